@@ -34,6 +34,8 @@
 #include "vphysics/constraints.h"
 #include "ragdoll_shared.h"
 #include "view.h"
+#include "iviewrender.h"
+#include "view_shared.h"
 #include "c_ai_basenpc.h"
 #include "c_entitydissolve.h"
 #include "saverestoretypes.h"
@@ -54,6 +56,7 @@
 #include "replay/replay_ragdoll.h"
 #include "studio_stats.h"
 #include "tier1/callqueue.h"
+#include "clientleafsystem.h"
 
 #ifdef TF_CLIENT_DLL
 #include "c_tf_player.h"
@@ -642,21 +645,6 @@ void C_ClientRagdoll::Release( void )
 // Incremented each frame in InvalidateModelBones. Models compare this value to what it
 // was last time they setup their bones to determine if they need to re-setup their bones.
 static unsigned long	g_iModelBoneCounter = 0;
-CUtlVector<C_BaseAnimating *> g_PreviousBoneSetups;
-static unsigned long	g_iPreviousBoneCounter = (unsigned)-1;
-
-class C_BaseAnimatingGameSystem : public CAutoGameSystem
-{
-	void LevelShutdownPostEntity()
-	{
-		g_iPreviousBoneCounter = (unsigned)-1;
-		if ( g_PreviousBoneSetups.Count() != 0 )
-		{
-			Msg( "%d entities in bone setup array. Should have been cleaned up by now\n", g_PreviousBoneSetups.Count() );
-			g_PreviousBoneSetups.RemoveAll();
-		}
-	}
-} g_BaseAnimatingGameSystem;
 
 
 //-----------------------------------------------------------------------------
@@ -686,9 +674,15 @@ C_BaseAnimating::C_BaseAnimating() :
 	AddBaseAnimatingInterpolatedVars();
 
 	m_iMostRecentModelBoneCounter = 0xFFFFFFFF;
-	m_iMostRecentBoneSetupRequest = g_iPreviousBoneCounter - 1;
+	m_iMostRecentBoneSetupRequest = g_iModelBoneCounter - 1;
 	m_flLastBoneSetupTime = -FLT_MAX;
 
+	m_nAnimLOD = 0;
+	m_nAnimLODFlags = 0;
+	m_nAnimLODFrame = -2;
+	m_nAnimLODSetupFrame = -1;
+	SetIdentityMatrix( m_AnimLODTransform );
+
 	m_vecPreRagdollMins = vec3_origin;
 	m_vecPreRagdollMaxs = vec3_origin;
 
@@ -741,9 +735,6 @@ C_BaseAnimating::C_BaseAnimating() :
 //-----------------------------------------------------------------------------
 C_BaseAnimating::~C_BaseAnimating()
 {
-	int i = g_PreviousBoneSetups.Find( this );
-	if ( i != -1 )
-		g_PreviousBoneSetups.FastRemove( i );
 	RemoveFromClientSideAnimationList();
 
 	TermRopes();
@@ -1495,7 +1486,8 @@ void C_BaseAnimating::BuildTransformations( CStudioHdr *hdr, Vector *pos, Quater
 			Assert( fabs( pos[i].z ) < 100000 );
 
 			if ( (hdr->boneFlags( i ) & BONE_ALWAYS_PROCEDURAL) && 
-				 (hdr->pBone( i )->proctype & STUDIO_PROC_JIGGLE) )
+				 (hdr->pBone( i )->proctype & STUDIO_PROC_JIGGLE) &&
+				 !IsAnimLODSkipping( ANIM_LOD_NO_JIGGLE ) )
 			{
 				//
 				// Physics-based "jiggle" bone
@@ -2641,56 +2633,221 @@ CMouthInfo *C_BaseAnimating::GetMouth( void )
 #ifdef DEBUG_BONE_SETUP_THREADING
 ConVar cl_warn_thread_contested_bone_setup("cl_warn_thread_contested_bone_setup", "0" );
 #endif
-ConVar cl_threaded_bone_setup("cl_threaded_bone_setup", "0", 0, "Enable parallel processing of C_BaseAnimating::SetupBones()" );
+ConVar cl_threaded_bone_setup("cl_threaded_bone_setup", "0", 0, "Set up the bones of the animating entities in each view on the job pool, right after the view's renderables list is built." );
+static ConVar cl_anim_lod( "cl_anim_lod", "0", 0, "Reduce bone setup work for animating entities that are small on screen." );
+static ConVar cl_anim_lod_scale( "cl_anim_lod_scale", "1", 0, "Scales the screen sizes at which cl_anim_lod drops a level; higher keeps full animation further away." );
 
 //-----------------------------------------------------------------------------
-// Purpose: Do the default sequence blending rules as done in HL1
+// Threaded bone setup: the animating entities a view is about to draw are set
+// up on the job pool. Move-parented entities stay on the main thread, since
+// bone merging and attachments make them read their parent's bones. Each
+// SetupBones holds the model cache lock only for its own
+// MDLCACHE_CRITICAL_SECTION.
 //-----------------------------------------------------------------------------
+static CUtlVector< C_BaseAnimating * > g_BoneSetupJobs;
+static bool g_bInThreadedBoneSetup;
 
 static void SetupBonesOnBaseAnimating( C_BaseAnimating *&pBaseAnimating )
 {
-	if ( !pBaseAnimating->GetMoveParent() )
-		pBaseAnimating->SetupBones( NULL, -1, -1, gpGlobals->curtime );
+	pBaseAnimating->SetupBones( NULL, -1, -1, gpGlobals->curtime );
 }
 
-static void PreThreadedBoneSetup()
+void C_BaseAnimating::InitBoneSetupThreadPool()
+{
+}				 
+
+void C_BaseAnimating::ShutdownBoneSetupThreadPool()
 {
-	mdlcache->BeginLock();
 }
 
-static void PostThreadedBoneSetup()
+//-----------------------------------------------------------------------------
+// Purpose: Adds this entity to the current threaded bone setup, once per frame.
+//-----------------------------------------------------------------------------
+void C_BaseAnimating::QueueThreadedBoneSetup()
 {
-	mdlcache->EndLock();
+	if ( m_iMostRecentBoneSetupRequest == g_iModelBoneCounter )
+		return;
+
+	if ( IsDormant() || GetSequence() == -1 || GetMoveParent() || m_CachedBoneData.Count() < 16 )
+		return;
+
+	m_iMostRecentBoneSetupRequest = g_iModelBoneCounter;
+	g_BoneSetupJobs.AddToTail( this );
 }
 
-static bool g_bInThreadedBoneSetup;
-static bool g_bDoThreadedBoneSetup;
+//-----------------------------------------------------------------------------
+// Purpose: Called on the main thread once a view's renderables list is built.
+//			Picks the animation LOD of the animating entities in it and, with
+//			cl_threaded_bone_setup, sets up their bones on the job pool.
+//-----------------------------------------------------------------------------
+void C_BaseAnimating::ThreadedBoneSetup( const CClientRenderablesList *pRenderList )
+{
+	bool bThreaded = cl_threaded_bone_setup.GetBool();
+	if ( !bThreaded && !cl_anim_lod.GetBool() )
+		return;
 
-void C_BaseAnimating::InitBoneSetupThreadPool()
+	VPROF_BUDGET( "C_BaseAnimating::ThreadedBoneSetup", VPROF_BUDGETGROUP_CLIENT_ANIMATION );
+
+	g_BoneSetupJobs.RemoveAll();
+	for ( int iGroup = 0; iGroup < RENDER_GROUP_COUNT; iGroup++ )
+	{
+		for ( int i = 0; i < pRenderList->m_RenderGroupCounts[iGroup]; i++ )
+		{
+			IClientUnknown *pUnknown = pRenderList->m_RenderGroups[iGroup][i].m_pRenderable->GetIClientUnknown();
+			C_BaseEntity *pEntity = pUnknown ? pUnknown->GetBaseEntity() : NULL;
+			C_BaseAnimating *pAnimating = pEntity ? pEntity->GetBaseAnimating() : NULL;
+			if ( pAnimating )
+			{
+				pAnimating->UpdateAnimLOD();
+
+				if ( bThreaded )
+				{
+					pAnimating->QueueThreadedBoneSetup();
+				}
+			}
+		}
+	}
+
+	int nCount = g_BoneSetupJobs.Count();
+	if ( nCount > 1 )
+	{
+		g_bInThreadedBoneSetup = true;
+
+		ParallelProcess( "C_BaseAnimating::ThreadedBoneSetup", g_BoneSetupJobs.Base(), nCount, &SetupBonesOnBaseAnimating );
+
+		g_bInThreadedBoneSetup = false;
+	}
+
+	g_BoneSetupJobs.RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+// Animation LOD.  Entities that are small on screen set their bones up every
+// few frames, moving the previous skeleton along with the entity in between,
+// and leave out IK, jiggle bones and flex.  Off by default until the levels
+// below have been tuned against the r_studio_stats counters.
+//
+// The level is picked on the main thread as each view's renderables list is
+// built, so SetupBones (which may run on a job thread) only reads it. A pick
+// from the previous frame still holds for bones set up before this frame's
+// first view; after that the entity gets full animation.
+//-----------------------------------------------------------------------------
+
+struct AnimLODLevel_t
 {
-}				 
+	float	m_flMinScreenSize;	// bounding radius over the half-width of the view at the entity's distance
+	int		m_nUpdateInterval;	// frames between full bone setups
+	int		m_nFlags;			// ANIM_LOD_ flags
+};
 
-void C_BaseAnimating::ShutdownBoneSetupThreadPool()
+static const AnimLODLevel_t s_AnimLODLevels[ANIM_LOD_COUNT] =
 {
-}
+	{ 0.15f,	1,	0 },
+	{ 0.06f,	1,	ANIM_LOD_NO_IK | ANIM_LOD_NO_JIGGLE },
+	{ 0.025f,	2,	ANIM_LOD_NO_IK | ANIM_LOD_NO_JIGGLE | ANIM_LOD_NO_FLEX | ANIM_LOD_TRIM_BONE_MASK },
+	{ 0.0f,		4,	ANIM_LOD_NO_IK | ANIM_LOD_NO_JIGGLE | ANIM_LOD_NO_FLEX | ANIM_LOD_TRIM_BONE_MASK },
+};
 
-void C_BaseAnimating::ThreadedBoneSetup()
+//-----------------------------------------------------------------------------
+// Purpose: Picks this frame's animation LOD from the entity's projected size.
+//			Main thread only.
+//-----------------------------------------------------------------------------
+void C_BaseAnimating::UpdateAnimLOD()
 {
-	g_bDoThreadedBoneSetup = cl_threaded_bone_setup.GetBool();
-	if ( g_bDoThreadedBoneSetup )
+	if ( m_nAnimLODFrame == gpGlobals->framecount )
+		return;
+
+	m_nAnimLODFrame = gpGlobals->framecount;
+	m_nAnimLOD = 0;
+	m_nAnimLODFlags = 0;
+
+	// Ragdolls, viewmodels and bone merged children need their bones every frame
+	if ( !cl_anim_lod.GetBool() || m_pRagdoll || IsViewModel() || IsEffectActive( EF_BONEMERGE ) || IsToolRecording() || cl_SetupAllBones.GetInt() )
+		return;
+
+	// Measure against the player's view even when bones are first set up for
+	// a monitor, shadow depth or reflection view earlier in the frame
+	const CViewSetup *pView = view->GetPlayerViewSetup();
+	float flTanHalfFOV = pView ? tanf( DEG2RAD( pView->fov * 0.5f ) ) : 0.0f;
+	if ( flTanHalfFOV <= 0.0f )
+		return;
+
+	Vector vecMins, vecMaxs;
+	GetRenderBounds( vecMins, vecMaxs );
+	float flRadius = 0.5f * ( vecMaxs - vecMins ).Length() * GetModelScale();
+	float flDist = ( GetRenderOrigin() - MainViewOrigin() ).Length();
+	if ( flDist <= flRadius )
+		return;
+
+	float flScreenSize = flRadius / ( flDist * flTanHalfFOV );
+	float flScale = cl_anim_lod_scale.GetFloat();
+	while ( m_nAnimLOD < ANIM_LOD_COUNT - 1 && flScreenSize < s_AnimLODLevels[m_nAnimLOD].m_flMinScreenSize * flScale )
 	{
-		int nCount = g_PreviousBoneSetups.Count();
-		if ( nCount > 1 )
-		{
-			g_bInThreadedBoneSetup = true;
+		m_nAnimLOD++;
+	}
+
+	m_nAnimLODFlags = s_AnimLODLevels[m_nAnimLOD].m_nFlags;
+	StudioStats_CountAnimLOD( m_nAnimLOD, ANIM_LOD_STAT_ENTITY );
+}
 
-			ParallelProcess( "C_BaseAnimating::ThreadedBoneSetup", g_PreviousBoneSetups.Base(), nCount, &SetupBonesOnBaseAnimating, &PreThreadedBoneSetup, &PostThreadedBoneSetup );
+//-----------------------------------------------------------------------------
+// Purpose: The animation LOD picked for this frame or the last one
+//-----------------------------------------------------------------------------
+int C_BaseAnimating::GetAnimLOD() const
+{
+	return ( gpGlobals->framecount - m_nAnimLODFrame <= 1 ) ? m_nAnimLOD : 0;
+}
 
-			g_bInThreadedBoneSetup = false;
+bool C_BaseAnimating::IsAnimLODSkipping( int nFlag ) const
+{
+	return ( gpGlobals->framecount - m_nAnimLODFrame <= 1 ) && ( m_nAnimLODFlags & nFlag ) != 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: On frames the animation LOD skips, moves last frame's bones along
+//			with the entity instead of setting them up again.
+// Output : Returns false if the bones need a full setup.
+//-----------------------------------------------------------------------------
+bool C_BaseAnimating::ReuseAnimLODBones()
+{
+	int nFramesSinceSetup = gpGlobals->framecount - m_nAnimLODSetupFrame;
+	if ( nFramesSinceSetup <= 0 || nFramesSinceSetup >= s_AnimLODLevels[ GetAnimLOD() ].m_nUpdateInterval )
+		return false;
+
+	int nReadableBones = m_BoneAccessor.GetReadableBones();
+	if ( !nReadableBones || Teleported() || IsNoInterpolationFrame() )
+		return false;
+
+	MDLCACHE_CRITICAL_SECTION();
+
+	CStudioHdr *hdr = GetModelPtr();
+	if ( !hdr || ( hdr->flags() & STUDIOHDR_FLAGS_STATIC_PROP ) )
+		return false;
+
+	matrix3x4_t parentTransform, invTransform, delta;
+	AngleMatrix( GetRenderAngles(), GetRenderOrigin(), parentTransform );
+	MatrixInvert( m_AnimLODTransform, invTransform );
+	ConcatTransforms( parentTransform, invTransform, delta );
+
+	matrix3x4_t *pBones = m_BoneAccessor.GetBoneArrayForWrite();
+	for ( int i = 0; i < hdr->numbones(); i++ )
+	{
+		if ( hdr->boneFlags( i ) & nReadableBones )
+		{
+			matrix3x4_t bone;
+			MatrixCopy( pBones[i], bone );
+			ConcatTransforms( delta, bone, pBones[i] );
 		}
 	}
-	g_iPreviousBoneCounter++;
-	g_PreviousBoneSetups.RemoveAll();
+	MatrixCopy( parentTransform, m_AnimLODTransform );
+
+	if ( nReadableBones & BONE_USED_BY_ATTACHMENT )
+	{
+		SetupBones_AttachmentHelper( hdr );
+	}
+
+	StudioStats_CountAnimLOD( GetAnimLOD(), ANIM_LOD_STAT_REUSED );
+	return true;
 }
 
 bool C_BaseAnimating::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, int boneMask, float currentTime )
@@ -2775,7 +2932,7 @@ bool C_BaseAnimating::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, i
 	{
 		// Clear out which bones we've touched this frame if this is 
 		// the first time we've seen this object this frame.
-		if ( LastBoneChangedTime() >= m_flLastBoneSetupTime )
+		if ( LastBoneChangedTime() >= m_flLastBoneSetupTime && !ReuseAnimLODBones() )
 		{
 			m_BoneAccessor.SetReadableBones( 0 );
 			m_BoneAccessor.SetWritableBones( 0 );
@@ -2784,6 +2941,12 @@ bool C_BaseAnimating::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, i
 		m_iPrevBoneMask = m_iAccumulatedBoneMask;
 		m_iAccumulatedBoneMask = 0;
 
+		if ( IsAnimLODSkipping( ANIM_LOD_TRIM_BONE_MASK ) )
+		{
+			// Only the vertex LOD the renderer asks for this frame
+			m_iPrevBoneMask &= ~BONE_USED_BY_VERTEX_MASK;
+		}
+
 #ifdef STUDIO_ENABLE_PERF_COUNTERS
 		CStudioHdr *hdr = GetModelPtr();
 		if (hdr)
@@ -2793,14 +2956,6 @@ bool C_BaseAnimating::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, i
 #endif
 	}
 
-	int nBoneCount = m_CachedBoneData.Count();
-	if ( g_bDoThreadedBoneSetup && !g_bInThreadedBoneSetup && ( nBoneCount >= 16 ) && !GetMoveParent() && m_iMostRecentBoneSetupRequest != g_iPreviousBoneCounter )
-	{
-		m_iMostRecentBoneSetupRequest = g_iPreviousBoneCounter;
-		Assert( g_PreviousBoneSetups.Find( this ) == -1 );
-		g_PreviousBoneSetups.AddToTail( this );
-	}
-
 	// Keep track of everthing asked for over the entire frame
 	m_iAccumulatedBoneMask |= boneMask;
 
@@ -2888,7 +3043,7 @@ bool C_BaseAnimating::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, i
 
 			CBoneBitList boneComputed;
 			// don't calculate IK on ragdolls
-			if ( m_pIk && !IsRagdoll() )
+			if ( m_pIk && !IsRagdoll() && !IsAnimLODSkipping( ANIM_LOD_NO_IK ) )
 			{
 				UpdateIKLocks( currentTime );
 
@@ -2902,6 +3057,10 @@ bool C_BaseAnimating::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, i
 			
 			RemoveFlag( EFL_SETTING_UP_BONES );
 			ControlMouth( hdr );
+
+			m_nAnimLODSetupFrame = gpGlobals->framecount;
+			MatrixCopy( parentTransform, m_AnimLODTransform );
+			StudioStats_CountAnimLOD( GetAnimLOD(), ANIM_LOD_STAT_SETUP );
 		}
 		
 		if( !( oldReadableBones & BONE_USED_BY_ATTACHMENT ) && ( boneMask & BONE_USED_BY_ATTACHMENT ) )
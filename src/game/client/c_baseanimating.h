@@ -46,12 +46,25 @@ class CBoneBitList;
 class CBoneList;
 class KeyValues;
 class CJiggleBones;
+class CClientRenderablesList;
 class IBoneSetup;
 FORWARD_DECLARE_HANDLE( memhandle_t );
 typedef unsigned short MDLHandle_t;
 
 extern ConVar vcollide_wireframe;
 
+// Animation LOD levels picked from screen size (see cl_anim_lod)
+#define ANIM_LOD_COUNT			4
+
+// What an animation LOD level leaves out
+enum
+{
+	ANIM_LOD_NO_IK				= 0x1,	// don't solve IK chains
+	ANIM_LOD_NO_JIGGLE			= 0x2,	// treat jiggle bones as regular bones
+	ANIM_LOD_NO_FLEX			= 0x4,	// leave facial flexes at rest
+	ANIM_LOD_TRIM_BONE_MASK		= 0x8,	// don't carry last frame's vertex bones over to this frame
+};
+
 
 struct ClientModelRenderInfo_t : public ModelRenderInfo_t
 {
@@ -384,6 +397,10 @@ public:
 	bool							IsBoneCacheValid() const;	// Returns true if the bone cache is considered good for this frame.
 	void							GetCachedBoneMatrix( int boneIndex, matrix3x4_t &out );
 
+	// Animation LOD picked when this frame's (or last frame's) views were built
+	int								GetAnimLOD() const;
+	bool							IsAnimLODSkipping( int nFlag ) const;
+
 	// Wrappers for CBoneAccessor.
 	const matrix3x4_t&				GetBone( int iBone ) const;
 	matrix3x4_t&					GetBoneForWrite( int iBone );
@@ -399,7 +416,7 @@ public:
 	};
 	static void						PushAllowBoneAccess( bool bAllowForNormalModels, bool bAllowForViewModels, char const *tagPush );
 	static void						PopBoneAccess( char const *tagPop );
-	static void						ThreadedBoneSetup();
+	static void						ThreadedBoneSetup( const CClientRenderablesList *pRenderList );
 	static void						InitBoneSetupThreadPool();
 	static void						ShutdownBoneSetupThreadPool();
 
@@ -602,10 +619,21 @@ private:
 	float							m_flLastBoneSetupTime;
 	CJiggleBones					*m_pJiggleBones;
 
+	// Animation LOD
+	int								m_nAnimLOD;
+	int								m_nAnimLODFlags;
+	int								m_nAnimLODFrame;		// framecount m_nAnimLOD was picked in
+	int								m_nAnimLODSetupFrame;	// framecount of the last full bone setup
+	matrix3x4_t						m_AnimLODTransform;		// entity transform the cached bones were built or moved with
+
+	void							UpdateAnimLOD();
+	bool							ReuseAnimLODBones();
+
 	// Calculated attachment points
 	CUtlVector<CAttachmentData>		m_Attachments;
 
 	void							SetupBones_AttachmentHelper( CStudioHdr *pStudioHdr );
+	void							QueueThreadedBoneSetup();
 
 	EHANDLE							m_hLightingOrigin;
 	EHANDLE							m_hLightingOriginRelative;
@@ -1151,6 +1151,18 @@ void C_BaseFlex::SetupWeights( const matrix3x4_t *pBoneToWorld, int nFlexWeightC
 	LinkToGlobalFlexControllers( GetModelPtr() );
 	m_iBlink = AddGlobalFlexController( "UH" );
 
+	// Too small on screen for facial animation to show
+	if ( IsAnimLODSkipping( ANIM_LOD_NO_FLEX ) )
+	{
+		int nSizeInBytes = nFlexWeightCount * sizeof( float );
+		memset( pFlexWeights, 0, nSizeInBytes );
+		if ( pFlexDelayedWeights )
+		{
+			memset( pFlexDelayedWeights, 0, nSizeInBytes );
+		}
+		return;
+	}
+
 	if ( SetupGlobalWeights( pBoneToWorld, nFlexWeightCount, pFlexWeights, pFlexDelayedWeights ) )
 	{
 		SetupLocalWeights( pBoneToWorld, nFlexWeightCount, pFlexWeights, pFlexDelayedWeights );
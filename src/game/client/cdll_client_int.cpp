@@ -2204,8 +2204,6 @@ void OnRenderStart()
 	SimulateEntities();
 	PhysicsSimulate();
 
-	C_BaseAnimating::ThreadedBoneSetup();
-
 	{
 		VPROF_("Client TempEnts", 0, VPROF_BUDGETGROUP_CLIENT_SIM, false, BUDGETFLAG_CLIENT);
 		// This creates things like temp entities.
@@ -6,6 +6,7 @@
 
 #include "cbase.h"
 #include "interpolatedvar.h"
+#include "mathlib/ssemath.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -25,6 +26,26 @@ float CInterpolationContext::s_flLastTimeStamp = 0;
 
 float g_flLastPacketTimestamp = 0;
 
+//-----------------------------------------------------------------------------
+// Same math as Lerp(): start + ( end - start ) * frac
+//-----------------------------------------------------------------------------
+bool InterpolatedVarLerpArray( float *pOut, const float *pStart, const float *pEnd, int nCount, float flFrac )
+{
+	fltx4 frac = ReplicateX4( flFrac );
+	int i = 0;
+	for ( ; i + 4 <= nCount; i += 4 )
+	{
+		fltx4 start = LoadUnalignedSIMD( pStart + i );
+		fltx4 end = LoadUnalignedSIMD( pEnd + i );
+		StoreUnalignedSIMD( pOut + i, MaddSIMD( SubSIMD( end, start ), frac, start ) );
+	}
+	for ( ; i < nCount; i++ )
+	{
+		pOut[i] = Lerp( flFrac, pStart[i], pEnd[i] );
+	}
+	return true;
+}
+
 
 ConVar cl_extrapolate_amount( "cl_extrapolate_amount", "0.25", FCVAR_CHEAT, "Set how many seconds the client will extrapolate entities for." );
 
@@ -428,6 +428,19 @@ private:
 	unsigned short m_growSize;
 };
 
+// -------------------------------------------------------------------------------------------------------------- //
+// InterpolatedVarLerpArray - straight linear interpolation of a whole array.  Float arrays (pose parameters, bone
+// controllers, flex weights) are done four at a time; other types return false and are lerped one by one.  Each var
+// is still lerped on its own as its entity interpolates; histories aren't shared across entities.
+// -------------------------------------------------------------------------------------------------------------- //
+template< class T >
+inline bool InterpolatedVarLerpArray( T *pOut, const T *pStart, const T *pEnd, int nCount, float flFrac )
+{
+	return false;
+}
+
+bool InterpolatedVarLerpArray( float *pOut, const float *pStart, const float *pEnd, int nCount, float flFrac );
+
 // -------------------------------------------------------------------------------------------------------------- //
 // CInterpolatedVarArrayBase - the main implementation of IInterpolatedVar.
 // -------------------------------------------------------------------------------------------------------------- //
@@ -572,6 +585,7 @@ protected:
 	float								m_InterpolationAmount;
 	const char *						m_pDebugName;
 	bool								m_bDebug : 1;
+	bool								m_bAnyLooping : 1;
 };
 
 
@@ -587,6 +601,7 @@ inline CInterpolatedVarArrayBase<Type, IS_ARRAY>::CInterpolatedVarArrayBase( con
 	m_LastNetworkedValue = NULL;
 	m_bLooping = NULL;
 	m_bDebug = false;
+	m_bAnyLooping = false;
 }
 
 template< typename Type, bool IS_ARRAY >
@@ -1180,6 +1195,7 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::Copy( IInterpolatedVar *p
 		m_LastNetworkedValue[i] = pSrc->m_LastNetworkedValue[i];
 		m_bLooping[i] = pSrc->m_bLooping[i];
 	}
+	m_bAnyLooping = pSrc->m_bAnyLooping;
 
 	m_LastNetworkedTime = pSrc->m_LastNetworkedTime;
 
@@ -1273,6 +1289,16 @@ inline void	CInterpolatedVarArrayBase<Type, IS_ARRAY>::SetLooping( bool looping,
 {
 	Assert( iArrayIndex >= 0 && iArrayIndex < m_nMaxCount );
 	m_bLooping[ iArrayIndex ] = looping;
+
+	m_bAnyLooping = false;
+	for ( int i = 0; i < m_nMaxCount; i++ )
+	{
+		if ( m_bLooping[i] )
+		{
+			m_bAnyLooping = true;
+			break;
+		}
+	}
 }
 
 template< typename Type, bool IS_ARRAY >
@@ -1293,6 +1319,7 @@ inline void	CInterpolatedVarArrayBase<Type, IS_ARRAY>::SetMaxCount( int newmax )
 		m_LastNetworkedValue = new Type[m_nMaxCount];
 		memset( m_bLooping, 0, sizeof(byte) * m_nMaxCount);
 		memset( m_LastNetworkedValue, 0, sizeof(Type) * m_nMaxCount);
+		m_bAnyLooping = false;
 
 		Reset();
 	}
@@ -1325,6 +1352,10 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::_Interpolate( Type *out,
 
 	Assert( frac >= 0.0f && frac <= 1.0f );
 
+	// Nothing loops, so float arrays can take the wide path
+	if ( m_nMaxCount >= 4 && !m_bAnyLooping && InterpolatedVarLerpArray( out, start->GetValue(), end->GetValue(), m_nMaxCount, frac ) )
+		return;
+
 	// Note that QAngle has a specialization that will do quaternion interpolation here...
 	for ( int i = 0; i < m_nMaxCount; i++ )
 	{
@@ -10,6 +10,7 @@
 #include <vgui_controls/EditablePanel.h>
 #include <mathlib/mathlib.h>
 #include "view.h"
+#include "c_baseanimating.h"
 #include "studio_stats.h"
 #include "coordsize.h"
 #include "collisionutils.h"
@@ -71,7 +72,48 @@ private:
 };
 
 
-void StudioStats_FindClosestEntity( CClientRenderablesList *pClientRenderablesList )
+//-----------------------------------------------------------------------------
+// Animation LOD counters.  Bone setup runs on the job pool, hence the interlocked
+// counts; they're printed and cleared once per frame.
+//-----------------------------------------------------------------------------
+static CInterlockedInt s_AnimLODStats[ANIM_LOD_COUNT][ANIM_LOD_STAT_COUNT];
+
+// The engine's r_studio_stats overlay owns the notify rows above this one
+#define ANIM_LOD_STATS_FIRST_LINE	40
+
+void StudioStats_CountAnimLOD( int nLOD, AnimLODStat_t stat )
+{
+	if ( r_studio_stats.GetBool() )
+	{
+		++s_AnimLODStats[nLOD][stat];
+	}
+}
+
+static void StudioStats_ReportAnimLOD()
+{
+	if ( r_studio_stats.GetBool() == false )
+		return;
+
+	C_BaseEntity *pEntity = g_pStudioStatsEntity ? g_pStudioStatsEntity->GetIClientUnknown()->GetBaseEntity() : NULL;
+	C_BaseAnimating *pAnimating = pEntity ? pEntity->GetBaseAnimating() : NULL;
+	if ( pAnimating )
+	{
+		engine->Con_NPrintf( ANIM_LOD_STATS_FIRST_LINE, "anim lod: %d", pAnimating->GetAnimLOD() );
+	}
+
+	for ( int i = 0; i < ANIM_LOD_COUNT; i++ )
+	{
+		engine->Con_NPrintf( ANIM_LOD_STATS_FIRST_LINE + 1 + i, "anim lod %d: %3d entities, %3d setups, %3d reused", i,
+			(int)s_AnimLODStats[i][ANIM_LOD_STAT_ENTITY], (int)s_AnimLODStats[i][ANIM_LOD_STAT_SETUP], (int)s_AnimLODStats[i][ANIM_LOD_STAT_REUSED] );
+
+		for ( int j = 0; j < ANIM_LOD_STAT_COUNT; j++ )
+		{
+			s_AnimLODStats[i][j] = 0;
+		}
+	}
+}
+
+static void StudioStats_FindClosestEntityInternal()
 {
 	if ( r_studio_stats_lock.GetBool() )
 		return;
@@ -137,3 +179,9 @@ void StudioStats_FindClosestEntity( CClientRenderablesList *pClientRenderablesLi
 		}
 	}
 }
+
+void StudioStats_FindClosestEntity( CClientRenderablesList *pClientRenderablesList )
+{
+	StudioStats_FindClosestEntityInternal();
+	StudioStats_ReportAnimLOD();
+}
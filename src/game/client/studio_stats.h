@@ -13,6 +13,18 @@
 
 void StudioStats_FindClosestEntity( CClientRenderablesList *pClientRenderablesList );
 
+// Per animation LOD counters, shown while r_studio_stats is on
+enum AnimLODStat_t
+{
+	ANIM_LOD_STAT_ENTITY = 0,	// entities at this LOD
+	ANIM_LOD_STAT_SETUP,		// full bone setups
+	ANIM_LOD_STAT_REUSED,		// frames that moved the previous bones instead
+
+	ANIM_LOD_STAT_COUNT,
+};
+
+void StudioStats_CountAnimLOD( int nLOD, AnimLODStat_t stat );
+
 extern IClientRenderable	*g_pStudioStatsEntity;
 
 
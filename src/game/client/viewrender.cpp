@@ -3298,6 +3298,8 @@ void CRendering3dView::SetupRenderablesList( int viewID )
 		setupInfo.m_flRenderDistSq *= setupInfo.m_flRenderDistSq;
 
 		ClientLeafSystem()->BuildRenderablesList( setupInfo );
+
+		C_BaseAnimating::ThreadedBoneSetup( m_pRenderablesList );
 	}
 }
 
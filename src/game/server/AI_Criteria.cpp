@@ -111,6 +111,22 @@ int AI_CriteriaSet::FindCriterionIndex( const char *name ) const
 	return idx;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Same as above for a name that's already been added to the symbol table
+// Input  : name - 
+// Output : int
+//-----------------------------------------------------------------------------
+int AI_CriteriaSet::FindCriterionIndex( CUtlSymbol name ) const
+{
+	CritEntry_t search;
+	search.criterianame = name;
+	int idx = m_Lookup.Find( search );
+	if ( idx == m_Lookup.InvalidIndex() )
+		return -1;
+
+	return idx;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 // Input  : index - 
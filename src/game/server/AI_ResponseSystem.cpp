@@ -22,6 +22,8 @@
 #include "stringpool.h"
 #include "fmtstr.h"
 #include "multiplay_gamerules.h"
+#include "tier0/fasttimer.h"
+#include "checksum_crc.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -29,6 +31,21 @@
 ConVar rr_debugresponses( "rr_debugresponses", "0", FCVAR_NONE, "Show verbose matching output (1 for simple, 2 for rule scoring). If set to 3, it will only show response success/failure for npc_selected NPCs." );
 ConVar rr_debugrule( "rr_debugrule", "", FCVAR_NONE, "If set to the name of the rule, that rule's score will be shown whenever a concept is passed into the response rules system.");
 ConVar rr_dumpresponses( "rr_dumpresponses", "0", FCVAR_NONE, "Dump all response_rules.txt and rules (requires restart)" );
+ConVar rr_index_rules( "rr_index_rules", "1", FCVAR_NONE, "Only score rules whose required concept (or other required equality criterion) matches the query" );
+
+ConVar rr_compiled_rules( "rr_compiled_rules", "1", FCVAR_NONE, "Load response rules from the compiled .rrc file when it matches the source scripts, and write one after parsing the scripts" );
+
+#define RR_QUERY_LOG_FILE	"rr_querylog.txt"
+
+// Compiled rule sets are the parsed dictionaries of a script and everything it
+// #includes, stored with the CRCs of those scripts so edits force a re-parse,
+// and with a CRC of the compiled data itself to catch damaged files
+#define RR_COMPILED_ID			(('C'<<24)+('R'<<16)+('R'<<8)+'R')
+#define RR_COMPILED_VERSION		2
+#define RR_COMPILED_EXTENSION	".rrc"
+
+// Number of queries left to append to the query log (see rr_capture_queries)
+static int g_nQueriesToCapture = 0;
 
 static CUtlSymbolTable g_RS;
 
@@ -403,6 +420,7 @@ struct Criteria
 			return *this;
 
 		name = CopyString( src.name );
+		nameSymbol = src.nameSymbol;
 		value = CopyString( src.value );
 		weight = src.weight;
 		required = src.required;
@@ -420,6 +438,7 @@ struct Criteria
 	Criteria(const Criteria& src )
 	{
 		name = CopyString( src.name );
+		nameSymbol = src.nameSymbol;
 		value = CopyString( src.value );
 		weight = src.weight;
 		required = src.required;
@@ -443,7 +462,18 @@ struct Criteria
 		return ( subcriteria.Count() > 0 ) ? true : false;
 	}
 
+	// Name as a symbol, so looking it up in a criteria set skips the string table
+	CUtlSymbol GetNameSymbol()
+	{
+		if ( !nameSymbol.IsValid() )
+		{
+			nameSymbol = name;
+		}
+		return nameSymbol;
+	}
+
 	char						*name;
+	CUtlSymbol					nameSymbol;
 	char						*value;
 	float16						weight;
 	bool						required;
@@ -683,11 +713,28 @@ public:
 	float		LookupEnumeration( const char *name, bool& found );
 
 	int			FindBestMatchingRule( const AI_CriteriaSet& set, bool verbose );
+	float		FindBestMatchingRules( const AI_CriteriaSet& set, CUtlVector< int >& bestrules, bool bUseIndex, bool verbose = false, int *pScored = NULL );
+
+	// Rules are bucketed by the value of one required equality criterion (preferably
+	// "concept"), so a query only scores rules that could possibly match it
+	struct RuleIndexField_t
+	{
+		CUtlSymbol				name;
+		CUtlDict< int, int >	values;		// criterion value -> index into m_RuleIndexBuckets
+	};
+
+	void		InvalidateRuleIndex();
+	void		BuildRuleIndex();
+	bool		IsRuleIndexValid() const { return m_nIndexedRules == m_Rules.Count(); }
+	int			GetRuleIndexCriterion( Rule *rule );
+	void		GatherCandidateRules( const AI_CriteriaSet& set, CUtlVector< unsigned short >& candidates );
 
 	float		ScoreCriteriaAgainstRule( const AI_CriteriaSet& set, int irule, bool verbose = false );
 	float		RecursiveScoreSubcriteriaAgainstRule( const AI_CriteriaSet& set, Criteria *parent, bool& exclude, bool verbose /*=false*/ );
 	float		ScoreCriteriaAgainstRuleCriteria( const AI_CriteriaSet& set, int icriterion, bool& exclude, bool verbose = false );
 	bool		GetBestResponse( ResponseSearchResult& result, Rule *rule, bool verbose = false, IResponseFilter *pFilter = NULL );
+	void		CaptureQuery( const AI_CriteriaSet& set );
+	void		BenchmarkQueries( int iterations );
 	bool		ResolveResponse( ResponseSearchResult& result, int depth, const char *name, bool verbose = false, IResponseFilter *pFilter = NULL );
 	int			SelectWeightedResponseFromResponseGroup( ResponseGroup *g, IResponseFilter *pFilter );
 	void		DescribeResponseGroup( ResponseGroup *group, int selected, int depth );
@@ -695,6 +742,17 @@ public:
 
 	void		LoadFromBuffer( const char *scriptfile, const char *buffer, CStringPool &includedFiles );
 
+	struct CompiledSource_t
+	{
+		FileNameHandle_t	name;
+		CRC32_t				crc;
+	};
+
+	void		GetCompiledRuleSetName( const char *basescript, char *out, int outlen );
+	bool		LoadCompiledRuleSet( const char *basescript );
+	bool		ValidateCompiledRuleSet();
+	void		SaveCompiledRuleSet( const char *basescript );
+
 	void		GetCurrentScript( char *buf, size_t buflen );
 	int			GetCurrentToken() const;
 	void		SetCurrentScript( const char *script );
@@ -710,6 +768,14 @@ public:
 	CUtlDict< Rule, short >	m_Rules;
 	CUtlDict< Enumeration, short > m_Enumerations;
 
+	CUtlVector< RuleIndexField_t * >				m_RuleIndexFields;
+	CUtlVector< CUtlVector< unsigned short > >	m_RuleIndexBuckets;
+	CUtlVector< unsigned short >					m_UnindexedRules;
+	int											m_nIndexedRules;	// m_Rules.Count() when the index was built, -1 if not built
+	CUtlVector< unsigned short >					m_CandidateRules;	// scratch for FindBestMatchingRules
+
+	CUtlVector< CompiledSource_t >	m_CompiledSources;	// scripts the current dictionaries were loaded from
+
 	char		token[ 1204 ];
 
 	bool		m_bUnget;
@@ -762,6 +828,7 @@ CResponseSystem::CResponseSystem()
 	m_bUnget = false;
 	m_bPrecache = true;
 	m_bCustomManagable = false;
+	m_nIndexedRules = -1;
 }
 
 //-----------------------------------------------------------------------------
@@ -769,6 +836,7 @@ CResponseSystem::CResponseSystem()
 //-----------------------------------------------------------------------------
 CResponseSystem::~CResponseSystem()
 {
+	InvalidateRuleIndex();
 }
 
 //-----------------------------------------------------------------------------
@@ -816,6 +884,7 @@ void CResponseSystem::Clear()
 	m_Responses.RemoveAll();
 	m_Criteria.RemoveAll();
 	m_Rules.RemoveAll();
+	InvalidateRuleIndex();
 	m_Enumerations.RemoveAll();
 }
 
@@ -1164,7 +1233,7 @@ float CResponseSystem::ScoreCriteriaAgainstRuleCriteria( const AI_CriteriaSet& s
 
 	const char *actualValue = "";
 
-	int found = set.FindCriterionIndex( c->name );
+	int found = ( c->name ) ? set.FindCriterionIndex( c->GetNameSymbol() ) : -1;
 	if ( found != -1 )
 	{
 		actualValue = set.GetValue( found );
@@ -1685,27 +1754,12 @@ bool CResponseSystem::GetBestResponse( ResponseSearchResult& searchResult, Rule
 int CResponseSystem::FindBestMatchingRule( const AI_CriteriaSet& set, bool verbose )
 {
 	CUtlVector< int >	bestrules;
-	float bestscore = 0.001f;
 
-	int c = m_Rules.Count();
-	int i;
-	for ( i = 0; i < c; i++ )
-	{
-		float score = ScoreCriteriaAgainstRule( set, i, verbose );
-		// Check equals so that we keep track of all matching rules
-		if ( score >= bestscore )
-		{
-			// Reset bucket
-			if( score != bestscore )
-			{
-				bestscore = score;
-				bestrules.RemoveAll();
-			}
+	// Score everything when debugging so every rule gets reported
+	const char *pszDebugRule = rr_debugrule.GetString();
+	bool bUseIndex = rr_index_rules.GetBool() && !verbose && !( pszDebugRule && pszDebugRule[0] );
 
-			// Add to bucket
-			bestrules.AddToTail( i );
-		}
-	}
+	FindBestMatchingRules( set, bestrules, bUseIndex, verbose );
 
 	int bestCount = bestrules.Count();
 	if ( bestCount <= 0 )
@@ -1723,6 +1777,210 @@ int CResponseSystem::FindBestMatchingRule( const AI_CriteriaSet& set, bool verbo
 	return bestrules[ idx ];
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Collects the highest scoring rules
+// Input  : set - 
+//			bestrules - receives the indices of all rules tied for the best score
+//			bUseIndex - only score the candidate rules from the rule index
+//			*pScored - if not NULL, receives the number of rules scored
+// Output : float - the best score
+//-----------------------------------------------------------------------------
+static void AddRuleScore( int irule, float score, float& bestscore, CUtlVector< int >& bestrules )
+{
+	// Check equals so that we keep track of all matching rules
+	if ( score >= bestscore )
+	{
+		// Reset bucket
+		if( score != bestscore )
+		{
+			bestscore = score;
+			bestrules.RemoveAll();
+		}
+
+		// Add to bucket
+		bestrules.AddToTail( irule );
+	}
+}
+
+float CResponseSystem::FindBestMatchingRules( const AI_CriteriaSet& set, CUtlVector< int >& bestrules, bool bUseIndex, bool verbose /*=false*/, int *pScored /*=NULL*/ )
+{
+	float bestscore = 0.001f;
+	bestrules.RemoveAll();
+
+	if ( bUseIndex )
+	{
+		if ( !IsRuleIndexValid() )
+		{
+			BuildRuleIndex();
+		}
+
+		CUtlVector< unsigned short > &candidates = m_CandidateRules;
+		candidates.RemoveAll();
+		GatherCandidateRules( set, candidates );
+
+		int c = candidates.Count();
+		for ( int i = 0; i < c; i++ )
+		{
+			AddRuleScore( candidates[ i ], ScoreCriteriaAgainstRule( set, candidates[ i ], verbose ), bestscore, bestrules );
+		}
+
+		if ( pScored )
+		{
+			*pScored = c;
+		}
+	}
+	else
+	{
+		int c = m_Rules.Count();
+		for ( int i = 0; i < c; i++ )
+		{
+			AddRuleScore( i, ScoreCriteriaAgainstRule( set, i, verbose ), bestscore, bestrules );
+		}
+
+		if ( pScored )
+		{
+			*pScored = c;
+		}
+	}
+
+	return bestscore;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Picks the criterion a rule is bucketed under in the rule index: a
+//			required, plain string equality test, preferably on "concept"
+// Input  : *rule - 
+// Output : int - criterion index, or -1 if the rule must always be scored
+//-----------------------------------------------------------------------------
+int CResponseSystem::GetRuleIndexCriterion( Rule *rule )
+{
+	int best = -1;
+
+	int c = rule->m_Criteria.Count();
+	for ( int i = 0; i < c; i++ )
+	{
+		int icriterion = rule->m_Criteria[ i ];
+		Criteria *crit = &m_Criteria[ icriterion ];
+		if ( crit->IsSubCriteriaType() || !crit->required || !crit->name )
+			continue;
+
+		// Only values that must compare equal as strings
+		Matcher &m = crit->matcher;
+		if ( !m.valid || m.isnumeric || m.notequal || m.usemin || m.usemax )
+			continue;
+
+		// An empty value would match a criterion missing from the query
+		if ( !m.GetToken()[0] )
+			continue;
+
+		if ( !Q_stricmp( crit->name, "concept" ) )
+			return icriterion;
+
+		if ( best == -1 )
+		{
+			best = icriterion;
+		}
+	}
+
+	return best;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: 
+//-----------------------------------------------------------------------------
+void CResponseSystem::InvalidateRuleIndex()
+{
+	m_RuleIndexFields.PurgeAndDeleteElements();
+	m_RuleIndexBuckets.Purge();
+	m_UnindexedRules.Purge();
+	m_nIndexedRules = -1;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Buckets the rules by the value of their index criterion
+//-----------------------------------------------------------------------------
+void CResponseSystem::BuildRuleIndex()
+{
+	InvalidateRuleIndex();
+
+	int c = m_Rules.Count();
+	for ( int i = 0; i < c; i++ )
+	{
+		int icriterion = GetRuleIndexCriterion( &m_Rules[ i ] );
+		if ( icriterion == -1 )
+		{
+			m_UnindexedRules.AddToTail( i );
+			continue;
+		}
+
+		Criteria *crit = &m_Criteria[ icriterion ];
+		CUtlSymbol name = crit->GetNameSymbol();
+
+		RuleIndexField_t *pField = NULL;
+		for ( int j = 0; j < m_RuleIndexFields.Count(); j++ )
+		{
+			if ( m_RuleIndexFields[ j ]->name == name )
+			{
+				pField = m_RuleIndexFields[ j ];
+				break;
+			}
+		}
+
+		if ( !pField )
+		{
+			pField = new RuleIndexField_t;
+			pField->name = name;
+			m_RuleIndexFields.AddToTail( pField );
+		}
+
+		const char *value = crit->matcher.GetToken();
+		int iValue = pField->values.Find( value );
+		if ( iValue == pField->values.InvalidIndex() )
+		{
+			iValue = pField->values.Insert( value, m_RuleIndexBuckets.AddToTail() );
+		}
+
+		m_RuleIndexBuckets[ pField->values[ iValue ] ].AddToTail( i );
+	}
+
+	m_nIndexedRules = c;
+
+	DevMsg( 2, "CResponseSystem:  indexed %i rules on %i criteria (%i buckets, %i unindexed)\n",
+		c, m_RuleIndexFields.Count(), m_RuleIndexBuckets.Count(), m_UnindexedRules.Count() );
+}
+
+static int __cdecl CompareRuleIndices( const unsigned short *lhs, const unsigned short *rhs )
+{
+	return (int)*lhs - (int)*rhs;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Gathers the rules that could match the criteria set, in rule order
+//-----------------------------------------------------------------------------
+void CResponseSystem::GatherCandidateRules( const AI_CriteriaSet& set, CUtlVector< unsigned short >& candidates )
+{
+	candidates.AddVectorToTail( m_UnindexedRules );
+
+	int c = m_RuleIndexFields.Count();
+	for ( int i = 0; i < c; i++ )
+	{
+		RuleIndexField_t *pField = m_RuleIndexFields[ i ];
+
+		int found = set.FindCriterionIndex( pField->name );
+		if ( found == -1 )
+			continue;
+
+		int iValue = pField->values.Find( set.GetValue( found ) );
+		if ( iValue != pField->values.InvalidIndex() )
+		{
+			candidates.AddVectorToTail( m_RuleIndexBuckets[ pField->values[ iValue ] ] );
+		}
+	}
+
+	// Keep rule order so ties are broken the same way as a full scan
+	candidates.Sort( CompareRuleIndices );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 // Input  : set - 
@@ -1736,6 +1994,11 @@ bool CResponseSystem::FindBestResponse( const AI_CriteriaSet& set, AI_Response&
 	bool showRules = ( iDbgResponse == 2 );
 	bool showResult = ( iDbgResponse == 1 || iDbgResponse == 2 );
 
+	if ( g_nQueriesToCapture > 0 )
+	{
+		CaptureQuery( set );
+	}
+
 	// Look for match. verbose mode used to be at level 2, but disabled because the writers don't actually care for that info.
 	int bestRule = FindBestMatchingRule( set, iDbgResponse == 3 ); 
 
@@ -1924,6 +2187,10 @@ void CResponseSystem::LoadFromBuffer( const char *scriptfile, const char *buffer
 	includedFiles.Allocate( scriptfile );
 	PushScript( scriptfile, (unsigned char * )buffer );
 
+	CompiledSource_t &source = m_CompiledSources[ m_CompiledSources.AddToTail() ];
+	source.name = m_ScriptStack[ 0 ].name;
+	source.crc = CRC32_ProcessSingleBuffer( buffer, Q_strlen( buffer ) );
+
 	if( rr_dumpresponses.GetBool() )
 	{
 		DevMsg("Reading: %s\n", scriptfile );
@@ -1989,6 +2256,14 @@ void CResponseSystem::LoadFromBuffer( const char *scriptfile, const char *buffer
 //-----------------------------------------------------------------------------
 void CResponseSystem::LoadRuleSet( const char *basescript )
 {
+	// Compiled files hold dictionary indices, so they only describe a system loaded from scratch
+	bool bEmpty = !m_Responses.Count() && !m_Criteria.Count() && !m_Rules.Count() && !m_Enumerations.Count();
+	if ( bEmpty && rr_compiled_rules.GetBool() && LoadCompiledRuleSet( basescript ) )
+	{
+		BuildRuleIndex();
+		return;
+	}
+
 	int length = 0;
 	unsigned char *buffer = (unsigned char *)UTIL_LoadFileForMe( basescript, &length );
 	if ( length <= 0 || !buffer )
@@ -1999,11 +2274,420 @@ void CResponseSystem::LoadRuleSet( const char *basescript )
 
 	CStringPool includedFiles;
 
+	m_CompiledSources.RemoveAll();
 	LoadFromBuffer( basescript, (const char *)buffer, includedFiles );
 
 	UTIL_FreeFile( buffer );
 
 	Assert( m_ScriptStack.Count() == 0 );
+
+	if ( bEmpty && rr_compiled_rules.GetBool() )
+	{
+		SaveCompiledRuleSet( basescript );
+	}
+
+	BuildRuleIndex();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The compiled file lives next to the script, "foo.txt" -> "foo.rrc"
+//-----------------------------------------------------------------------------
+void CResponseSystem::GetCompiledRuleSetName( const char *basescript, char *out, int outlen )
+{
+	Q_StripExtension( basescript, out, outlen );
+	Q_strncat( out, RR_COMPILED_EXTENSION, outlen, COPY_ALL_CHARACTERS );
+}
+
+static void PutCompiledOptionalString( CUtlBuffer &buf, const char *s )
+{
+	buf.PutUnsignedChar( s ? 1 : 0 );
+	if ( s )
+	{
+		buf.PutString( s );
+	}
+}
+
+// Strings point straight into the file buffer, callers copy what they keep.
+// Returns NULL if the buffer ends before the terminator.
+static const char *GetCompiledString( CUtlBuffer &buf )
+{
+	int len = buf.PeekStringLength();
+	if ( len <= 0 )
+		return NULL;
+
+	const char *s = (const char *)buf.PeekGet();
+	buf.SeekGet( CUtlBuffer::SEEK_CURRENT, len );
+	return s;
+}
+
+static const char *GetCompiledOptionalString( CUtlBuffer &buf )
+{
+	if ( !buf.GetUnsignedChar() )
+		return NULL;
+
+	return GetCompiledString( buf );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Writes the dictionaries parsed from basescript out in binary, in
+//			dictionary index order so rule -> criteria/response indices stay valid
+//-----------------------------------------------------------------------------
+void CResponseSystem::SaveCompiledRuleSet( const char *basescript )
+{
+	int i, j;
+	CUtlBuffer buf;
+
+	buf.PutInt( m_CompiledSources.Count() );
+	for ( i = 0; i < m_CompiledSources.Count(); i++ )
+	{
+		char name[ MAX_PATH ];
+		if ( !filesystem->String( m_CompiledSources[ i ].name, name, sizeof( name ) ) )
+			return;
+
+		buf.PutString( name );
+		buf.PutUnsignedInt( m_CompiledSources[ i ].crc );
+	}
+
+	buf.PutInt( m_Enumerations.Count() );
+	for ( i = 0; i < m_Enumerations.Count(); i++ )
+	{
+		buf.PutString( m_Enumerations.GetElementName( i ) );
+		buf.PutFloat( m_Enumerations[ i ].value );
+	}
+
+	buf.PutInt( m_Responses.Count() );
+	for ( i = 0; i < m_Responses.Count(); i++ )
+	{
+		ResponseGroup &group = m_Responses[ i ];
+
+		buf.PutString( m_Responses.GetElementName( i ) );
+		buf.Put( &group.rp, sizeof( group.rp ) );
+		buf.PutUnsignedChar( ( group.m_bDepleteBeforeRepeat ? 1 : 0 ) |
+			( group.m_bHasFirst ? 2 : 0 ) |
+			( group.m_bHasLast ? 4 : 0 ) |
+			( group.IsSequential() ? 8 : 0 ) |
+			( group.IsNoRepeat() ? 16 : 0 ) );
+
+		buf.PutInt( group.group.Count() );
+		for ( j = 0; j < group.group.Count(); j++ )
+		{
+			Response &response = group.group[ j ];
+			PutCompiledOptionalString( buf, response.value );
+			buf.PutFloat( response.weight.GetFloat() );
+			buf.PutUnsignedChar( response.type );
+			buf.PutUnsignedChar( ( response.first ? 1 : 0 ) | ( response.last ? 2 : 0 ) );
+		}
+	}
+
+	buf.PutInt( m_Criteria.Count() );
+	for ( i = 0; i < m_Criteria.Count(); i++ )
+	{
+		Criteria &criterion = m_Criteria[ i ];
+		Matcher &matcher = criterion.matcher;
+
+		buf.PutString( m_Criteria.GetElementName( i ) );
+		PutCompiledOptionalString( buf, criterion.name );
+		PutCompiledOptionalString( buf, criterion.value );
+		buf.PutFloat( criterion.weight.GetFloat() );
+		buf.PutUnsignedChar( criterion.required ? 1 : 0 );
+
+		buf.PutUnsignedChar( ( matcher.valid ? 1 : 0 ) |
+			( matcher.isnumeric ? 2 : 0 ) |
+			( matcher.notequal ? 4 : 0 ) |
+			( matcher.usemin ? 8 : 0 ) |
+			( matcher.minequals ? 16 : 0 ) |
+			( matcher.usemax ? 32 : 0 ) |
+			( matcher.maxequals ? 64 : 0 ) );
+		if ( matcher.valid )
+		{
+			buf.PutFloat( matcher.minval );
+			buf.PutFloat( matcher.maxval );
+			buf.PutString( matcher.GetToken() );
+			buf.PutString( matcher.GetRaw() );
+		}
+
+		buf.PutInt( criterion.subcriteria.Count() );
+		for ( j = 0; j < criterion.subcriteria.Count(); j++ )
+		{
+			buf.PutUnsignedShort( criterion.subcriteria[ j ] );
+		}
+	}
+
+	buf.PutInt( m_Rules.Count() );
+	for ( i = 0; i < m_Rules.Count(); i++ )
+	{
+		Rule &rule = m_Rules[ i ];
+
+		buf.PutString( m_Rules.GetElementName( i ) );
+		PutCompiledOptionalString( buf, rule.GetContext() );
+		buf.PutUnsignedChar( ( rule.IsMatchOnce() ? 1 : 0 ) | ( rule.IsApplyContextToWorld() ? 2 : 0 ) );
+
+		buf.PutInt( rule.m_Criteria.Count() );
+		for ( j = 0; j < rule.m_Criteria.Count(); j++ )
+		{
+			buf.PutUnsignedShort( rule.m_Criteria[ j ] );
+		}
+
+		buf.PutInt( rule.m_Responses.Count() );
+		for ( j = 0; j < rule.m_Responses.Count(); j++ )
+		{
+			buf.PutUnsignedShort( rule.m_Responses[ j ] );
+		}
+	}
+
+	CUtlBuffer file;
+	file.PutInt( RR_COMPILED_ID );
+	file.PutInt( RR_COMPILED_VERSION );
+	file.PutInt( sizeof( AI_ResponseParams ) );
+	file.PutUnsignedInt( CRC32_ProcessSingleBuffer( buf.Base(), buf.TellPut() ) );
+	file.Put( buf.Base(), buf.TellPut() );
+
+	char filename[ MAX_PATH ];
+	GetCompiledRuleSetName( basescript, filename, sizeof( filename ) );
+
+	char path[ MAX_PATH ];
+	Q_ExtractFilePath( filename, path, sizeof( path ) );
+	filesystem->CreateDirHierarchy( path, "DEFAULT_WRITE_PATH" );
+
+	if ( !filesystem->WriteFile( filename, "DEFAULT_WRITE_PATH", file ) )
+	{
+		DevMsg( "CResponseSystem:  couldn't write %s\n", filename );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Fills the (empty) dictionaries from the compiled version of basescript.
+//			Fails if there's no compiled file, it's from another version, or any
+//			of the scripts it was built from has changed since.
+//-----------------------------------------------------------------------------
+bool CResponseSystem::LoadCompiledRuleSet( const char *basescript )
+{
+	char filename[ MAX_PATH ];
+	GetCompiledRuleSetName( basescript, filename, sizeof( filename ) );
+
+	MEM_ALLOC_CREDIT();
+
+	CUtlBuffer buf;
+	if ( !filesystem->ReadFile( filename, "GAME", buf ) )
+		return false;
+
+	if ( buf.GetInt() != RR_COMPILED_ID ||
+		 buf.GetInt() != RR_COMPILED_VERSION ||
+		 buf.GetInt() != (int)sizeof( AI_ResponseParams ) )
+	{
+		DevMsg( "CResponseSystem:  ignoring %s from another version\n", filename );
+		return false;
+	}
+
+	CRC32_t crcData = buf.GetUnsignedInt();
+	if ( !buf.IsValid() || CRC32_ProcessSingleBuffer( buf.PeekGet(), buf.GetBytesRemaining() ) != crcData )
+	{
+		DevMsg( "CResponseSystem:  %s is corrupt, re-parsing %s\n", filename, basescript );
+		return false;
+	}
+
+	int i, j, c;
+
+	m_CompiledSources.RemoveAll();
+	c = buf.GetInt();
+	for ( i = 0; i < c; i++ )
+	{
+		const char *pszSource = GetCompiledString( buf );
+		if ( !pszSource )
+			return false;
+
+		CRC32_t crc = buf.GetUnsignedInt();
+
+		int length = 0;
+		unsigned char *pScript = (unsigned char *)UTIL_LoadFileForMe( pszSource, &length );
+		bool bMatches = ( pScript && length > 0 && CRC32_ProcessSingleBuffer( pScript, Q_strlen( (const char *)pScript ) ) == crc );
+		if ( pScript )
+		{
+			UTIL_FreeFile( pScript );
+		}
+
+		if ( !bMatches )
+		{
+			DevMsg( "CResponseSystem:  %s has changed, re-parsing %s\n", pszSource, basescript );
+			return false;
+		}
+
+		CompiledSource_t &source = m_CompiledSources[ m_CompiledSources.AddToTail() ];
+		source.name = filesystem->FindOrAddFileName( pszSource );
+		source.crc = crc;
+	}
+
+	bool bValid = true;
+
+	c = buf.GetInt();
+	for ( i = 0; bValid && i < c; i++ )
+	{
+		const char *pszName = GetCompiledString( buf );
+		Enumeration newEnum;
+		newEnum.value = buf.GetFloat();
+		bValid = buf.IsValid() && pszName && m_Enumerations.Insert( pszName, newEnum ) == i;
+	}
+
+	c = bValid ? buf.GetInt() : 0;
+	for ( i = 0; bValid && i < c; i++ )
+	{
+		const char *pszName = GetCompiledString( buf );
+
+		ResponseGroup newGroup;
+		buf.Get( &newGroup.rp, sizeof( newGroup.rp ) );
+
+		int flags = buf.GetUnsignedChar();
+		newGroup.m_bDepleteBeforeRepeat = ( flags & 1 ) ? true : false;
+		newGroup.m_bHasFirst = ( flags & 2 ) ? true : false;
+		newGroup.m_bHasLast = ( flags & 4 ) ? true : false;
+		newGroup.SetSequential( ( flags & 8 ) ? true : false );
+		newGroup.SetNoRepeat( ( flags & 16 ) ? true : false );
+
+		int nResponses = buf.GetInt();
+		for ( j = 0; j < nResponses && buf.IsValid(); j++ )
+		{
+			Response newResponse;
+			newResponse.value = CopyString( GetCompiledOptionalString( buf ) );
+			newResponse.weight.SetFloat( buf.GetFloat() );
+			newResponse.type = buf.GetUnsignedChar();
+			flags = buf.GetUnsignedChar();
+			newResponse.first = ( flags & 1 ) ? 1 : 0;
+			newResponse.last = ( flags & 2 ) ? 1 : 0;
+			newGroup.group.AddToTail( newResponse );
+		}
+
+		bValid = buf.IsValid() && pszName && m_Responses.Insert( pszName, newGroup ) == i;
+	}
+
+	c = bValid ? buf.GetInt() : 0;
+	for ( i = 0; bValid && i < c; i++ )
+	{
+		const char *pszName = GetCompiledString( buf );
+
+		Criteria newCriterion;
+		newCriterion.name = CopyString( GetCompiledOptionalString( buf ) );
+		newCriterion.value = CopyString( GetCompiledOptionalString( buf ) );
+		newCriterion.weight.SetFloat( buf.GetFloat() );
+		newCriterion.required = buf.GetUnsignedChar() ? true : false;
+
+		Matcher &matcher = newCriterion.matcher;
+		int flags = buf.GetUnsignedChar();
+		matcher.valid = ( flags & 1 ) ? true : false;
+		matcher.isnumeric = ( flags & 2 ) ? true : false;
+		matcher.notequal = ( flags & 4 ) ? true : false;
+		matcher.usemin = ( flags & 8 ) ? true : false;
+		matcher.minequals = ( flags & 16 ) ? true : false;
+		matcher.usemax = ( flags & 32 ) ? true : false;
+		matcher.maxequals = ( flags & 64 ) ? true : false;
+		if ( matcher.valid )
+		{
+			matcher.minval = buf.GetFloat();
+			matcher.maxval = buf.GetFloat();
+			const char *pszToken = GetCompiledString( buf );
+			const char *pszRaw = GetCompiledString( buf );
+			matcher.SetToken( pszToken ? pszToken : "" );
+			matcher.SetRaw( pszRaw ? pszRaw : "" );
+		}
+
+		int nSubcriteria = buf.GetInt();
+		for ( j = 0; j < nSubcriteria && buf.IsValid(); j++ )
+		{
+			newCriterion.subcriteria.AddToTail( buf.GetUnsignedShort() );
+		}
+
+		bValid = buf.IsValid() && pszName && m_Criteria.Insert( pszName, newCriterion ) == i;
+	}
+
+	c = bValid ? buf.GetInt() : 0;
+	for ( i = 0; bValid && i < c; i++ )
+	{
+		const char *pszName = GetCompiledString( buf );
+
+		Rule newRule;
+		newRule.SetContext( GetCompiledOptionalString( buf ) );
+
+		int flags = buf.GetUnsignedChar();
+		newRule.m_bMatchOnce = ( flags & 1 ) ? true : false;
+		newRule.m_bApplyContextToWorld = ( flags & 2 ) ? true : false;
+
+		int nCriteria = buf.GetInt();
+		for ( j = 0; j < nCriteria && buf.IsValid(); j++ )
+		{
+			newRule.m_Criteria.AddToTail( buf.GetUnsignedShort() );
+		}
+
+		int nResponses = buf.GetInt();
+		for ( j = 0; j < nResponses && buf.IsValid(); j++ )
+		{
+			newRule.m_Responses.AddToTail( buf.GetUnsignedShort() );
+		}
+
+		bValid = buf.IsValid() && pszName && m_Rules.Insert( pszName, newRule ) == i;
+	}
+
+	if ( !bValid || !ValidateCompiledRuleSet() )
+	{
+		DevMsg( "CResponseSystem:  %s is corrupt, re-parsing %s\n", filename, basescript );
+		Clear();
+		return false;
+	}
+
+	DevMsg( 1, "CResponseSystem:  %s (%i rules, %i criteria, and %i responses, compiled)\n",
+		basescript, m_Rules.Count(), m_Criteria.Count(), m_Responses.Count() );
+
+	if ( rr_dumpresponses.GetBool() )
+	{
+		DumpRules();
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Checks every index read from a compiled file against the
+//			dictionaries it was loaded into
+//-----------------------------------------------------------------------------
+bool CResponseSystem::ValidateCompiledRuleSet()
+{
+	int i, j;
+
+	for ( i = 0; i < m_Responses.Count(); i++ )
+	{
+		ResponseGroup &group = m_Responses[ i ];
+		for ( j = 0; j < group.group.Count(); j++ )
+		{
+			if ( group.group[ j ].type >= NUM_RESPONSES )
+				return false;
+		}
+	}
+
+	for ( i = 0; i < m_Criteria.Count(); i++ )
+	{
+		Criteria &criterion = m_Criteria[ i ];
+		for ( j = 0; j < criterion.subcriteria.Count(); j++ )
+		{
+			if ( criterion.subcriteria[ j ] >= m_Criteria.Count() )
+				return false;
+		}
+	}
+
+	for ( i = 0; i < m_Rules.Count(); i++ )
+	{
+		Rule &rule = m_Rules[ i ];
+		for ( j = 0; j < rule.m_Criteria.Count(); j++ )
+		{
+			if ( rule.m_Criteria[ j ] >= m_Criteria.Count() )
+				return false;
+		}
+
+		for ( j = 0; j < rule.m_Responses.Count(); j++ )
+		{
+			if ( rule.m_Responses[ j ] >= m_Responses.Count() )
+				return false;
+		}
+	}
+
+	return true;
 }
 
 static ResponseType_t ComputeResponseType( const char *s )
@@ -3051,6 +3735,160 @@ CON_COMMAND( rr_reloadresponsesystems, "Reload all response system scripts." )
 #endif
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Appends a query to the query log, one line of tab separated
+//			name, value and weight triples per query
+//-----------------------------------------------------------------------------
+void CResponseSystem::CaptureQuery( const AI_CriteriaSet& set )
+{
+	FileHandle_t fh = filesystem->Open( RR_QUERY_LOG_FILE, "a", "MOD" );
+	if ( fh == FILESYSTEM_INVALID_HANDLE )
+	{
+		Warning( "Couldn't open %s, query capture stopped\n", RR_QUERY_LOG_FILE );
+		g_nQueriesToCapture = 0;
+		return;
+	}
+
+	int c = set.GetCount();
+	for ( int i = 0; i < c; i++ )
+	{
+		filesystem->FPrintf( fh, "%s%s\t%s\t%f", ( i > 0 ) ? "\t" : "", set.GetName( i ), set.GetValue( i ), set.GetWeight( i ) );
+	}
+	filesystem->FPrintf( fh, "\n" );
+	filesystem->Close( fh );
+
+	if ( --g_nQueriesToCapture == 0 )
+	{
+		Msg( "Finished capturing response queries to %s\n", RR_QUERY_LOG_FILE );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Replays the query log through the full rule scan and the rule
+//			index, timing both and checking they pick the same rules
+//-----------------------------------------------------------------------------
+void CResponseSystem::BenchmarkQueries( int iterations )
+{
+	CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	if ( !filesystem->ReadFile( RR_QUERY_LOG_FILE, "MOD", buf ) )
+	{
+		Msg( "No query log, capture one with rr_capture_queries\n" );
+		return;
+	}
+
+	CUtlVector< AI_CriteriaSet > queries;
+	char line[ 4096 ];
+	while ( buf.IsValid() )
+	{
+		buf.GetLine( line, sizeof( line ) );
+		Q_StripPrecedingAndTrailingWhitespace( line );
+		if ( !line[0] )
+			continue;
+
+		AI_CriteriaSet &set = queries[ queries.AddToTail() ];
+
+		char *fields[ 3 ];
+		int nField = 0;
+		char *p = line;
+		while ( p )
+		{
+			fields[ nField++ ] = p;
+			p = strchr( p, '\t' );
+			if ( p )
+			{
+				*p++ = 0;
+			}
+
+			if ( nField == 3 )
+			{
+				set.AppendCriteria( fields[ 0 ], fields[ 1 ], (float)atof( fields[ 2 ] ) );
+				nField = 0;
+			}
+		}
+	}
+
+	if ( !queries.Count() )
+	{
+		Msg( "%s is empty\n", RR_QUERY_LOG_FILE );
+		return;
+	}
+
+	if ( !IsRuleIndexValid() )
+	{
+		BuildRuleIndex();
+	}
+
+	CUtlVector< int > fullRules;
+	CUtlVector< int > indexedRules;
+	int nFullScored = 0;
+	int nIndexedScored = 0;
+	int nMismatches = 0;
+	CCycleCount fullTime;
+	CCycleCount indexedTime;
+
+	for ( int iteration = 0; iteration < iterations; iteration++ )
+	{
+		for ( int i = 0; i < queries.Count(); i++ )
+		{
+			int nScored;
+			CFastTimer timer;
+
+			timer.Start();
+			float fullScore = FindBestMatchingRules( queries[ i ], fullRules, false, false, &nScored );
+			timer.End();
+			fullTime += timer.GetDuration();
+			nFullScored += nScored;
+
+			timer.Start();
+			float indexedScore = FindBestMatchingRules( queries[ i ], indexedRules, true, false, &nScored );
+			timer.End();
+			indexedTime += timer.GetDuration();
+			nIndexedScored += nScored;
+
+			if ( iteration == 0 )
+			{
+				bool bSame = ( fullScore == indexedScore && fullRules.Count() == indexedRules.Count() );
+				for ( int j = 0; bSame && j < fullRules.Count(); j++ )
+				{
+					bSame = ( fullRules[ j ] == indexedRules[ j ] );
+				}
+
+				if ( !bSame )
+				{
+					Warning( "Query %d: full scan and rule index disagree\n", i + 1 );
+					nMismatches++;
+				}
+			}
+		}
+	}
+
+	int nQueries = queries.Count() * iterations;
+	Msg( "%d queries (%d x %d iterations), %d rules\n", nQueries, queries.Count(), iterations, m_Rules.Count() );
+	Msg( "Full scan:  %8.3f ms total, %6.2f us per query, %.1f rules scored per query\n",
+		fullTime.GetMillisecondsF(), 1000.0f * fullTime.GetMillisecondsF() / nQueries, (float)nFullScored / nQueries );
+	Msg( "Rule index: %8.3f ms total, %6.2f us per query, %.1f rules scored per query\n",
+		indexedTime.GetMillisecondsF(), 1000.0f * indexedTime.GetMillisecondsF() / nQueries, (float)nIndexedScored / nQueries );
+	Msg( "%d mismatched queries\n", nMismatches );
+}
+
+CON_COMMAND( rr_capture_queries, "Append the next <count> response queries to " RR_QUERY_LOG_FILE " for rr_benchmark_queries" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	g_nQueriesToCapture = ( args.ArgC() > 1 ) ? atoi( args[ 1 ] ) : 1000;
+	Msg( "Capturing %d response queries to %s\n", g_nQueriesToCapture, RR_QUERY_LOG_FILE );
+}
+
+CON_COMMAND( rr_benchmark_queries, "Replay " RR_QUERY_LOG_FILE " against the response rules, with and without the rule index. Optional iteration count" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int iterations = ( args.ArgC() > 1 ) ? MAX( atoi( args[ 1 ] ), 1 ) : 10;
+	defaultresponsesytem.BenchmarkQueries( iterations );
+}
+
 static short RESPONSESYSTEM_SAVE_RESTORE_VERSION = 1;
 
 // note:  this won't save/restore settings from instanced response systems.  Could add that with a CDefSaveRestoreOps implementation if needed
@@ -15,6 +15,9 @@
 
 extern CTimedEventMgr g_NetworkPropertyEventMgr;
 
+// Source of PVS info serials, see GetPVSInfoSerial()
+static int s_nPVSInfoSerial = 0;
+
 
 //-----------------------------------------------------------------------------
 // Save/load
@@ -23,6 +26,7 @@ BEGIN_DATADESC_NO_BASE( CServerNetworkProperty )
 //	DEFINE_FIELD( m_pOuter, FIELD_CLASSPTR ),
 //	DEFINE_FIELD( m_pPev, FIELD_CLASSPTR ),
 //	DEFINE_FIELD( m_PVSInfo, PVSInfo_t ),
+//	DEFINE_FIELD( m_nPVSInfoSerial, FIELD_INTEGER ),
 //	DEFINE_FIELD( m_pServerClass, FIELD_CLASSPTR ),
 	DEFINE_GLOBAL_FIELD( m_hParent, FIELD_EHANDLE ),
 //	DEFINE_FIELD( m_TimerEvent, CEventRegister ),
@@ -65,6 +69,7 @@ void CServerNetworkProperty::Init( CBaseEntity *pEntity )
 //	m_pTransmitProxy = NULL;
 	m_bPendingStateChange = false;
 	m_PVSInfo.m_nClusterCount = 0;
+	m_nPVSInfoSerial = ++s_nPVSInfoSerial;
 	m_TimerEvent.Init( &g_NetworkPropertyEventMgr, this );
 }
 
@@ -144,6 +149,7 @@ void CServerNetworkProperty::RecomputePVSInformation()
 	{
 		m_pPev->m_fStateFlags &= ~FL_EDICT_DIRTY_PVS_INFORMATION;
 		engine->BuildEntityClusterList( edict(), &m_PVSInfo );
+		m_nPVSInfoSerial = ++s_nPVSInfoSerial;
 	}
 }
 
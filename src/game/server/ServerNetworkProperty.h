@@ -101,6 +101,9 @@ public:
 	// Recomputes PVS information
 	void RecomputePVSInformation();
 
+	// Changes every time the PVS information is rebuilt, and is never shared between networkables
+	int GetPVSInfoSerial() const;
+
 private:
 	// Detaches the edict.. should only be called by CBaseNetworkable's destructor.
 	void DetachEdict();
@@ -114,6 +117,7 @@ private:
 	// CBaseTransmitProxy *m_pTransmitProxy;
 	edict_t	*m_pPev;
 	PVSInfo_t m_PVSInfo;
+	int m_nPVSInfoSerial;
 	ServerClass *m_pServerClass;
 
 	// NOTE: This state is 'owned' by the entity. It's only copied here
@@ -248,6 +252,12 @@ inline void CServerNetworkProperty::SetEdict( edict_t *pEdict )
 }
 
 
+inline int CServerNetworkProperty::GetPVSInfoSerial() const
+{
+	return m_nPVSInfoSerial;
+}
+
+
 inline int CServerNetworkProperty::AreaNum() const
 {
 	const_cast<CServerNetworkProperty*>(this)->RecomputePVSInformation();
@@ -106,6 +106,7 @@ extern ConVar sk_healthkit;
 
 #include "utlbuffer.h"
 #include "gamestats.h"
+#include "entityprofile.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -4783,6 +4784,7 @@ void CAI_BaseNPC::PrescheduleThink( void )
 void CAI_BaseNPC::RunAI( void )
 {
 	AI_PROFILE_SCOPE(CAI_BaseNPC_RunAI);
+	ENTITY_PROFILE_SCOPE( this, ENTITY_PROFILE_RUN_AI );
 	g_AIRunTimer.Start();
 
 	if( ai_debug_squads.GetBool() )
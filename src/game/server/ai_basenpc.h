@@ -1311,6 +1311,7 @@ public:
 	virtual bool		IsUnusableNode(int iNodeID, CAI_Hint *pHint); // Override for special NPC behavior
 	virtual bool		ValidateNavGoal();
 	virtual bool		IsCurTaskContinuousMove();
+	virtual bool		IsPathTask( const Task_t *pTask );
 	virtual bool		IsValidMoveAwayDest( const Vector &vecDest )	{ return true; }
 
 	//---------------------------------
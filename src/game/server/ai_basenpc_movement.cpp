@@ -182,6 +182,47 @@ bool CAI_BaseNPC::IsCurTaskContinuousMove()
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Tasks that build a route when they start. With ai_path_budget_ms
+//			set, these wait to be started until the frame's budget allows.
+//-----------------------------------------------------------------------------
+bool CAI_BaseNPC::IsPathTask( const Task_t *pTask )
+{
+	switch( pTask->iTask )
+	{
+	case TASK_MOVE_AWAY_PATH:
+	case TASK_GET_PATH_AWAY_FROM_BEST_SOUND:
+	case TASK_GET_PATH_TO_GOAL:
+	case TASK_GET_PATH_TO_ENEMY:
+	case TASK_GET_PATH_TO_ENEMY_LKP:
+	case TASK_GET_CHASE_PATH_TO_ENEMY:
+	case TASK_GET_PATH_TO_ENEMY_LKP_LOS:
+	case TASK_GET_PATH_TO_ENEMY_CORPSE:
+	case TASK_GET_PATH_TO_PLAYER:
+	case TASK_GET_PATH_TO_ENEMY_LOS:
+	case TASK_GET_FLANK_RADIUS_PATH_TO_ENEMY_LOS:
+	case TASK_GET_FLANK_ARC_PATH_TO_ENEMY_LOS:
+	case TASK_GET_PATH_TO_RANGE_ENEMY_LKP_LOS:
+	case TASK_GET_PATH_TO_TARGET:
+	case TASK_GET_PATH_TO_TARGET_WEAPON:
+	case TASK_GET_PATH_TO_HINTNODE:
+	case TASK_GET_PATH_TO_COMMAND_GOAL:
+	case TASK_GET_PATH_TO_LASTPOSITION:
+	case TASK_GET_PATH_TO_SAVEPOSITION:
+	case TASK_GET_PATH_TO_SAVEPOSITION_LOS:
+	case TASK_GET_PATH_TO_RANDOM_NODE:
+	case TASK_GET_PATH_TO_BESTSOUND:
+	case TASK_GET_PATH_TO_BESTSCENT:
+	case TASK_GET_PATH_TO_INTERACTION_PARTNER:
+		return true;
+		break;
+
+	default:
+		return false;
+		break;
+	}
+}
+
 
 //-----------------------------------------------------------------------------
 // Purpose: Used to specify that the NPC has a reason not to use the a navigation node
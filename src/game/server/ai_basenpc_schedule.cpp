@@ -705,6 +705,17 @@ void CAI_BaseNPC::MaintainSchedule ( void )
 			return;
 		}
 		
+		// Don't start a path task until this frame's route building budget allows it.
+		// The task isn't started at all, so it can't fail for want of a route.
+		if ( GetTaskStatus() == TASKSTATUS_NEW && IsPathTask( GetTask() ) && GetNavigator()->ShouldDeferPathRequest() )
+		{
+			if (m_debugOverlays & OVERLAY_TASK_TEXT_BIT)
+			{
+				DevMsg(this, AIMF_IGNORE_SELECTED, "  Task: %s waiting for path budget\n", TaskName( GetTask()->iTask ) );
+			}
+			break;
+		}
+
 		AI_PROFILE_SCOPE_BEGIN_( CAI_BaseNPC::GetSchedulingSymbols()->ScheduleIdToSymbol( GetCurSchedule()->GetId() ) );
 
 		if ( GetTaskStatus() == TASKSTATUS_NEW )
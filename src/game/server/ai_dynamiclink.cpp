@@ -152,6 +152,8 @@ void CAI_DynamicLinkController::InputSetAllowed( inputdata_t &inputdata )
 		}
 		m_ControlledLinks[i]->m_strAllowUse = m_strAllowUse;
 	}
+
+	g_pBigAINet->InvalidateRouteZones();
 }
 
 void CAI_DynamicLinkController::InputSetInvert( inputdata_t &inputdata )
@@ -290,9 +292,10 @@ void CAI_DynamicLink::InitDynamicLinks(void)
 					int hullBits = ( pDynamicLink->GetSpawnFlags() & bits_HULL_BITS_MASK );
 					for ( int i = 0; i < NUM_HULLS; i++ )
 					{
-						if ( hullBits & ( 1 << i ) )
+						if ( ( hullBits & ( 1 << i ) ) && pLink->m_iAcceptedMoveTypes[i] != pDynamicLink->m_nLinkType )
 						{
 							pLink->m_iAcceptedMoveTypes[i] = pDynamicLink->m_nLinkType;
+							g_pBigAINet->InvalidateRouteZones();
 						}
 					}
 				}
@@ -319,6 +322,9 @@ void CAI_DynamicLink::InitDynamicLinks(void)
 	if ( bUpdateZones )
 	{
 		g_AINetworkBuilder.InitZones( g_pBigAINet );
+
+		// Pick up the new links' hulls in the nearest node grid
+		g_pBigAINet->BuildNodeGrid();
 	}
 }
 
@@ -486,6 +492,7 @@ void CAI_DynamicLink::SetLinkState(void)
 		if ( pLink )
 		{
 			pLink->m_pDynamicLink = this;
+			byte oldLinkInfo = pLink->m_LinkInfo;
 			if (m_nLinkState == LINK_OFF)
 			{
 				pLink->m_LinkInfo |=  bits_LINK_OFF;
@@ -494,6 +501,11 @@ void CAI_DynamicLink::SetLinkState(void)
 			{
 				pLink->m_LinkInfo &= ~bits_LINK_OFF;
 			}
+
+			if ( pLink->m_LinkInfo != oldLinkInfo )
+			{
+				g_pBigAINet->InvalidateRouteZones();
+			}
 		}
 		else
 		{
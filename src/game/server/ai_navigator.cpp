@@ -453,6 +453,207 @@ bool CAI_Navigator::FindPath( const AI_NavGoal_t &goal, unsigned flags )
 ConVar ai_navigator_generate_spikes( "ai_navigator_generate_spikes", "0" );
 ConVar ai_navigator_generate_spikes_strength( "ai_navigator_generate_spikes_strength", "8" );
 
+//-----------------------------------------------------------------------------
+// CAI_PathRequestScheduler
+//
+// Purpose: Spreads route building over frames. Each frame has a budget of
+//			milliseconds for building routes. Once it is spent, an NPC about to
+//			start a path task is queued and starts the task on a later think. At
+//			the start of each frame the queue is sorted so NPCs closest to a
+//			player get the budget first.
+//-----------------------------------------------------------------------------
+
+ConVar ai_path_budget_ms( "ai_path_budget_ms", "0", FCVAR_NONE, "Milliseconds per frame NPCs may spend building routes before new path requests are queued (0 = no limit)" );
+
+#define PATH_REQUEST_IDLE_TIME		1.0		// Forget queued NPCs that stop asking for a path
+#define PATH_REQUEST_AGING_RATE		4.0		// Priority boost per second spent in the queue
+
+class CAI_PathRequestScheduler : public CAutoGameSystemPerFrame
+{
+public:
+	CAI_PathRequestScheduler( char const *name ) 
+	 :	CAutoGameSystemPerFrame( name ),
+		m_flSpentMs( 0 ),
+		m_flReservedMs( 0 ),
+		m_flAverageMs( 1.0 )
+	{
+	}
+
+	virtual void LevelInitPreEntity()		{ m_Requests.Purge(); }
+	virtual void LevelShutdownPostEntity()	{ m_Requests.Purge(); }
+	virtual void FrameUpdatePreEntityThink();
+
+	bool	ShouldDefer( CAI_BaseNPC *pNPC );
+	void	OnRouteBuilt( float flMs );
+
+private:
+	struct PathRequest_t
+	{
+		CHandle<CAI_BaseNPC>	hNPC;
+		float					flPriority;
+		float					flFirstRequest;
+		float					flLastRequest;
+		bool					bGranted;
+	};
+
+	static int __cdecl	ComparePriority( const PathRequest_t *pLeft, const PathRequest_t *pRight );
+	float				ComputePriority( CAI_BaseNPC *pNPC );
+	int					FindRequest( CAI_BaseNPC *pNPC );
+
+	CUtlVector<PathRequest_t>	m_Requests;
+	float						m_flSpentMs;
+	float						m_flReservedMs;
+	float						m_flAverageMs;
+};
+
+CAI_PathRequestScheduler g_AIPathRequestScheduler( "CAI_PathRequestScheduler" );
+
+//-------------------------------------
+
+void CAI_PathRequestScheduler::FrameUpdatePreEntityThink()
+{
+	m_flSpentMs = 0;
+	m_flReservedMs = 0;
+
+	float flBudget = ai_path_budget_ms.GetFloat();
+	if ( flBudget <= 0 )
+	{
+		m_Requests.RemoveAll();
+		return;
+	}
+
+	int i;
+	for ( i = m_Requests.Count() - 1; i >= 0; i-- )
+	{
+		PathRequest_t &request = m_Requests[i];
+		CAI_BaseNPC *pNPC = request.hNPC;
+		if ( !pNPC || !pNPC->IsAlive() || gpGlobals->curtime - request.flLastRequest > PATH_REQUEST_IDLE_TIME )
+		{
+			m_Requests.FastRemove( i );
+			continue;
+		}
+
+		// Age requests so distant NPCs aren't starved
+		float flWaited = gpGlobals->curtime - request.flFirstRequest;
+		request.flPriority = ComputePriority( pNPC ) / ( 1.0 + flWaited * PATH_REQUEST_AGING_RATE );
+		request.bGranted = false;
+	}
+
+	m_Requests.Sort( ComparePriority );
+
+	// Reserve this frame's budget for the most important waiting NPCs. The
+	// first one always gets through so the queue keeps moving.
+	for ( i = 0; i < m_Requests.Count(); i++ )
+	{
+		if ( i > 0 && m_flReservedMs + m_flAverageMs > flBudget )
+			break;
+
+		m_Requests[i].bGranted = true;
+		m_flReservedMs += m_flAverageMs;
+	}
+}
+
+//-------------------------------------
+
+bool CAI_PathRequestScheduler::ShouldDefer( CAI_BaseNPC *pNPC )
+{
+	float flBudget = ai_path_budget_ms.GetFloat();
+	if ( flBudget <= 0 )
+		return false;
+
+	int i = FindRequest( pNPC );
+	if ( i != m_Requests.InvalidIndex() )
+	{
+		if ( m_Requests[i].bGranted )
+		{
+			m_flReservedMs = MAX( m_flReservedMs - m_flAverageMs, 0 );
+			m_Requests.FastRemove( i );
+			return false;
+		}
+
+		m_Requests[i].flLastRequest = gpGlobals->curtime;
+		return true;
+	}
+
+	if ( m_flSpentMs + m_flReservedMs + m_flAverageMs <= flBudget )
+		return false;
+
+	i = m_Requests.AddToTail();
+	m_Requests[i].hNPC = pNPC;
+	m_Requests[i].flPriority = ComputePriority( pNPC );
+	m_Requests[i].flFirstRequest = gpGlobals->curtime;
+	m_Requests[i].flLastRequest = gpGlobals->curtime;
+	m_Requests[i].bGranted = false;
+
+	return true;
+}
+
+//-------------------------------------
+
+void CAI_PathRequestScheduler::OnRouteBuilt( float flMs )
+{
+	m_flSpentMs += flMs;
+	m_flAverageMs = m_flAverageMs * 0.9 + flMs * 0.1;
+}
+
+//-------------------------------------
+
+int __cdecl CAI_PathRequestScheduler::ComparePriority( const PathRequest_t *pLeft, const PathRequest_t *pRight )
+{
+	if ( pLeft->flPriority < pRight->flPriority )
+		return -1;
+	if ( pLeft->flPriority > pRight->flPriority )
+		return 1;
+	return 0;
+}
+
+//-------------------------------------
+// Lower is more important: distance to the nearest player, with NPCs that
+// are running efficiently (out of sight) pushed back
+//-------------------------------------
+
+float CAI_PathRequestScheduler::ComputePriority( CAI_BaseNPC *pNPC )
+{
+	float flNearestSqr = MAX_COORD_RANGE * MAX_COORD_RANGE;
+	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
+	{
+		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
+		if ( !pPlayer || !pPlayer->IsAlive() )
+			continue;
+
+		flNearestSqr = MIN( flNearestSqr, ( pPlayer->GetAbsOrigin() - pNPC->GetAbsOrigin() ).LengthSqr() );
+	}
+
+	float flPriority = sqrt( flNearestSqr );
+
+	if ( pNPC->GetEfficiency() > AIE_NORMAL )
+		flPriority *= 2.0;
+
+	if ( pNPC->GetEnemy() && pNPC->GetEnemy()->IsPlayer() )
+		flPriority *= 0.5;
+
+	return flPriority;
+}
+
+//-------------------------------------
+
+int CAI_PathRequestScheduler::FindRequest( CAI_BaseNPC *pNPC )
+{
+	for ( int i = 0; i < m_Requests.Count(); i++ )
+	{
+		if ( m_Requests[i].hNPC == pNPC )
+			return i;
+	}
+	return m_Requests.InvalidIndex();
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_Navigator::ShouldDeferPathRequest()
+{
+	return g_AIPathRequestScheduler.ShouldDefer( GetOuter() );
+}
+
 //-----------------------------------------------------------------------------
 
 bool CAI_Navigator::SetGoal( const AI_NavGoal_t &goal, unsigned flags )
@@ -3382,6 +3583,9 @@ bool CAI_Navigator::FindPath( bool fSignalTaskStatus, bool bDontIgnoreBadLinks )
 		}
 	}
 
+	CFastTimer timer;
+	timer.Start();
+
 	bool bFindResult = DoFindPath();
 
 	if ( !bDontIgnoreBadLinks && !bFindResult && GetOuter()->IsNavigationUrgent() )
@@ -3390,6 +3594,9 @@ bool CAI_Navigator::FindPath( bool fSignalTaskStatus, bool bDontIgnoreBadLinks )
 		bFindResult = DoFindPath();
 	}
 
+	timer.End();
+	g_AIPathRequestScheduler.OnRouteBuilt( timer.GetDuration().GetMillisecondsF() );
+
 	if (bFindResult)
 	{	
 		Forget(bits_MEMORY_PATH_FAILED);
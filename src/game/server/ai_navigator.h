@@ -299,6 +299,9 @@ public:
 
 	// Simple pathfind
 	virtual bool 		SetGoal( const AI_NavGoal_t &goal, unsigned flags = 0 );
+
+	// Should a path task wait for a later frame's route building budget (ai_path_budget_ms)?
+	bool				ShouldDeferPathRequest();
 	
 	// Change the target of the path
 	virtual bool		SetGoalTarget( CBaseEntity *pEntity, const Vector &offset );
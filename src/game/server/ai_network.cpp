@@ -16,6 +16,7 @@
 #include "ai_navigator.h"
 #include "world.h"
 #include "ai_moveprobe.h"
+#include "ai_dynamiclink.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -38,6 +39,7 @@ abstract_class INodeListFilter
 public:
 	virtual bool	NodeIsValid( CAI_Node &node ) = 0;
 	virtual float	NodeDistanceSqr( CAI_Node &node ) = 0;
+	virtual int		HullBits() = 0;
 };
 
 //-------------------------------------
@@ -89,6 +91,13 @@ public:
 			return (node.GetOrigin() - m_pos).LengthSqr();
 	}
 
+	virtual int		HullBits()
+	{
+		if ( m_pNPC && m_pNPC->GetHullType() < NUM_HULLS )
+			return HullToBit( m_pNPC->GetHullType() );
+		return ~0;
+	}
+
 	const Vector &m_pos;
 	CAI_BaseNPC	*m_pNPC;
 	int			m_capabilities;	// cache this
@@ -117,6 +126,10 @@ CAI_Network::CAI_Network()
 		m_NearestCache[node].expiration	= FLT_MIN;
 	}
 
+	m_flGridCellSize = NODE_GRID_CELL_SIZE;
+	m_nGridCellsX = 0;
+	m_nGridCellsY = 0;
+
 #ifdef AI_NODE_TREE
 	m_pNodeTree = NULL;
 #endif
@@ -205,40 +218,38 @@ int CAI_Network::ListNodesInBox( CNodeList &list, int maxListCount, const Vector
 	result.SetLessFunc( CNodeList::RevIsLowerPriority );
 	
 	// NOTE: maxListCount must be > 0 or this will crash
-	bool full = false;
-	float flClosest = 1000000.0 * 1000000;
-	int closest = 0;
-
-// UNDONE: Store the nodes in a tree and query the tree instead of the entire list!!!
-	for ( int node = 0; node < m_iNumNodes; node++ )
+	if ( IsNodeGridValid() )
 	{
-		CAI_Node *pNode = m_pAInode[node];
-		const Vector &origin = pNode->GetOrigin();
-		// in box?
-		if ( origin.x < mins.x || origin.x > maxs.x ||
-			 origin.y < mins.y || origin.y > maxs.y ||
-			 origin.z < mins.z || origin.z > maxs.z )
-			continue;
+		int hullBits = pFilter->HullBits();
 
-		if ( !pFilter->NodeIsValid(*pNode) )
-			continue;
+		int minX = GetNodeGridCell( mins.x, m_vGridMins.x, m_nGridCellsX );
+		int maxX = GetNodeGridCell( maxs.x, m_vGridMins.x, m_nGridCellsX );
+		int minY = GetNodeGridCell( mins.y, m_vGridMins.y, m_nGridCellsY );
+		int maxY = GetNodeGridCell( maxs.y, m_vGridMins.y, m_nGridCellsY );
 
-		float flDist = pFilter->NodeDistanceSqr(*pNode);
-
-		if ( flDist < flClosest )
+		for ( int y = minY; y <= maxY; y++ )
 		{
-			closest = node;
-			flClosest = flDist;
-		}
+			for ( int x = minX; x <= maxX; x++ )
+			{
+				int cell = y * m_nGridCellsX + x;
+				if ( !( m_GridCellHulls[cell] & hullBits ) )
+					continue;
 
-		if ( !full || (flDist < result.ElementAtHead().dist) )
+				int last = m_GridCellFirst[cell + 1];
+				for ( int i = m_GridCellFirst[cell]; i < last; i++ )
+				{
+					int node = m_GridNodes[i];
+					if ( m_NodeHulls[node] & hullBits )
+						ListNodeInBox( result, maxListCount, node, mins, maxs, pFilter );
+				}
+			}
+		}
+	}
+	else
+	{
+		for ( int node = 0; node < m_iNumNodes; node++ )
 		{
-			if ( full )
-				result.RemoveAtHead();
-
-			result.Insert( AI_NearNode_t(node, flDist) );
-	
-			full = (result.Count() == maxListCount);
+			ListNodeInBox( result, maxListCount, node, mins, maxs, pFilter );
 		}
 	}
 	
@@ -252,6 +263,156 @@ int CAI_Network::ListNodesInBox( CNodeList &list, int maxListCount, const Vector
 	return list.Count();
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Adds a node to a ListNodesInBox() result if it's in the box and
+//			closer than the furthest node kept so far
+//-----------------------------------------------------------------------------
+
+void CAI_Network::ListNodeInBox( CNodeList &result, int maxListCount, int node, const Vector &mins, const Vector &maxs, INodeListFilter *pFilter )
+{
+	CAI_Node *pNode = m_pAInode[node];
+	const Vector &origin = pNode->GetOrigin();
+	// in box?
+	if ( origin.x < mins.x || origin.x > maxs.x ||
+		 origin.y < mins.y || origin.y > maxs.y ||
+		 origin.z < mins.z || origin.z > maxs.z )
+		return;
+
+	if ( !pFilter->NodeIsValid(*pNode) )
+		return;
+
+	float flDist = pFilter->NodeDistanceSqr(*pNode);
+
+	bool full = ( result.Count() == maxListCount );
+	if ( !full || (flDist < result.ElementAtHead().dist) )
+	{
+		if ( full )
+			result.RemoveAtHead();
+
+		result.Insert( AI_NearNode_t(node, flDist) );
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+int CAI_Network::GetNodeGridCell( float flCoord, float flMins, int nCells ) const
+{
+	int cell = (int)( ( flCoord - flMins ) / m_flGridCellSize );
+	return clamp( cell, 0, nCells - 1 );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Buckets the nodes into a 2D grid so box queries only look at the
+//			cells they overlap. Each node and cell also records which hulls
+//			have a link out of it, so queries can skip nodes their hull
+//			can never path from.
+//-----------------------------------------------------------------------------
+
+void CAI_Network::BuildNodeGrid()
+{
+	InvalidateNodeGrid();
+
+	// Nodes get moved around in edit mode
+	if ( !m_iNumNodes || engine->IsInEditMode() )
+		return;
+
+	const int allHulls = ( 1 << NUM_HULLS ) - 1;
+
+	Vector mins( FLT_MAX, FLT_MAX, FLT_MAX );
+	Vector maxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+
+	m_NodeHulls.SetCount( m_iNumNodes );
+
+	int node;
+	for ( node = 0; node < m_iNumNodes; node++ )
+	{
+		CAI_Node *pNode = m_pAInode[node];
+
+		int hulls = 0;
+		for ( int link = 0; link < pNode->NumLinks(); link++ )
+		{
+			CAI_Link *pLink = pNode->GetLinkByIndex( link );
+			for ( int hull = 0; hull < NUM_HULLS; hull++ )
+			{
+				if ( pLink->m_iAcceptedMoveTypes[hull] )
+					hulls |= HullToBit( (Hull_t)hull );
+			}
+		}
+
+		// Nodes no hull can leave yet (unlinked, or only dynamic links that are
+		// off) are still valid answers for non-routing queries, so every
+		// query visits them, as the linear scan did
+		m_NodeHulls[node] = ( hulls ) ? hulls : allHulls;
+
+		VectorMin( pNode->GetOrigin(), mins, mins );
+		VectorMax( pNode->GetOrigin(), maxs, maxs );
+	}
+
+	float flExtent = MAX( maxs.x - mins.x, maxs.y - mins.y );
+	float flCellSize = NODE_GRID_CELL_SIZE;
+	if ( flExtent >= flCellSize * ( NODE_GRID_MAX_CELLS - 1 ) )
+	{
+		flCellSize = flExtent / ( NODE_GRID_MAX_CELLS - 1 );
+	}
+
+	int nCellsX = (int)( ( maxs.x - mins.x ) / flCellSize ) + 1;
+	int nCellsY = (int)( ( maxs.y - mins.y ) / flCellSize ) + 1;
+	int nCells = nCellsX * nCellsY;
+
+	m_vGridMins = mins;
+	m_flGridCellSize = flCellSize;
+
+	// Count the nodes in each cell, then lay the cells out back to back
+	CUtlVector<int> nodeCells;
+	nodeCells.SetCount( m_iNumNodes );
+
+	m_GridCellFirst.SetCount( nCells + 1 );
+	m_GridCellHulls.SetCount( nCells );
+	memset( m_GridCellFirst.Base(), 0, m_GridCellFirst.Count() * sizeof(int) );
+	memset( m_GridCellHulls.Base(), 0, m_GridCellHulls.Count() * sizeof(int) );
+
+	for ( node = 0; node < m_iNumNodes; node++ )
+	{
+		const Vector &origin = m_pAInode[node]->GetOrigin();
+		int cell = GetNodeGridCell( origin.y, mins.y, nCellsY ) * nCellsX + GetNodeGridCell( origin.x, mins.x, nCellsX );
+		nodeCells[node] = cell;
+		m_GridCellFirst[cell + 1]++;
+		m_GridCellHulls[cell] |= m_NodeHulls[node];
+	}
+
+	int cell;
+	for ( cell = 0; cell < nCells; cell++ )
+	{
+		m_GridCellFirst[cell + 1] += m_GridCellFirst[cell];
+	}
+
+	CUtlVector<int> cellNext;
+	cellNext.CopyArray( m_GridCellFirst.Base(), nCells );
+
+	m_GridNodes.SetCount( m_iNumNodes );
+	for ( node = 0; node < m_iNumNodes; node++ )
+	{
+		m_GridNodes[cellNext[nodeCells[node]]++] = node;
+	}
+
+	m_nGridCellsX = nCellsX;
+	m_nGridCellsY = nCellsY;
+
+	DevMsg( 2, "AI node grid: %d nodes in %d x %d cells of %.0f units\n", m_iNumNodes, nCellsX, nCellsY, flCellSize );
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_Network::InvalidateNodeGrid()
+{
+	m_nGridCellsX = 0;
+	m_nGridCellsY = 0;
+	m_GridCellFirst.RemoveAll();
+	m_GridNodes.RemoveAll();
+	m_GridCellHulls.RemoveAll();
+	m_NodeHulls.RemoveAll();
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Return ID of node nearest of vecOrigin for pNPC with the given
 //			tolerance distance.  If a route is required to get to the node
@@ -534,6 +695,9 @@ CAI_Node *CAI_Network::AddNode( const Vector &origin, float yaw )
 
 	m_pAInode[m_iNumNodes] = new CAI_Node( m_iNumNodes, origin, yaw );
 
+	InvalidateNodeGrid();
+	InvalidateRouteZones();
+
 #ifdef AI_NODE_TREE
 	if ( !m_pNodeTree )
 	{
@@ -593,6 +757,10 @@ CAI_Link *CAI_Network::CreateLink( int srcID, int destID, CAI_DynamicLink *pDyna
 	pSrcNode->AddLink(pLink);
 	pDestNode->AddLink(pLink);
 
+	// The grid's hull bits don't know about this link
+	InvalidateNodeGrid();
+	InvalidateRouteZones();
+
 	return pLink;
 }
 
@@ -631,6 +799,131 @@ bool CAI_Network::IsConnected(int srcID, int destID)
 	return ( srcZone == destZone );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Returns false if no combination of links usable by the hull and
+//			movement capabilities joins the two nodes, so there is no point
+//			searching for a route. Links that are off but could be allowed for
+//			a specific NPC, and jump links that a hint could enable, are
+//			treated as connected so this never rejects a possible route.
+//-----------------------------------------------------------------------------
+
+bool CAI_Network::IsRouteConnected( int srcID, int destID, Hull_t hull, int capabilities )
+{
+	if ( srcID == destID )
+		return true;
+
+	if ( srcID < 0 || srcID >= m_iNumNodes || destID < 0 || destID >= m_iNumNodes || hull >= NUM_HULLS )
+	{
+		Assert( 0 );
+		return true;
+	}
+
+	// Links come and go in edit mode
+	if ( engine->IsInEditMode() )
+		return true;
+
+	int moveTypes = ( capabilities & AI_MOVE_TYPE_BITS ) | bits_CAP_MOVE_JUMP;
+
+	RouteZones_t &routeZones = GetRouteZones( hull, moveTypes );
+	return ( routeZones.zones[srcID] == routeZones.zones[destID] );
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_Network::InvalidateRouteZones()
+{
+	for ( int i = 0; i < m_RouteZones.Count(); i++ )
+	{
+		m_RouteZones[i].bValid = false;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+CAI_Network::RouteZones_t &CAI_Network::GetRouteZones( Hull_t hull, int moveTypes )
+{
+	int i;
+	for ( i = 0; i < m_RouteZones.Count(); i++ )
+	{
+		if ( m_RouteZones[i].hull == hull && m_RouteZones[i].moveTypes == moveTypes )
+			break;
+	}
+
+	if ( i == m_RouteZones.Count() )
+	{
+		i = m_RouteZones.AddToTail();
+		m_RouteZones[i].hull = hull;
+		m_RouteZones[i].moveTypes = moveTypes;
+		m_RouteZones[i].bValid = false;
+	}
+
+	RouteZones_t &routeZones = m_RouteZones[i];
+	if ( !routeZones.bValid || routeZones.zones.Count() != m_iNumNodes )
+	{
+		BuildRouteZones( routeZones );
+	}
+	return routeZones;
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_Network::BuildRouteZones( RouteZones_t &routeZones )
+{
+	const unsigned short UNKNOWN_ZONE = 0xffff;
+
+	CUtlVector<unsigned short> &zones = routeZones.zones;
+	zones.SetCount( m_iNumNodes );
+
+	int node;
+	for ( node = 0; node < m_iNumNodes; node++ )
+	{
+		zones[node] = UNKNOWN_ZONE;
+	}
+
+	CUtlVector<int> open;
+	open.EnsureCapacity( m_iNumNodes );
+
+	unsigned short curZone = 0;
+	for ( node = 0; node < m_iNumNodes; node++ )
+	{
+		if ( zones[node] != UNKNOWN_ZONE )
+			continue;
+
+		zones[node] = curZone;
+		open.AddToTail( node );
+
+		while ( open.Count() )
+		{
+			int curID = open.Tail();
+			open.FastRemove( open.Count() - 1 );
+
+			CAI_Node *pNode = m_pAInode[curID];
+			for ( int link = 0; link < pNode->NumLinks(); link++ )
+			{
+				CAI_Link *pLink = pNode->GetLinkByIndex( link );
+
+				if ( !( pLink->m_iAcceptedMoveTypes[routeZones.hull] & routeZones.moveTypes ) )
+					continue;
+
+				if ( ( pLink->m_LinkInfo & bits_LINK_OFF ) && 
+					 ( !pLink->m_pDynamicLink || pLink->m_pDynamicLink->m_strAllowUse == NULL_STRING ) )
+					continue;
+
+				int destID = pLink->DestNodeID( curID );
+				if ( zones[destID] == UNKNOWN_ZONE )
+				{
+					zones[destID] = curZone;
+					open.AddToTail( destID );
+				}
+			}
+		}
+
+		curZone++;
+	}
+
+	routeZones.bValid = true;
+}
+
 //-----------------------------------------------------------------------------
 
 IterationRetval_t CAI_Network::EnumElement( IHandleEntity *pHandleEntity )
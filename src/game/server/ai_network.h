@@ -94,6 +94,8 @@ public:
 	CAI_Link *		CreateLink( int srcID, int destID, CAI_DynamicLink *pDynamicLink = NULL );
 
 	bool			IsConnected(int srcID, int destID);	// Use during run time
+	bool			IsRouteConnected( int srcID, int destID, Hull_t hull, int capabilities ); // Use during run time
+	void			InvalidateRouteZones();
 	void			TestIsConnected(int startID, int endID);	// Use only for initialization!
 	
 	Vector			GetNodePosition( CBaseCombatCharacter *pNPC, int nodeID );
@@ -127,6 +129,14 @@ public:
 	}
 	
 	CAI_Node**		AccessNodes() const	{ return m_pAInode; }
+
+	//---------------------------------
+
+	// Spatial index used by the nearest node queries. Built once the graph
+	// is final; any node added afterwards drops back to a linear search.
+	void			BuildNodeGrid();
+	void			InvalidateNodeGrid();
+	bool			IsNodeGridValid() const	{ return ( m_nGridCellsX > 0 ); }
 	
 private:
 	friend class CAI_NetworkManager;
@@ -138,6 +148,7 @@ private:
 	int				GetCachedNode(const Vector &checkPos, Hull_t nHull, int *pCachePos);
 
 	int				ListNodesInBox( CNodeList &list, int maxListCount, const Vector &mins, const Vector &maxs, INodeListFilter *pFilter );
+	void			ListNodeInBox( CNodeList &result, int maxListCount, int node, const Vector &mins, const Vector &maxs, INodeListFilter *pFilter );
 
 	//---------------------------------
 
@@ -167,6 +178,42 @@ private:
 	NearNodeCache_T		m_NearestCache[NEARNODE_CACHE_SIZE];	// Cache of nearest nodes
 	int					m_iNearestCacheNext;					// Oldest record in the cache
 
+	//---------------------------------
+
+	enum
+	{
+		NODE_GRID_CELL_SIZE		= 256,
+		NODE_GRID_MAX_CELLS		= 256,		// Per axis, cell size grows to fit
+	};
+
+	int					GetNodeGridCell( float flCoord, float flMins, int nCells ) const;
+
+	//---------------------------------
+
+	// Connected components of the graph as seen by one hull with one set of
+	// movement capabilities, rebuilt lazily after links change
+	struct RouteZones_t
+	{
+		Hull_t						hull;
+		int							moveTypes;
+		bool						bValid;
+		CUtlVector<unsigned short>	zones;
+	};
+
+	RouteZones_t &	GetRouteZones( Hull_t hull, int moveTypes );
+	void			BuildRouteZones( RouteZones_t &routeZones );
+
+	Vector				m_vGridMins;
+	float				m_flGridCellSize;
+	int					m_nGridCellsX;
+	int					m_nGridCellsY;
+	CUtlVector<int>		m_GridCellFirst;		// Index of the first entry in m_GridNodes for each cell, plus an end marker
+	CUtlVector<int>		m_GridNodes;			// Node IDs bucketed by (x,y) cell
+	CUtlVector<int>		m_GridCellHulls;		// Hull bits with a usable link from some node in the cell
+	CUtlVector<int>		m_NodeHulls;			// Hull bits with a usable link from each node
+
+	CUtlVector<RouteZones_t> m_RouteZones;
+
 #ifdef AI_NODE_TREE
 	ISpatialPartition * m_pNodeTree;
 	CUtlVector<int>		m_GatheredNodes;
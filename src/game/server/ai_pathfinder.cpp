@@ -21,6 +21,8 @@
 #include "ai_dynamiclink.h"
 #include "ai_hint.h"
 #include "bitstring.h"
+#include "tier0/fasttimer.h"
+#include "utlpriorityqueue.h"
 
 //@todo: bad dependency!
 #include "ai_navigator.h"
@@ -272,6 +274,151 @@ int CAI_Pathfinder::NearestNodeToPoint( const Vector &vecOrigin )
 	return GetNetwork()->NearestNodeToPoint( GetOuter(), vecOrigin );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Scratch state for an A* search over the node graph. The per-node
+//			arrays are sized to the network once and tagged with a generation
+//			stamp, so starting a new search never has to touch every node.
+//-----------------------------------------------------------------------------
+
+struct AI_OpenNode_t
+{
+	AI_OpenNode_t() {}
+	AI_OpenNode_t( int id, float f ) { nodeID = id; flF = f; }
+
+	int		nodeID;
+	float	flF;
+};
+
+class CAI_PathfindScratch
+{
+public:
+	CAI_PathfindScratch()
+	 :	m_iGeneration( 0 )
+	{
+		m_Open.SetLessFunc( IsLowerPriority );
+	}
+
+	void Begin( int nNodes )
+	{
+		if ( m_Stamp.Count() != nNodes )
+		{
+			m_Stamp.SetCount( nNodes );
+			m_G.SetCount( nNodes );
+			m_F.SetCount( nNodes );
+			m_Parent.SetCount( nNodes );
+			for ( int i = 0; i < nNodes; i++ )
+				m_Stamp[i] = 0;
+			m_iGeneration = 0;
+		}
+
+		// On wrap, flush the stamps so old generations can't alias the new one
+		if ( ++m_iGeneration == 0 )
+		{
+			for ( int i = 0; i < nNodes; i++ )
+				m_Stamp[i] = 0;
+			m_iGeneration = 1;
+		}
+
+		m_Open.RemoveAll();
+	}
+
+	bool	IsVisited( int nodeID ) const	{ return ( m_Stamp[nodeID] == m_iGeneration ); }
+	float	GetG( int nodeID ) const		{ return IsVisited( nodeID ) ? m_G[nodeID] : FLT_MAX; }
+
+	void Visit( int nodeID, int parentID, float g, float f )
+	{
+		m_Stamp[nodeID]		= m_iGeneration;
+		m_Parent[nodeID]	= parentID;
+		m_G[nodeID]			= g;
+		m_F[nodeID]			= f;
+		m_Open.Insert( AI_OpenNode_t( nodeID, f ) );
+	}
+
+	// Returns NO_NODE when the open list is exhausted. Entries superseded by a
+	// cheaper visit are left in the heap and discarded here.
+	int PopCheapest()
+	{
+		while ( m_Open.Count() )
+		{
+			AI_OpenNode_t top = m_Open.ElementAtHead();
+			m_Open.RemoveAtHead();
+			if ( top.flF == m_F[top.nodeID] )
+				return top.nodeID;
+		}
+		return NO_NODE;
+	}
+
+	int *	GetParents()	{ return m_Parent.Base(); }
+
+private:
+	static bool IsLowerPriority( const AI_OpenNode_t &node1, const AI_OpenNode_t &node2 )
+	{
+		// Cheaper nodes first, ties broken by lowest ID like the old linear scan
+		if ( node1.flF != node2.flF )
+			return ( node1.flF > node2.flF );
+		return ( node1.nodeID > node2.nodeID );
+	}
+
+	CUtlVector<unsigned>	m_Stamp;
+	CUtlVector<float>		m_G;
+	CUtlVector<float>		m_F;
+	CUtlVector<int>			m_Parent;
+	unsigned				m_iGeneration;
+
+	CUtlPriorityQueue<AI_OpenNode_t> m_Open;
+};
+
+// Pathfinding only happens on the main thread, so a single scratch is shared
+// by every NPC.
+static CAI_PathfindScratch g_AIPathfindScratch;
+
+//-----------------------------------------------------------------------------
+// Pathfinding statistics
+//-----------------------------------------------------------------------------
+
+ConVar ai_pathfind_stats( "ai_pathfind_stats", "0", 0, "Accumulate node graph pathfinding statistics (see ai_pathfind_stats_report)" );
+
+struct AI_PathfindStats_t
+{
+	int		nSearches;
+	int		nFailed;
+	int		nRejected;
+	int		nExpanded;
+	int		nVisited;
+	int		nMostExpanded;
+	float	flTotalMs;
+	float	flMaxMs;
+};
+
+static AI_PathfindStats_t g_AIPathfindStats;
+
+CON_COMMAND( ai_pathfind_stats_report, "Report and reset node graph pathfinding statistics" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	const AI_PathfindStats_t &stats = g_AIPathfindStats;
+	if ( !stats.nSearches && !stats.nRejected )
+	{
+		Msg( "No paths searched%s\n", ( ai_pathfind_stats.GetBool() ) ? "" : " (ai_pathfind_stats is 0)" );
+		return;
+	}
+
+	Msg( "Paths rejected: %d (nodes not connected)\n", stats.nRejected );
+	if ( !stats.nSearches )
+	{
+		memset( &g_AIPathfindStats, 0, sizeof( g_AIPathfindStats ) );
+		return;
+	}
+
+	Msg( "Paths searched: %d (%d failed)\n", stats.nSearches, stats.nFailed );
+	Msg( "Nodes expanded: %d total, %.1f per path, %d max\n", stats.nExpanded, (float)stats.nExpanded / stats.nSearches, stats.nMostExpanded );
+	Msg( "Nodes visited:  %d total, %.1f per path\n", stats.nVisited, (float)stats.nVisited / stats.nSearches );
+	Msg( "Time:           %.3f ms total, %.3f ms per path, %.3f ms max\n", stats.flTotalMs, stats.flTotalMs / stats.nSearches, stats.flMaxMs );
+
+	memset( &g_AIPathfindStats, 0, sizeof( g_AIPathfindStats ) );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Build a path between two nodes
 //-----------------------------------------------------------------------------
@@ -287,39 +434,36 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 	m_nPerfStatPB++;
 #endif
 
+	bool bStats = ai_pathfind_stats.GetBool();
+	CFastTimer timer;
+	if ( bStats )
+		timer.Start();
+
+	int nExpanded = 0;
+	int nVisited = 1;
+
 	int nNodes = GetNetwork()->NumNodes();
 	CAI_Node **pAInode = GetNetwork()->AccessNodes();
 
-	CVarBitVec	openBS(nNodes);
-	CVarBitVec	closeBS(nNodes);
+	Hull_t hull = GetHullType();
+	int capabilities = CapabilitiesGet();
+	CAI_Navigator *pNavigator = GetOuter()->GetNavigator();
+	Vector vEnd = pAInode[endID]->GetPosition(hull);
 
 	// ------------- INITIALIZE ------------------------
-	float* nodeG = (float *)stackalloc( nNodes * sizeof(float) );
-	float* nodeH = (float *)stackalloc( nNodes * sizeof(float) );
-	float* nodeF = (float *)stackalloc( nNodes * sizeof(float) );
-	int*   nodeP = (int *)stackalloc( nNodes * sizeof(int) );		// Node parent 
-
-	for (int node=0;node<nNodes;node++)
-	{
-		nodeG[node] = FLT_MAX;
-		nodeP[node] = -1;
-	}
-
-	nodeG[startID] = 0;
+	Assert( ThreadInMainThread() );
+	CAI_PathfindScratch &scratch = g_AIPathfindScratch;
+	scratch.Begin( nNodes );
 
-	nodeH[startID] = 0.1*(pAInode[startID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length(); // Don't want to over estimate
-	nodeF[startID] = nodeG[startID] + nodeH[startID];
+	float startH = 0.1*(pAInode[startID]->GetPosition(hull)-vEnd).Length(); // Don't want to over estimate
+	scratch.Visit( startID, NO_NODE, 0, startH );
 
-	openBS.Set(startID);
-	closeBS.Set( startID );
+	AI_Waypoint_t *pResult = NULL;
 
 	// --------------- FIND BEST PATH ------------------
-	while (!openBS.IsAllClear()) 
+	int smallestID;
+	while ( ( smallestID = scratch.PopCheapest() ) != NO_NODE ) 
 	{
-		int smallestID = CAI_Network::FindBSSmallest(&openBS,nodeF,nNodes);
-	
-		openBS.Clear(smallestID);
-
 		CAI_Node *pSmallestNode = pAInode[smallestID];
 		
 		if (GetOuter()->IsUnusableNode(smallestID, pSmallestNode->GetHint()))
@@ -327,10 +471,14 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 
 		if (smallestID == endID) 
 		{
-			AI_Waypoint_t* route = MakeRouteFromParents(&nodeP[0], endID);
-			return route;
+			pResult = MakeRouteFromParents(scratch.GetParents(), endID);
+			break;
 		}
 
+		nExpanded++;
+
+		float smallestG = scratch.GetG( smallestID );
+
 		// Check this if the node is immediately in the path after the startNode 
 		// that it isn't blocked
 		for (int link=0; link < pSmallestNode->NumLinks();link++) 
@@ -341,32 +489,44 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 				continue;
 
 			// FIXME: the cost function should take into account Node costs (danger, flanking, etc).
-			int moveType = nodeLink->m_iAcceptedMoveTypes[GetHullType()] & CapabilitiesGet();
+			int moveType = nodeLink->m_iAcceptedMoveTypes[hull] & capabilities;
 			int testID	 = nodeLink->DestNodeID(smallestID);
 
-			Vector r1 = pSmallestNode->GetPosition(GetHullType());
-			Vector r2 = pAInode[testID]->GetPosition(GetHullType());
-			float dist   = GetOuter()->GetNavigator()->MovementCost( moveType, r1, r2 ); // MovementCost takes ref parameters!!
+			Vector r1 = pSmallestNode->GetPosition(hull);
+			Vector r2 = pAInode[testID]->GetPosition(hull);
+			float dist   = pNavigator->MovementCost( moveType, r1, r2 ); // MovementCost takes ref parameters!!
 
 			if ( dist == FLT_MAX )
 				continue;
 
-			float new_g  = nodeG[smallestID] + dist;
+			float new_g  = smallestG + dist;
 
-			if ( !closeBS.IsBitSet(testID) || (new_g < nodeG[testID]) ) 
+			if ( !scratch.IsVisited(testID) || (new_g < scratch.GetG(testID)) ) 
 			{
-				nodeP[testID] = smallestID;
-				nodeG[testID] = new_g;
-				nodeH[testID] = (pAInode[testID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length();
-				nodeF[testID] = nodeG[testID] + nodeH[testID];
-
-				closeBS.Set( testID );
-				openBS.Set( testID );
+				float new_h = (pAInode[testID]->GetPosition(hull)-vEnd).Length();
+				scratch.Visit( testID, smallestID, new_g, new_g + new_h );
+				nVisited++;
 			}
 		}
 	}
 
-	return NULL;   
+	if ( bStats )
+	{
+		timer.End();
+		float flMs = timer.GetDuration().GetMillisecondsF();
+
+		AI_PathfindStats_t &stats = g_AIPathfindStats;
+		stats.nSearches++;
+		if ( !pResult )
+			stats.nFailed++;
+		stats.nExpanded += nExpanded;
+		stats.nVisited += nVisited;
+		stats.nMostExpanded = MAX( stats.nMostExpanded, nExpanded );
+		stats.flTotalMs += flMs;
+		stats.flMaxMs = MAX( stats.flMaxMs, flMs );
+	}
+
+	return pResult;
 }
 
 //-----------------------------------------------------------------------------
@@ -1802,9 +1962,19 @@ AI_Waypoint_t *CAI_Pathfinder::BuildNodeRoute(const Vector &vStart, const Vector
 		return srcRoute;
 	}
 
-	// If nodes are not connected by network graph, no route is possible
-	if (!GetNetwork()->IsConnected(srcID, destID))
+	// If nodes are not connected by network graph, or not by any links
+	// this NPC could use, no route is possible
+	if ( !GetNetwork()->IsConnected(srcID, destID) || 
+		 !GetNetwork()->IsRouteConnected( srcID, destID, GetHullType(), CapabilitiesGet() ) )
+	{
+		if ( ai_pathfind_stats.GetBool() )
+			g_AIPathfindStats.nRejected++;
+
+		DeleteAll(srcRoute);
+		DeleteAll(destRoute);
+		DbgNavMsg2( GetOuter(), "Node pathfind failed, %d and %d are not connected\n", srcID, destID );
 		return NULL;
+	}
 
 	AI_Waypoint_t *path = FindBestPath(srcID, destID);
 
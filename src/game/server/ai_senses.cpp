@@ -13,6 +13,7 @@
 #include "team.h"
 #include "ai_basenpc.h"
 #include "saverestore_utlvector.h"
+#include "collisionutils.h"
 
 #ifdef PORTAL
 	#include "portal_util_shared.h"
@@ -35,9 +36,16 @@ const float AI_EFFICIENT_NPC_SEARCH_TIME = .35;
 const float AI_HIGH_PRIORITY_SEARCH_TIME = 0.15;
 const float AI_MISC_SEARCH_TIME  = 0.45;
 
+ConVar ai_shared_sensing( "ai_shared_sensing", "1", 0, "Share line of sight results between nearby squad members within a frame" );
+ConVar ai_shared_sensing_cell( "ai_shared_sensing_cell", "96", 0, "Size of the grid cell squad members must share to share line of sight results", true, 1.0f, false, 0.0f );
+ConVar ai_sensing_budget( "ai_sensing_budget", "0", 0, "Most full NPC/object looks per frame, 0 for no limit. Looks are never deferred past twice their interval" );
+
 //-----------------------------------------------------------------------------
 
 CAI_SensedObjectsManager g_AI_SensedObjectsManager;
+CAI_SharedSensing g_AI_SharedSensing;
+
+extern ConVar ai_LOS_mode;
 
 //-----------------------------------------------------------------------------
 
@@ -446,7 +454,8 @@ int CAI_Senses::LookForNPCs( int iDistance )
 	const Vector &origin = GetAbsOrigin();
 	AI_Efficiency_t efficiency = GetOuter()->GetEfficiency();
 	float timeNPCs = ( efficiency < AIE_VERY_EFFICIENT ) ? AI_STANDARD_NPC_SEARCH_TIME : AI_EFFICIENT_NPC_SEARCH_TIME;
-	if ( gpGlobals->curtime - m_TimeLastLookNPCs > timeNPCs )
+	float timeSinceLook = gpGlobals->curtime - m_TimeLastLookNPCs;
+	if ( timeSinceLook > timeNPCs && g_AI_SharedSensing.AllowFullLook( timeSinceLook > timeNPCs * 2 ) )
 	{
 		AI_PROFILE_SENSES(CAI_Senses_LookForNPCs);
 
@@ -507,7 +516,8 @@ int CAI_Senses::LookForObjects( int iDistance )
 	const int BOX_QUERY_MASK = FL_OBJECT;
 	int	nSeen = 0;
 
-	if ( gpGlobals->curtime - m_TimeLastLookMisc > AI_MISC_SEARCH_TIME )
+	float timeSinceLook = gpGlobals->curtime - m_TimeLastLookMisc;
+	if ( timeSinceLook > AI_MISC_SEARCH_TIME && g_AI_SharedSensing.AllowFullLook( timeSinceLook > AI_MISC_SEARCH_TIME * 2 ) )
 	{
 		AI_PROFILE_SENSES(CAI_Senses_LookForObjects);
 		m_TimeLastLookMisc = gpGlobals->curtime;
@@ -663,6 +673,237 @@ void CAI_Senses::PerformSensing( void )
 		Listen();
 }
 
+//=============================================================================
+//
+// CAI_SharedSensing
+//
+//=============================================================================
+
+CAI_SharedSensing::CAI_SharedSensing()
+ :	m_Results( 0, 0, CResultLess( 0 ) ),
+	m_flResultsTime( -1 ),
+	m_nFullLooks( 0 ),
+	m_nShared( 0 ),
+	m_nTraced( 0 ),
+	m_nDeferredLooks( 0 )
+{
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_SharedSensing::CResultLess::operator()( const Result_t &lhs, const Result_t &rhs ) const
+{
+	return ( memcmp( &lhs, &rhs, offsetof( Result_t, hBlocker ) ) < 0 );
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_SharedSensing::CheckFrame()
+{
+	if ( m_flResultsTime != gpGlobals->curtime )
+	{
+		m_Results.RemoveAll();
+		m_nFullLooks = 0;
+		m_flResultsTime = gpGlobals->curtime;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_SharedSensing::MakeKey( CAI_BaseNPC *pObserver, CBaseEntity *pTarget, int traceMask, Result_t *pKey )
+{
+	if ( !ai_shared_sensing.GetBool() || ai_LOS_mode.GetBool() || !pObserver->GetSquad() )
+		return false;
+
+	if ( pTarget->GetFlags() & FL_NOTARGET )
+		return false;
+
+	// Clear the padding too, the key is compared with memcmp
+	memset( pKey, 0, sizeof( *pKey ) );
+
+	float flCellSize = ai_shared_sensing_cell.GetFloat();
+	Vector vecEyes = pObserver->EyePosition();
+
+	pKey->pSquad = pObserver->GetSquad();
+	pKey->cell[0] = (int)floor( vecEyes.x / flCellSize );
+	pKey->cell[1] = (int)floor( vecEyes.y / flCellSize );
+	pKey->cell[2] = (int)floor( vecEyes.z / flCellSize );
+	pKey->pTarget = pTarget;
+	pKey->traceMask = traceMask;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The same filter CBaseEntity::FVisible uses, noting whether the trace
+//			met a character other than the looker and its target. Such a trace
+//			depends on who is looking (the looker itself is skipped), so it
+//			can't stand in for a squad mate's.
+//-----------------------------------------------------------------------------
+
+class CTraceFilterSharedLOS : public CTraceFilterLOS
+{
+public:
+	CTraceFilterSharedLOS( CAI_BaseNPC *pObserver, CBaseEntity *pTarget )
+	 :	CTraceFilterLOS( pObserver, COLLISION_GROUP_NONE, pTarget ),
+		m_pTarget( pTarget ),
+		m_bMetCharacter( false )
+	{
+	}
+
+	bool ShouldHitEntity( IHandleEntity *pHandleEntity, int contentsMask )
+	{
+		if ( !CTraceFilterLOS::ShouldHitEntity( pHandleEntity, contentsMask ) )
+			return false;
+
+		CBaseEntity *pEntity = EntityFromEntityHandle( pHandleEntity );
+		if ( pEntity && pEntity != m_pTarget && pEntity->MyCombatCharacterPointer() )
+		{
+			m_bMetCharacter = true;
+		}
+		return true;
+	}
+
+	bool MetCharacter() const { return m_bMetCharacter; }
+
+private:
+	CBaseEntity *m_pTarget;
+	bool m_bMetCharacter;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Same test as CBaseEntity::FVisible
+//-----------------------------------------------------------------------------
+
+bool CAI_SharedSensing::TraceLOS( CAI_BaseNPC *pObserver, CBaseEntity *pTarget, int traceMask, CBaseEntity **ppBlocker, bool *pbShareable )
+{
+	// If we're doing an LOS search, include NPCs.
+	if ( traceMask == MASK_BLOCKLOS )
+	{
+		traceMask = MASK_BLOCKLOS_AND_NPCS;
+	}
+
+	trace_t tr;
+	CTraceFilterSharedLOS traceFilter( pObserver, pTarget );
+	UTIL_TraceLine( pObserver->EyePosition(), pTarget->EyePosition(), traceMask, &traceFilter, &tr );
+
+	*pbShareable = !traceFilter.MetCharacter();
+
+	if ( tr.fraction != 1.0 || tr.startsolid )
+	{
+		if ( tr.m_pEnt == pTarget )
+			return true;
+
+		if ( pTarget->IsPlayer() && tr.m_pEnt == assert_cast<CBasePlayer *>( pTarget )->GetVehicleEntity() )
+			return true;
+
+		*ppBlocker = tr.m_pEnt;
+		return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The NPC that made a shared trace skipped itself. Would it have been
+//			in the way of the squad mate now reusing the result?
+//-----------------------------------------------------------------------------
+
+bool CAI_SharedSensing::ObserverBlocks( CBaseEntity *pTracer, CAI_BaseNPC *pObserver, CBaseEntity *pTarget )
+{
+	if ( !pTracer || pTracer == pObserver || !pTracer->BlocksLOS() )
+		return false;
+
+	Vector vecMins, vecMaxs;
+	pTracer->CollisionProp()->WorldSpaceAABB( &vecMins, &vecMaxs );
+
+	Vector vecStart = pObserver->EyePosition();
+	return IsBoxIntersectingRay( vecMins, vecMaxs, vecStart, pTarget->EyePosition() - vecStart );
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_SharedSensing::FVisible( CAI_BaseNPC *pObserver, CBaseEntity *pTarget, int traceMask, bool *pbVisible, CBaseEntity **ppBlocker )
+{
+	Result_t key;
+	if ( !MakeKey( pObserver, pTarget, traceMask, &key ) )
+		return false;
+
+	CheckFrame();
+
+	int i = m_Results.Find( key );
+	if ( i != m_Results.InvalidIndex() && !ObserverBlocks( m_Results[i].hObserver, pObserver, pTarget ) )
+	{
+		m_nShared++;
+
+		*pbVisible = m_Results[i].bVisible;
+		if ( !*pbVisible && ppBlocker )
+		{
+			*ppBlocker = m_Results[i].hBlocker;
+		}
+		return true;
+	}
+
+	m_nTraced++;
+
+	CBaseEntity *pBlocker = NULL;
+	bool bShareable;
+	*pbVisible = TraceLOS( pObserver, pTarget, traceMask, &pBlocker, &bShareable );
+	if ( !*pbVisible && ppBlocker )
+	{
+		*ppBlocker = pBlocker;
+	}
+
+	if ( bShareable && i == m_Results.InvalidIndex() )
+	{
+		key.hObserver = pObserver;
+		key.hBlocker = pBlocker;
+		key.bVisible = *pbVisible;
+		m_Results.Insert( key );
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_SharedSensing::AllowFullLook( bool bOverdue )
+{
+	int nBudget = ai_sensing_budget.GetInt();
+	if ( nBudget <= 0 )
+		return true;
+
+	CheckFrame();
+
+	if ( m_nFullLooks >= nBudget && !bOverdue )
+	{
+		m_nDeferredLooks++;
+		return false;
+	}
+
+	m_nFullLooks++;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_SharedSensing::ReportStats()
+{
+	int nTotal = m_nShared + m_nTraced;
+	Msg( "Squad line of sight checks: %d (%d shared, %d traced, %.0f%% saved)\n", 
+		 nTotal, m_nShared, m_nTraced, ( nTotal ) ? 100.0f * m_nShared / nTotal : 0.0f );
+	Msg( "Full looks deferred by ai_sensing_budget: %d\n", m_nDeferredLooks );
+
+	m_nShared = m_nTraced = m_nDeferredLooks = 0;
+}
+
+CON_COMMAND( ai_shared_sensing_report, "Report and reset shared sensing statistics" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	g_AI_SharedSensing.ReportStats();
+}
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
@@ -20,6 +20,8 @@
 
 class CBaseEntity;
 class CSound;
+class CAI_BaseNPC;
+class CAI_Squad;
 
 //-------------------------------------
 
@@ -163,6 +165,70 @@ private:
 extern CAI_SensedObjectsManager g_AI_SensedObjectsManager;
 
 //-----------------------------------------------------------------------------
+// class CAI_SharedSensing
+//
+// Purpose: Per-frame sensing shared between NPCs. Line of sight results are
+//			kept for the frame per (observer cluster, target), where a cluster
+//			is the members of a squad whose eyes lie in the same grid cell, so
+//			squad mates looking at the same target only trace once. Only traces
+//			that met no other character are shared, so the result is the one
+//			each member's own trace would give. Also meters out the expensive
+//			full looks across frames.
+//-----------------------------------------------------------------------------
+
+class CAI_SharedSensing
+{
+public:
+	CAI_SharedSensing();
+
+	// Returns false if the observer doesn't share line of sight results
+	bool			FVisible( CAI_BaseNPC *pObserver, CBaseEntity *pTarget, int traceMask, bool *pbVisible, CBaseEntity **ppBlocker );
+
+	// Returns false if this frame's budget of full looks is spent and the look isn't overdue
+	bool			AllowFullLook( bool bOverdue );
+
+	void			ReportStats();
+
+private:
+	struct Result_t
+	{
+		// Key
+		CAI_Squad *		pSquad;
+		int				cell[3];
+		CBaseEntity *	pTarget;
+		int				traceMask;
+
+		// Data
+		EHANDLE			hObserver;
+		EHANDLE			hBlocker;
+		bool			bVisible;
+	};
+
+	class CResultLess
+	{
+	public:
+		CResultLess( int ) {}
+		bool operator!() const { return false; }
+		bool operator()( const Result_t &lhs, const Result_t &rhs ) const;
+	};
+
+	bool			MakeKey( CAI_BaseNPC *pObserver, CBaseEntity *pTarget, int traceMask, Result_t *pKey );
+	bool			TraceLOS( CAI_BaseNPC *pObserver, CBaseEntity *pTarget, int traceMask, CBaseEntity **ppBlocker, bool *pbShareable );
+	bool			ObserverBlocks( CBaseEntity *pTracer, CAI_BaseNPC *pObserver, CBaseEntity *pTarget );
+	void			CheckFrame();
+
+	CUtlRBTree<Result_t, int, CResultLess> m_Results;
+	float			m_flResultsTime;
+	int				m_nFullLooks;
+
+	int				m_nShared;
+	int				m_nTraced;
+	int				m_nDeferredLooks;
+};
+
+extern CAI_SharedSensing g_AI_SharedSensing;
+
+//-----------------------------------------------------------------------------
 
 
 
@@ -13,6 +13,7 @@
 #include "gamerules.h"
 #include "ai_basenpc.h"
 #include "ai_squadslot.h"
+#include "ai_senses.h"
 #include "ammodef.h"
 #include "ndebugoverlay.h"
 #include "player.h"
@@ -399,7 +400,13 @@ bool CBaseCombatCharacter::FVisible( CBaseEntity *pEntity, int traceMask, CBaseE
 		ppBlocker = &pBlocker;
 	}
 
-	bool bResult = BaseClass::FVisible( pEntity, traceMask, ppBlocker );
+	// Squad mates standing together share the trace
+	bool bResult;
+	CAI_BaseNPC *pNPC = MyNPCPointer();
+	if ( !pNPC || !g_AI_SharedSensing.FVisible( pNPC, pEntity, traceMask, &bResult, ppBlocker ) )
+	{
+		bResult = BaseClass::FVisible( pEntity, traceMask, ppBlocker );
+	}
 
 	if ( !bResult )
 	{
@@ -62,6 +62,7 @@
 #include "env_debughistory.h"
 #include "tier1/utlstring.h"
 #include "utlhashtable.h"
+#include "entityprofile.h"
 
 #if defined( TF_DLL )
 #include "tf_gamerules.h"
@@ -613,6 +614,13 @@ CBaseEntity *CBaseEntity::GetFollowedEntity()
 void CBaseEntity::SetClassname( const char *className )
 {
 	m_iClassname = AllocPooledString( className );
+	gEntList.OnEntityClassnameChanged( this );
+}
+
+void CBaseEntity::SetName( string_t newName )
+{
+	m_iName = newName;
+	gEntList.OnEntityNameChanged( this );
 }
 
 void CBaseEntity::SetModelIndex( int index )
@@ -3224,6 +3232,10 @@ int CBaseEntity::Restore( IRestore &restore )
 		m_hGroundEntity->AddEntityToGroundList( this );
 	}
 
+	// The names were read straight into the fields
+	gEntList.OnEntityNameChanged( this );
+	gEntList.OnEntityClassnameChanged( this );
+
 	return status;
 }
 
@@ -3869,6 +3881,8 @@ ConVar ent_messages_draw( "ent_messages_draw", "0", FCVAR_CHEAT, "Visualizes all
 //-----------------------------------------------------------------------------
 bool CBaseEntity::AcceptInput( const char *szInputName, CBaseEntity *pActivator, CBaseEntity *pCaller, variant_t Value, int outputID )
 {
+	ENTITY_PROFILE_SCOPE( this, ENTITY_PROFILE_INPUT );
+
 	if ( ent_messages_draw.GetBool() )
 	{
 		if ( pCaller != NULL )
@@ -77,6 +77,7 @@ class CAI_BaseNPC;
 class CAI_Senses;
 class CSquadNPC;
 class variant_t;
+class CThinkCommandBuffer;
 class CEventAction;
 typedef struct KeyValueData_s KeyValueData;
 class CUserCmd;
@@ -752,6 +753,13 @@ public:
 	void (CBaseEntity::*m_pfnThink)(void);
 	virtual void Think( void ) { if (m_pfnThink) (this->*m_pfnThink)();};
 
+	// Parallel thinking (sv_parallel_think).  Called on the main thread when the base think
+	// is due; return true to have ParallelThink() run on a worker thread this tick instead of
+	// Think().  ParallelThink() may only read shared state and write the entity's own members,
+	// everything else goes through the command buffer.
+	virtual bool PrepareParallelThink( void ) { return false; }
+	virtual void ParallelThink( CThinkCommandBuffer &commands ) {}
+
 	// Think functions with contexts
 	int		RegisterThinkContext( const char *szContext );
 	BASEPTR	ThinkSet( BASEPTR func, float flNextThinkTime = 0, const char *szContext = NULL );
@@ -1436,6 +1444,8 @@ public:
 	void					PhysicsCheckForEntityUntouch( void );
  	bool					PhysicsRunThink( thinkmethods_t thinkMethod = THINK_FIRE_ALL_FUNCTIONS );
 	bool					PhysicsRunSpecificThink( int nContextIndex, BASEPTR thinkFunc );
+	bool					PhysicsBeginParallelThink( void );
+	void					PhysicsEndParallelThink( CThinkCommandBuffer &commands );
 	bool					PhysicsTestEntityPosition( CBaseEntity **ppEntity = NULL );
 	void					PhysicsPushEntity( const Vector& push, trace_t *pTrace );
 	bool					PhysicsCheckWater( void );
@@ -1919,12 +1929,6 @@ inline string_t CBaseEntity::GetEntityName()
 	return m_iName; 
 }
 
-inline void CBaseEntity::SetName( string_t newName )
-{
-	m_iName = newName;
-}
-
-
 inline bool CBaseEntity::NameMatches( const char *pszNameOrWildcard )
 {
 	if ( IDENT_STRINGS(m_iName, pszNameOrWildcard) )
@@ -86,6 +86,8 @@ OUTPUTS:
 #include "env_debughistory.h"
 
 #include "tier0/vprof.h"
+#include "tier0/fasttimer.h"
+#include "vstdlib/random.h"
 
 //HL1
 #include	"extdll.h"
@@ -645,8 +647,10 @@ CEventQueue g_EventQueue;
 
 CEventQueue::CEventQueue()
 {
-	m_Events.m_flFireTime = -FLT_MAX;
-	m_Events.m_pNext = NULL;
+	m_nNextSequence = 0;
+	m_pFiringEvent = NULL;
+	memset( m_pEventsByCaller, 0, sizeof( m_pEventsByCaller ) );
+	memset( m_pEventsByTarget, 0, sizeof( m_pEventsByTarget ) );
 
 	Init();
 }
@@ -760,27 +764,24 @@ void CEventQueue::Init( void )
 void CEventQueue::Clear( void )
 {
 	// delete all the events in the queue
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
-	
-	while ( pe != NULL )
+	while ( m_Heap.Count() )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
-		delete pe;
-		pe = next;
+		DeleteEvent( m_Heap[ m_Heap.Count() - 1 ] );
 	}
 
-	m_Events.m_pNext = NULL;
+	m_Heap.Purge();
 }
 
 void CEventQueue::Dump( void )
 {
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
+	CUtlVector< EventQueuePrioritizedEvent_t * > events;
+	GetEventsInFireOrder( events );
 
 	Msg( "Dumping event queue. Current time is: %.2f\n", engine->GetServerTime() );
 
-	while ( pe != NULL )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
+		EventQueuePrioritizedEvent_t *pe = events[ i ];
 
 		Msg("   (%.2f) Target: '%s', Input: '%s', Parameter '%s'. Activator: '%s', Caller '%s'.  \n", 
 			pe->m_flFireTime, 
@@ -789,8 +790,6 @@ void CEventQueue::Dump( void )
 			pe->m_VariantValue.String(),
 			pe->m_pActivator ? pe->m_pActivator->GetDebugName() : "None", 
 			pe->m_pCaller ? pe->m_pCaller->GetDebugName() : "None"  );
-
-		pe = next;
 	}
 
 	Msg("Finished dump.\n");
@@ -844,40 +843,194 @@ void CEventQueue::AddEvent( CBaseEntity *target, const char *action, float fireD
 
 
 //-----------------------------------------------------------------------------
-// Purpose: private function, adds an event into the list
+// Purpose: heap order, earlier fire time first and then the order events were
+//			added in, which is the order the old sorted list dispatched them in
+//-----------------------------------------------------------------------------
+inline bool CEventQueue::FiresBefore( const EventQueuePrioritizedEvent_t *a, const EventQueuePrioritizedEvent_t *b )
+{
+	if ( a->m_flFireTime != b->m_flFireTime )
+		return a->m_flFireTime < b->m_flFireTime;
+
+	// wrap safe
+	return (int)( a->m_nSequence - b->m_nSequence ) < 0;
+}
+
+void CEventQueue::HeapUp( int i )
+{
+	EventQueuePrioritizedEvent_t *pe = m_Heap[ i ];
+	while ( i > 0 )
+	{
+		int parent = ( i - 1 ) / 2;
+		if ( !FiresBefore( pe, m_Heap[ parent ] ) )
+			break;
+
+		m_Heap[ i ] = m_Heap[ parent ];
+		m_Heap[ i ]->m_iHeapIndex = i;
+		i = parent;
+	}
+
+	m_Heap[ i ] = pe;
+	pe->m_iHeapIndex = i;
+}
+
+void CEventQueue::HeapDown( int i )
+{
+	EventQueuePrioritizedEvent_t *pe = m_Heap[ i ];
+	int count = m_Heap.Count();
+	while ( 1 )
+	{
+		int child = 2 * i + 1;
+		if ( child >= count )
+			break;
+
+		if ( child + 1 < count && FiresBefore( m_Heap[ child + 1 ], m_Heap[ child ] ) )
+		{
+			child++;
+		}
+
+		if ( !FiresBefore( m_Heap[ child ], pe ) )
+			break;
+
+		m_Heap[ i ] = m_Heap[ child ];
+		m_Heap[ i ]->m_iHeapIndex = i;
+		i = child;
+	}
+
+	m_Heap[ i ] = pe;
+	pe->m_iHeapIndex = i;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: copies the queued events out sorted by the order they will fire in
+//-----------------------------------------------------------------------------
+static int __cdecl EventFireOrderSortFunc( EventQueuePrioritizedEvent_t * const *a, EventQueuePrioritizedEvent_t * const *b )
+{
+	if ( (*a)->m_flFireTime != (*b)->m_flFireTime )
+		return ( (*a)->m_flFireTime < (*b)->m_flFireTime ) ? -1 : 1;
+	return (int)( (*a)->m_nSequence - (*b)->m_nSequence );
+}
+
+void CEventQueue::GetEventsInFireOrder( CUtlVector< EventQueuePrioritizedEvent_t * > &events )
+{
+	events.CopyArray( m_Heap.Base(), m_Heap.Count() );
+	events.Sort( EventFireOrderSortFunc );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: private function, adds an event into the queue
 // Input  : *newEvent - the (already built) event to add
 //-----------------------------------------------------------------------------
 void CEventQueue::AddEvent( EventQueuePrioritizedEvent_t *newEvent )
 {
-	// loop through the actions looking for a place to insert
-	EventQueuePrioritizedEvent_t *pe;
-	for ( pe = &m_Events; pe->m_pNext != NULL; pe = pe->m_pNext )
+	newEvent->m_nSequence = m_nNextSequence++;
+
+	newEvent->m_iHeapIndex = m_Heap.AddToTail( newEvent );
+	HeapUp( newEvent->m_iHeapIndex );
+
+	// link it to the entities that can cancel it
+	CBaseEntity *pCaller = newEvent->m_pCaller;
+	newEvent->m_iCallerSlot = pCaller ? pCaller->GetRefEHandle().GetEntryIndex() : -1;
+	newEvent->m_pPrevByCaller = NULL;
+	newEvent->m_pNextByCaller = NULL;
+	if ( newEvent->m_iCallerSlot != -1 )
 	{
-		if ( pe->m_pNext->m_flFireTime > newEvent->m_flFireTime )
+		EventQueuePrioritizedEvent_t *&pHead = m_pEventsByCaller[ newEvent->m_iCallerSlot ];
+		newEvent->m_pNextByCaller = pHead;
+		if ( pHead )
 		{
-			break;
+			pHead->m_pPrevByCaller = newEvent;
 		}
+		pHead = newEvent;
 	}
 
-	Assert( pe );
-
-	// insert
-	newEvent->m_pNext = pe->m_pNext;
-	newEvent->m_pPrev = pe;
-	pe->m_pNext = newEvent;
-	if ( newEvent->m_pNext )
+	CBaseEntity *pTarget = newEvent->m_pEntTarget;
+	newEvent->m_iTargetSlot = pTarget ? pTarget->GetRefEHandle().GetEntryIndex() : -1;
+	newEvent->m_pPrevByTarget = NULL;
+	newEvent->m_pNextByTarget = NULL;
+	if ( newEvent->m_iTargetSlot != -1 )
 	{
-		newEvent->m_pNext->m_pPrev = newEvent;
+		EventQueuePrioritizedEvent_t *&pHead = m_pEventsByTarget[ newEvent->m_iTargetSlot ];
+		newEvent->m_pNextByTarget = pHead;
+		if ( pHead )
+		{
+			pHead->m_pPrevByTarget = newEvent;
+		}
+		pHead = newEvent;
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: takes an event out of the queue without freeing it
+//-----------------------------------------------------------------------------
 void CEventQueue::RemoveEvent( EventQueuePrioritizedEvent_t *pe )
 {
-	Assert( pe->m_pPrev );
-	pe->m_pPrev->m_pNext = pe->m_pNext;
-	if ( pe->m_pNext )
+	int i = pe->m_iHeapIndex;
+	Assert( i >= 0 && i < m_Heap.Count() && m_Heap[ i ] == pe );
+	if ( i < 0 )
+		return;
+
+	// fill the hole with the last event and move that up or down into place
+	int last = m_Heap.Count() - 1;
+	EventQueuePrioritizedEvent_t *pMoved = m_Heap[ last ];
+	m_Heap.FastRemove( last );
+	if ( i != last )
+	{
+		m_Heap[ i ] = pMoved;
+		pMoved->m_iHeapIndex = i;
+		HeapUp( i );
+		HeapDown( pMoved->m_iHeapIndex );
+	}
+	pe->m_iHeapIndex = -1;
+
+	if ( pe->m_iCallerSlot != -1 )
 	{
-		pe->m_pNext->m_pPrev = pe->m_pPrev;
+		if ( pe->m_pPrevByCaller )
+		{
+			pe->m_pPrevByCaller->m_pNextByCaller = pe->m_pNextByCaller;
+		}
+		else
+		{
+			m_pEventsByCaller[ pe->m_iCallerSlot ] = pe->m_pNextByCaller;
+		}
+		if ( pe->m_pNextByCaller )
+		{
+			pe->m_pNextByCaller->m_pPrevByCaller = pe->m_pPrevByCaller;
+		}
+		pe->m_iCallerSlot = -1;
+	}
+
+	if ( pe->m_iTargetSlot != -1 )
+	{
+		if ( pe->m_pPrevByTarget )
+		{
+			pe->m_pPrevByTarget->m_pNextByTarget = pe->m_pNextByTarget;
+		}
+		else
+		{
+			m_pEventsByTarget[ pe->m_iTargetSlot ] = pe->m_pNextByTarget;
+		}
+		if ( pe->m_pNextByTarget )
+		{
+			pe->m_pNextByTarget->m_pPrevByTarget = pe->m_pPrevByTarget;
+		}
+		pe->m_iTargetSlot = -1;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: removes and frees an event, unless it's the one being serviced
+//			right now, which ServiceEvents frees once its inputs return
+//-----------------------------------------------------------------------------
+void CEventQueue::DeleteEvent( EventQueuePrioritizedEvent_t *pe )
+{
+	if ( pe->m_iHeapIndex != -1 )
+	{
+		RemoveEvent( pe );
+	}
+
+	if ( pe != m_pFiringEvent )
+	{
+		delete pe;
 	}
 }
 
@@ -892,12 +1045,15 @@ void CEventQueue::ServiceEvents( void )
 		return;
 	}
 
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
-
-	while ( pe != NULL && pe->m_flFireTime <= engine->GetServerTime() )
+	while ( m_Heap.Count() && m_Heap[ 0 ]->m_flFireTime <= engine->GetServerTime() )
 	{
 		MDLCACHE_CRITICAL_SECTION();
 
+		// stays queued while its inputs run, like it always has, so it can be
+		// seen by HasEventPending and cancelled
+		EventQueuePrioritizedEvent_t *pe = m_Heap[ 0 ];
+		m_pFiringEvent = pe;
+
 		bool targetFound = false;
 
 		// find the targets
@@ -961,9 +1117,9 @@ void CEventQueue::ServiceEvents( void )
 			ADD_DEBUG_HISTORY( HISTORY_ENTITY_IO, szBuffer );
 		}
 
-		// remove the event from the list (remembering that the queue may have been added to)
-		RemoveEvent( pe );
-		delete pe;
+		// remove the event from the queue (remembering that the queue may have been added to)
+		m_pFiringEvent = NULL;
+		DeleteEvent( pe );
 
 		//
 		// If we are in debug mode, exit the loop if we have fired the correct number of events.
@@ -976,8 +1132,7 @@ void CEventQueue::ServiceEvents( void )
 			}
 		}
 
-		// restart the list (to catch any new items have probably been added to the queue)
-		pe = m_Events.m_pNext;	
+		// the loop restarts from the top of the queue, to catch any new items that have probably been added
 	}
 }
 
@@ -1005,7 +1160,7 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 	if (!pCaller)
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pCur = m_pEventsByCaller[ pCaller->GetRefEHandle().GetEntryIndex() ];
 
 	while (pCur != NULL)
 	{
@@ -1022,12 +1177,11 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 		}
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByCaller;
 
 		if (bDelete)
 		{
-			RemoveEvent( pCurSave );
-			delete pCurSave;
+			DeleteEvent( pCurSave );
 		}
 	}
 }
@@ -1043,7 +1197,7 @@ void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 	if (!pTarget)
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pCur = m_pEventsByTarget[ pTarget->GetRefEHandle().GetEntryIndex() ];
 
 	while (pCur != NULL)
 	{
@@ -1058,12 +1212,11 @@ void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 		}
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByTarget;
 
 		if (bDelete)
 		{
-			RemoveEvent( pCurSave );
-			delete pCurSave;
+			DeleteEvent( pCurSave );
 		}
 	}
 }
@@ -1078,7 +1231,7 @@ bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName
 	if (!pTarget)
 		return false;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pCur = m_pEventsByTarget[ pTarget->GetRefEHandle().GetEntryIndex() ];
 
 	while (pCur != NULL)
 	{
@@ -1091,12 +1244,113 @@ bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName
 				return true;
 		}
 
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByTarget;
 	}
 
 	return false;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Times queueing, cancelling and draining synthetic events on this
+//			(empty) queue.  Nothing is fired so no map is needed; if entities
+//			exist, up to 64 of them are used as callers and targets so the
+//			cancel and pending lookups have something to find.
+//-----------------------------------------------------------------------------
+void CEventQueue::Benchmark( int nEvents )
+{
+	Assert( !m_Heap.Count() );
+
+	static const char *s_pszTargets[] = { "bench_door", "bench_relay", "bench_timer", "bench_counter" };
+
+	CUtlVector< CBaseEntity * > entities;
+	for ( CBaseEntity *pEntity = gEntList.FirstEnt(); pEntity && entities.Count() < 64; pEntity = gEntList.NextEnt( pEntity ) )
+	{
+		entities.AddToTail( pEntity );
+	}
+
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+
+	variant_t value;
+	CFastTimer timer;
+	int i;
+
+	timer.Start();
+	for ( i = 0; i < nEvents; i++ )
+	{
+		float flDelay = random.RandomFloat( 0.0f, 30.0f );
+		CBaseEntity *pCaller = entities.Count() ? entities[ i % entities.Count() ] : NULL;
+		if ( pCaller && ( i & 1 ) )
+		{
+			AddEvent( pCaller, "BenchInput", value, flDelay, NULL, pCaller );
+		}
+		else
+		{
+			AddEvent( s_pszTargets[ i & 3 ], "BenchInput", value, flDelay, NULL, pCaller );
+		}
+	}
+	timer.End();
+	float flAddTime = timer.GetDuration().GetMillisecondsF();
+
+	timer.Start();
+	int nPending = 0;
+	for ( i = 0; i < entities.Count(); i++ )
+	{
+		if ( HasEventPending( entities[ i ], "BenchInput" ) )
+		{
+			nPending++;
+		}
+	}
+	for ( i = 0; i < entities.Count(); i += 2 )
+	{
+		CancelEvents( entities[ i ] );
+	}
+	timer.End();
+	float flCancelTime = timer.GetDuration().GetMillisecondsF();
+
+	int nDrained = m_Heap.Count();
+	bool bInOrder = true;
+	float flLastFireTime = -FLT_MAX;
+	unsigned int nLastSequence = 0;
+
+	timer.Start();
+	while ( m_Heap.Count() )
+	{
+		EventQueuePrioritizedEvent_t *pe = m_Heap[ 0 ];
+		if ( pe->m_flFireTime < flLastFireTime || ( pe->m_flFireTime == flLastFireTime && (int)( pe->m_nSequence - nLastSequence ) < 0 ) )
+		{
+			bInOrder = false;
+		}
+		flLastFireTime = pe->m_flFireTime;
+		nLastSequence = pe->m_nSequence;
+
+		DeleteEvent( pe );
+	}
+	timer.End();
+	float flDrainTime = timer.GetDuration().GetMillisecondsF();
+
+	Msg( "Event queue benchmark, %d events:\n", nEvents );
+	Msg( "  add:    %.2f ms (%.3f us/event)\n", flAddTime, nEvents ? 1000.0f * flAddTime / nEvents : 0.0f );
+	Msg( "  cancel: %.2f ms for %d pending checks and %d callers (%d cancelled)\n", flCancelTime, entities.Count(), ( entities.Count() + 1 ) / 2, nEvents - nDrained );
+	Msg( "  drain:  %.2f ms (%.3f us/event), %s\n", flDrainTime, nDrained ? 1000.0f * flDrainTime / nDrained : 0.0f, bInOrder ? "in fire order" : "OUT OF ORDER" );
+	if ( entities.Count() )
+	{
+		Msg( "  %d of %d entities had pending events\n", nPending, entities.Count() );
+	}
+}
+
+CON_COMMAND( eventqueue_benchmark, "Times the entity I/O event queue on synthetic events: eventqueue_benchmark [events]" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nEvents = ( args.ArgC() > 1 ) ? atoi( args[ 1 ] ) : 100000;
+
+	CEventQueue *pQueue = new CEventQueue;
+	pQueue->Benchmark( MAX( nEvents, 0 ) );
+	delete pQueue;
+}
+
 void ServiceEventQueue( void )
 {
 	VPROF("ServiceEventQueue()");
@@ -1126,29 +1380,33 @@ BEGIN_SIMPLE_DATADESC( EventQueuePrioritizedEvent_t )
 	DEFINE_FIELD( m_iOutputID, FIELD_INTEGER ),
 	DEFINE_CUSTOM_FIELD( m_VariantValue, variantFuncs ),
 
-//	DEFINE_FIELD( m_pNext, FIELD_??? ),
-//	DEFINE_FIELD( m_pPrev, FIELD_??? ),
+//	DEFINE_FIELD( m_nSequence, FIELD_INTEGER ),
+//	DEFINE_FIELD( m_iHeapIndex, FIELD_INTEGER ),
+//	DEFINE_FIELD( m_iCallerSlot, FIELD_INTEGER ),
+//	DEFINE_FIELD( m_iTargetSlot, FIELD_INTEGER ),
+//	DEFINE_FIELD( m_pNextByCaller, FIELD_??? ),
+//	DEFINE_FIELD( m_pPrevByCaller, FIELD_??? ),
+//	DEFINE_FIELD( m_pNextByTarget, FIELD_??? ),
+//	DEFINE_FIELD( m_pPrevByTarget, FIELD_??? ),
 END_DATADESC()
 
 
 int CEventQueue::Save( ISave &save )
 {
-	// count the number of items in the queue
-	EventQueuePrioritizedEvent_t *pe;
+	// saved in the order they fire in, so restoring keeps the order of events with equal fire times
+	CUtlVector< EventQueuePrioritizedEvent_t * > events;
+	GetEventsInFireOrder( events );
 
-	m_iListCount = 0;
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
-	{
-		m_iListCount++;
-	}
+	m_iListCount = events.Count();
 
 	// save that value out to disk, so we know how many to restore
 	if ( !save.WriteFields( "EventQueue", this, NULL, m_DataMap.dataDesc, m_DataMap.dataNumFields ) )
 		return 0;
 	
 	// cycle through all the events, saving them all
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
+		EventQueuePrioritizedEvent_t *pe = events[ i ];
 		if ( !save.WriteFields( "PEvent", pe, NULL, pe->m_DataMap.dataDesc, pe->m_DataMap.dataNumFields ) )
 			return 0;
 	}
@@ -17,6 +17,7 @@
 #include "ai_initutils.h"
 #include "globalstate.h"
 #include "datacache/imdlcache.h"
+#include "tier1/generichash.h"
 
 #ifdef HL2_DLL
 #include "npc_playercompanion.h"
@@ -33,6 +34,155 @@ static CUtlVector<IServerNetworkable*> g_DeleteList;
 CGlobalEntityList gEntList;
 CBaseEntityList *g_pEntityList = &gEntList;
 
+ConVar sv_entity_name_index( "sv_entity_name_index", "1", 0, "Look up entities by name and classname through hash buckets instead of walking the whole entity list" );
+
+#define ENTITY_NAME_INDEX_BUCKETS	1024
+
+// Position of each entity list slot in the active list, which only ever appends,
+// so buckets can return entities in the same order as a walk of the list
+static unsigned int s_nEntityListOrder[ NUM_ENT_ENTRIES ];
+static unsigned int s_nNextEntityListOrder = 0;
+
+//-----------------------------------------------------------------------------
+// Purpose: Entity list slots bucketed by a caseless hash of a string_t (the
+//			name or the classname).  Buckets are intrusive lists kept in entity
+//			list order.  Candidates still have to be checked with NameMatches or
+//			ClassMatches, buckets are shared by different names.
+//-----------------------------------------------------------------------------
+class CEntityNameIndex
+{
+public:
+	CEntityNameIndex()
+	{
+		int i;
+		for ( i = 0; i < ENTITY_NAME_INDEX_BUCKETS; i++ )
+		{
+			m_nHead[ i ] = m_nTail[ i ] = -1;
+		}
+		for ( i = 0; i < NUM_ENT_ENTRIES; i++ )
+		{
+			m_nBucket[ i ] = -1;
+		}
+	}
+
+	static int BucketForName( const char *pszName )
+	{
+		return HashStringCaseless( pszName ) & ( ENTITY_NAME_INDEX_BUCKETS - 1 );
+	}
+
+	// Names with wildcards have to be matched against every entity
+	static bool CanLookUp( const char *pszName )
+	{
+		return pszName && pszName[0] && !strchr( pszName, '*' ) && sv_entity_name_index.GetBool();
+	}
+
+	void Insert( int iSlot, string_t iszName )
+	{
+		Remove( iSlot );
+		if ( iszName == NULL_STRING )
+			return;
+
+		int iBucket = BucketForName( STRING( iszName ) );
+
+		// New entities have the highest order so this is usually the tail, only
+		// renamed entities walk back
+		int iPrev = m_nTail[ iBucket ];
+		while ( iPrev != -1 && s_nEntityListOrder[ iPrev ] > s_nEntityListOrder[ iSlot ] )
+		{
+			iPrev = m_nPrev[ iPrev ];
+		}
+
+		int iNext = ( iPrev != -1 ) ? m_nNext[ iPrev ] : m_nHead[ iBucket ];
+		m_nPrev[ iSlot ] = iPrev;
+		m_nNext[ iSlot ] = iNext;
+		if ( iPrev != -1 )
+		{
+			m_nNext[ iPrev ] = iSlot;
+		}
+		else
+		{
+			m_nHead[ iBucket ] = iSlot;
+		}
+		if ( iNext != -1 )
+		{
+			m_nPrev[ iNext ] = iSlot;
+		}
+		else
+		{
+			m_nTail[ iBucket ] = iSlot;
+		}
+		m_nBucket[ iSlot ] = iBucket;
+	}
+
+	void Remove( int iSlot )
+	{
+		int iBucket = m_nBucket[ iSlot ];
+		if ( iBucket == -1 )
+			return;
+
+		int iPrev = m_nPrev[ iSlot ];
+		int iNext = m_nNext[ iSlot ];
+		if ( iPrev != -1 )
+		{
+			m_nNext[ iPrev ] = iNext;
+		}
+		else
+		{
+			m_nHead[ iBucket ] = iNext;
+		}
+		if ( iNext != -1 )
+		{
+			m_nPrev[ iNext ] = iPrev;
+		}
+		else
+		{
+			m_nTail[ iBucket ] = iPrev;
+		}
+		m_nBucket[ iSlot ] = -1;
+	}
+
+	// First slot after pStartEntity (or the first slot if NULL) that may be called pszName
+	int FirstCandidate( const char *pszName, CBaseEntity *pStartEntity ) const
+	{
+		int iBucket = BucketForName( pszName );
+		if ( !pStartEntity )
+			return m_nHead[ iBucket ];
+
+		int iStart = pStartEntity->GetRefEHandle().GetEntryIndex();
+		if ( m_nBucket[ iStart ] == iBucket )
+			return m_nNext[ iStart ];
+
+		int iSlot = m_nHead[ iBucket ];
+		while ( iSlot != -1 && s_nEntityListOrder[ iSlot ] <= s_nEntityListOrder[ iStart ] )
+		{
+			iSlot = m_nNext[ iSlot ];
+		}
+		return iSlot;
+	}
+
+	int NextCandidate( int iSlot ) const
+	{
+		return m_nNext[ iSlot ];
+	}
+
+	bool IsIndexedAs( int iSlot, string_t iszName ) const
+	{
+		if ( iszName == NULL_STRING )
+			return m_nBucket[ iSlot ] == -1;
+		return m_nBucket[ iSlot ] == BucketForName( STRING( iszName ) );
+	}
+
+private:
+	short	m_nHead[ ENTITY_NAME_INDEX_BUCKETS ];
+	short	m_nTail[ ENTITY_NAME_INDEX_BUCKETS ];
+	short	m_nNext[ NUM_ENT_ENTRIES ];
+	short	m_nPrev[ NUM_ENT_ENTRIES ];
+	short	m_nBucket[ NUM_ENT_ENTRIES ];	// -1 if not indexed
+};
+
+static CEntityNameIndex s_EntityNameIndex;
+static CEntityNameIndex s_EntityClassnameIndex;
+
 class CAimTargetManager : public IEntityListener
 {
 public:
@@ -127,12 +277,35 @@ void AimTarget_ForceRepopulateList()
 // NOTE: This is usually a small subset of the global entity list, so it's
 // an optimization to maintain this list incrementally rather than polling each
 // frame.
+// Entities that only think are also kept on a wheel of per-tick buckets so the
+// per-frame copy only visits the ones that are due (or that simulate every tick)
+// instead of every thinker on the map.
 struct simthinkentry_t
 {
 	unsigned short	entEntry;
 	unsigned short	unused0;
 	int				nextThinkTick;
 };
+
+struct simthinklink_t
+{
+	unsigned short	next;
+	unsigned short	prev;
+	unsigned short	bucket;
+};
+
+#define SIMTHINK_WHEEL_BITS		8
+#define SIMTHINK_WHEEL_SIZE		( 1 << SIMTHINK_WHEEL_BITS )
+#define SIMTHINK_WHEEL_MASK		( SIMTHINK_WHEEL_SIZE - 1 )
+// Bucket for entries that have to be looked at every tick: simulating entities
+// and thinkers whose tick has come up
+#define SIMTHINK_DUE_BUCKET		SIMTHINK_WHEEL_SIZE
+
+static int __cdecl SimThinkListIndexLessFunc( const unsigned short *a, const unsigned short *b )
+{
+	return (int)*a - (int)*b;
+}
+
 class CSimThinkManager : public IEntityListener
 {
 public:
@@ -146,7 +319,13 @@ public:
 		for ( int i = 0; i < ARRAYSIZE(m_entinfoIndex); i++ )
 		{
 			m_entinfoIndex[i] = 0xFFFF;
+			m_links[i].next = m_links[i].prev = m_links[i].bucket = 0xFFFF;
 		}
+		for ( int i = 0; i < ARRAYSIZE(m_bucketHead); i++ )
+		{
+			m_bucketHead[i] = 0xFFFF;
+		}
+		m_wheelTick = 0;
 	}
 	void LevelInitPreEntity()
 	{
@@ -175,6 +354,7 @@ public:
 		if ( listHandle != 0xFFFF )
 		{
 			Assert(m_simThinkList[listHandle].entEntry == index);
+			Unlink( index );
 			m_simThinkList.FastRemove( listHandle );
 			m_entinfoIndex[index] = 0xFFFF;
 			
@@ -192,22 +372,32 @@ public:
 
 	int ListCopy( CBaseEntity *pList[], int listMax )
 	{
-		int count = MIN(listMax, ListCount());
-		int out = 0;
-		for ( int i = 0; i < count; i++ )
+		AdvanceWheel( gpGlobals->tickcount );
+
+		// Copy out in list order, same as walking the whole list would
+		m_dueScratch.RemoveAll();
+		for ( unsigned short index = m_bucketHead[SIMTHINK_DUE_BUCKET]; index != 0xFFFF; index = m_links[index].next )
 		{
 			// only copy out entities that will simulate or think this frame
-			if ( m_simThinkList[i].nextThinkTick <= gpGlobals->tickcount )
+			if ( m_simThinkList[m_entinfoIndex[index]].nextThinkTick <= gpGlobals->tickcount )
 			{
-				Assert(m_simThinkList[i].nextThinkTick>=0);
-				int entinfoIndex = m_simThinkList[i].entEntry;
-				const CEntInfo *pInfo = gEntList.GetEntInfoPtrByIndex( entinfoIndex );
-				pList[out] = (CBaseEntity *)pInfo->m_pEntity;
-				Assert(m_simThinkList[i].nextThinkTick==0 || pList[out]->GetFirstThinkTick()==m_simThinkList[i].nextThinkTick);
-				Assert( gEntList.IsEntityPtr( pList[out] ) );
-				out++;
+				m_dueScratch.AddToTail( m_entinfoIndex[index] );
 			}
 		}
+		m_dueScratch.Sort( SimThinkListIndexLessFunc );
+
+		int count = MIN(listMax, m_dueScratch.Count());
+		int out = 0;
+		for ( int i = 0; i < count; i++ )
+		{
+			const simthinkentry_t &entry = m_simThinkList[m_dueScratch[i]];
+			Assert(entry.nextThinkTick>=0);
+			const CEntInfo *pInfo = gEntList.GetEntInfoPtrByIndex( entry.entEntry );
+			pList[out] = (CBaseEntity *)pInfo->m_pEntity;
+			Assert(entry.nextThinkTick==0 || pList[out]->GetFirstThinkTick()==entry.nextThinkTick);
+			Assert( gEntList.IsEntityPtr( pList[out] ) );
+			out++;
+		}
 
 		return out;
 	}
@@ -255,12 +445,96 @@ public:
 					m_simThinkList[m_entinfoIndex[index]].nextThinkTick = 0;
 				}
 			}
+
+			Link( index, BucketForTick( m_simThinkList[m_entinfoIndex[index]].nextThinkTick ) );
 		}
 	}
 
 private:
+	// Anything not strictly after the last tick the wheel was advanced to has
+	// to be checked every tick from now on
+	int BucketForTick( int nextThinkTick ) const
+	{
+		if ( nextThinkTick <= m_wheelTick )
+			return SIMTHINK_DUE_BUCKET;
+		return nextThinkTick & SIMTHINK_WHEEL_MASK;
+	}
+
+	void Link( int index, int bucket )
+	{
+		if ( m_links[index].bucket == bucket )
+			return;
+
+		Unlink( index );
+
+		m_links[index].bucket = bucket;
+		m_links[index].prev = 0xFFFF;
+		m_links[index].next = m_bucketHead[bucket];
+		if ( m_bucketHead[bucket] != 0xFFFF )
+		{
+			m_links[m_bucketHead[bucket]].prev = index;
+		}
+		m_bucketHead[bucket] = index;
+	}
+
+	void Unlink( int index )
+	{
+		simthinklink_t &link = m_links[index];
+		if ( link.bucket == 0xFFFF )
+			return;
+
+		if ( link.prev != 0xFFFF )
+		{
+			m_links[link.prev].next = link.next;
+		}
+		else
+		{
+			m_bucketHead[link.bucket] = link.next;
+		}
+		if ( link.next != 0xFFFF )
+		{
+			m_links[link.next].prev = link.prev;
+		}
+		link.next = link.prev = link.bucket = 0xFFFF;
+	}
+
+	// Moves everything whose tick has come up since the last call onto the due list
+	void AdvanceWheel( int tick )
+	{
+		if ( tick <= m_wheelTick )
+		{
+			// Time went backwards (or we were already here); the wheel only holds
+			// entries later than m_wheelTick, so it's still valid
+			m_wheelTick = tick;
+			return;
+		}
+
+		int nBuckets = MIN( tick - m_wheelTick, SIMTHINK_WHEEL_SIZE );
+		for ( int i = 1; i <= nBuckets; i++ )
+		{
+			int bucket = ( m_wheelTick + i ) & SIMTHINK_WHEEL_MASK;
+			unsigned short index = m_bucketHead[bucket];
+			while ( index != 0xFFFF )
+			{
+				unsigned short next = m_links[index].next;
+				if ( m_simThinkList[m_entinfoIndex[index]].nextThinkTick <= tick )
+				{
+					Link( index, SIMTHINK_DUE_BUCKET );
+				}
+				index = next;
+			}
+		}
+
+		m_wheelTick = tick;
+	}
+
 	unsigned short m_entinfoIndex[NUM_ENT_ENTRIES];
 	CUtlVector<simthinkentry_t>	m_simThinkList;
+
+	simthinklink_t	m_links[NUM_ENT_ENTRIES];
+	unsigned short	m_bucketHead[SIMTHINK_WHEEL_SIZE + 1];
+	int				m_wheelTick;
+	CUtlVector<unsigned short>	m_dueScratch;
 };
 
 CSimThinkManager g_SimThinkManager;
@@ -481,6 +755,18 @@ bool CGlobalEntityList::IsEntityPtr( void *pTest )
 //-----------------------------------------------------------------------------
 CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity, const char *szName )
 {
+	if ( CEntityNameIndex::CanLookUp( szName ) )
+	{
+		for ( int iSlot = s_EntityClassnameIndex.FirstCandidate( szName, pStartEntity ); iSlot != -1; iSlot = s_EntityClassnameIndex.NextCandidate( iSlot ) )
+		{
+			CBaseEntity *pEntity = (CBaseEntity *)GetEntInfoPtrByIndex( iSlot )->m_pEntity;
+			if ( pEntity->ClassMatches(szName) )
+				return pEntity;
+		}
+
+		return NULL;
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -591,6 +877,23 @@ CBaseEntity *CGlobalEntityList::FindEntityByName( CBaseEntity *pStartEntity, con
 		return NULL;
 	}
 	
+	if ( CEntityNameIndex::CanLookUp( szName ) )
+	{
+		for ( int iSlot = s_EntityNameIndex.FirstCandidate( szName, pStartEntity ); iSlot != -1; iSlot = s_EntityNameIndex.NextCandidate( iSlot ) )
+		{
+			CBaseEntity *ent = (CBaseEntity *)GetEntInfoPtrByIndex( iSlot )->m_pEntity;
+			if ( ent->NameMatches( szName ) )
+			{
+				if ( pFilter && !pFilter->ShouldFindEntity(ent) )
+					continue;
+
+				return ent;
+			}
+		}
+
+		return NULL;
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -1095,6 +1398,12 @@ void CGlobalEntityList::OnAddEntity( IHandleEntity *pEnt, CBaseHandle handle )
 	
 	// NOTE: Must be a CBaseEntity on server
 	Assert( pBaseEnt );
+
+	int iSlot = handle.GetEntryIndex();
+	s_nEntityListOrder[ iSlot ] = s_nNextEntityListOrder++;
+	s_EntityNameIndex.Insert( iSlot, pBaseEnt->GetEntityName() );
+	s_EntityClassnameIndex.Insert( iSlot, pBaseEnt->m_iClassname );
+
 	//DevMsg(2,"Created %s\n", pBaseEnt->GetClassname() );
 	for ( i = m_entityListeners.Count()-1; i >= 0; i-- )
 	{
@@ -1121,6 +1430,9 @@ void CGlobalEntityList::OnRemoveEntity( IHandleEntity *pEnt, CBaseHandle handle
 	}
 #endif
 
+	s_EntityNameIndex.Remove( handle.GetEntryIndex() );
+	s_EntityClassnameIndex.Remove( handle.GetEntryIndex() );
+
 	CBaseEntity *pBaseEnt = static_cast<IServerUnknown*>(pEnt)->GetBaseEntity();
 	if ( pBaseEnt->edict() )
 		m_iNumEdicts--;
@@ -1128,6 +1440,52 @@ void CGlobalEntityList::OnRemoveEntity( IHandleEntity *pEnt, CBaseHandle handle
 	m_iNumEnts--;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Re-buckets an entity after its name or classname has been changed.
+//			Entities that aren't in the list yet are indexed by OnAddEntity.
+//-----------------------------------------------------------------------------
+void CGlobalEntityList::OnEntityNameChanged( CBaseEntity *pEnt )
+{
+	const CBaseHandle &handle = pEnt->GetRefEHandle();
+	if ( handle.IsValid() && LookupEntity( handle ) == pEnt )
+	{
+		s_EntityNameIndex.Insert( handle.GetEntryIndex(), pEnt->GetEntityName() );
+	}
+}
+
+void CGlobalEntityList::OnEntityClassnameChanged( CBaseEntity *pEnt )
+{
+	const CBaseHandle &handle = pEnt->GetRefEHandle();
+	if ( handle.IsValid() && LookupEntity( handle ) == pEnt )
+	{
+		s_EntityClassnameIndex.Insert( handle.GetEntryIndex(), pEnt->m_iClassname );
+	}
+}
+
+CON_COMMAND( sv_entity_name_index_verify, "Lists entities whose name or classname changed without the entity list's name index being told" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nBad = 0;
+	for ( const CEntInfo *pInfo = gEntList.FirstEntInfo(); pInfo; pInfo = pInfo->m_pNext )
+	{
+		CBaseEntity *pEntity = (CBaseEntity *)pInfo->m_pEntity;
+		if ( !pEntity )
+			continue;
+
+		int iSlot = pEntity->GetRefEHandle().GetEntryIndex();
+		if ( !s_EntityNameIndex.IsIndexedAs( iSlot, pEntity->GetEntityName() ) ||
+			 !s_EntityClassnameIndex.IsIndexedAs( iSlot, pEntity->m_iClassname ) )
+		{
+			Msg( "%d: %s (%s) is in the wrong bucket\n", iSlot, pEntity->GetClassname(), pEntity->GetDebugName() );
+			nBad++;
+		}
+	}
+
+	Msg( "%d entities indexed incorrectly\n", nBad );
+}
+
 void CGlobalEntityList::NotifyCreateEntity( CBaseEntity *pEnt )
 {
 	if ( !pEnt )
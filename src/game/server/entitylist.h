@@ -112,6 +112,9 @@ public:
 	void NotifyCreateEntity( CBaseEntity *pEnt );
 	void NotifySpawn( CBaseEntity *pEnt );
 	void NotifyRemoveEntity( CBaseHandle hEnt );
+	// m_iName/m_iClassname changed, keeps FindEntityByName/FindEntityByClassname up to date
+	void OnEntityNameChanged( CBaseEntity *pEnt );
+	void OnEntityClassnameChanged( CBaseEntity *pEnt );
 	// iteration functions
 
 	// returns the next entity after pCurrentEnt;  if pCurrentEnt is NULL, return the first entity
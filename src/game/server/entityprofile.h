@@ -0,0 +1,75 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Opt-in per-entity and per-classname CPU profiling
+//
+//=============================================================================
+#ifndef ENTITYPROFILE_H
+#define ENTITYPROFILE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/fasttimer.h"
+
+class CBaseEntity;
+
+//-----------------------------------------------------------------------------
+// What an entity was doing when a sample was taken.  Scopes nest (a think runs
+// inside Physics_SimulateEntity, inputs fire from thinks); each sample only
+// gets the time not spent in nested scopes, so the categories add up.
+//-----------------------------------------------------------------------------
+enum EntityProfileCategory_t
+{
+	ENTITY_PROFILE_SIMULATE = 0,
+	ENTITY_PROFILE_THINK,
+	ENTITY_PROFILE_RUN_AI,
+	ENTITY_PROFILE_INPUT,
+
+	ENTITY_PROFILE_CATEGORY_COUNT,
+};
+
+// Mirrors sv_entity_profile; tested inline so a disabled profiler costs one branch
+extern bool g_bEntityProfile;
+
+//-----------------------------------------------------------------------------
+// Purpose: Times its own lifetime against an entity when sv_entity_profile is on.
+//			Everything needed for the sample is captured up front, so the
+//			entity may remove itself inside the scope.  Main thread only.
+//-----------------------------------------------------------------------------
+class CEntityProfileScope
+{
+public:
+	CEntityProfileScope( CBaseEntity *pEntity, EntityProfileCategory_t category )
+	{
+		m_bActive = g_bEntityProfile;
+		if ( m_bActive )
+		{
+			Begin( pEntity, category );
+		}
+	}
+
+	~CEntityProfileScope()
+	{
+		if ( m_bActive )
+		{
+			End();
+		}
+	}
+
+private:
+	void Begin( CBaseEntity *pEntity, EntityProfileCategory_t category );
+	void End();
+
+	bool					m_bActive;
+	CEntityProfileScope		*m_pParent;
+	uint64					m_nChildCycles;
+	EntityProfileCategory_t	m_Category;
+	unsigned long			m_hEntity;
+	string_t				m_iClassname;
+	string_t				m_iName;
+	CFastTimer				m_Timer;
+};
+
+#define ENTITY_PROFILE_SCOPE( pEntity, category )	CEntityProfileScope _entityProfileScope( pEntity, category )
+
+#endif // ENTITYPROFILE_H
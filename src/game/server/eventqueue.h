@@ -2,7 +2,8 @@
 //
 // Purpose: A global class that holds a prioritized queue of entity I/O events.
 //			Events can be posted with a nonzero delay, which determines how long
-//			they are held before being dispatched to their recipients.
+//			they are held before being dispatched to their recipients.  Events
+//			with the same fire time are dispatched in the order they were posted.
 //
 //			The queue is serviced once per server frame.
 //
@@ -28,8 +29,17 @@ struct EventQueuePrioritizedEvent_t
 
 	variant_t m_VariantValue;	// variable-type parameter
 
-	EventQueuePrioritizedEvent_t *m_pNext;
-	EventQueuePrioritizedEvent_t *m_pPrev;
+	// Queue bookkeeping, not saved
+	unsigned int m_nSequence;	// order the event was queued in, fires first among equal fire times
+	int m_iHeapIndex;			// position in CEventQueue::m_Heap, -1 once removed
+
+	// Events sharing the entity list slot of m_pCaller / m_pEntTarget (as of when queued)
+	int m_iCallerSlot;
+	int m_iTargetSlot;
+	EventQueuePrioritizedEvent_t *m_pNextByCaller;
+	EventQueuePrioritizedEvent_t *m_pPrevByCaller;
+	EventQueuePrioritizedEvent_t *m_pNextByTarget;
+	EventQueuePrioritizedEvent_t *m_pPrevByTarget;
 
 	DECLARE_SIMPLE_DATADESC();
 
@@ -66,14 +76,30 @@ public:
 
 	void Dump( void );
 
+	// times queue operations on synthetic events, see eventqueue_benchmark
+	void Benchmark( int nEvents );
+
 private:
 
 	void AddEvent( EventQueuePrioritizedEvent_t *event );
 	void RemoveEvent( EventQueuePrioritizedEvent_t *pe );
+	void DeleteEvent( EventQueuePrioritizedEvent_t *pe );
+
+	// binary min-heap on ( m_flFireTime, m_nSequence )
+	static bool FiresBefore( const EventQueuePrioritizedEvent_t *a, const EventQueuePrioritizedEvent_t *b );
+	void HeapUp( int i );
+	void HeapDown( int i );
+	void GetEventsInFireOrder( CUtlVector< EventQueuePrioritizedEvent_t * > &events );
 
 	DECLARE_SIMPLE_DATADESC();
-	EventQueuePrioritizedEvent_t m_Events;
+	CUtlVector< EventQueuePrioritizedEvent_t * > m_Heap;
+	unsigned int m_nNextSequence;
+	EventQueuePrioritizedEvent_t *m_pFiringEvent;	// event being serviced, deleted by ServiceEvents
 	int m_iListCount;
+
+	// per entity list slot lists for CancelEvents / CancelEventOn / HasEventPending
+	EventQueuePrioritizedEvent_t *m_pEventsByCaller[ NUM_ENT_ENTRIES ];
+	EventQueuePrioritizedEvent_t *m_pEventsByTarget[ NUM_ENT_ENTRIES ];
 };
 
 extern CEventQueue g_EventQueue;
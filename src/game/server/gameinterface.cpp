@@ -2419,6 +2419,147 @@ inline void CServerNetworkProperty::CheckTransmit( CCheckTransmitInfo *pInfo )
 	}
 } */
 
+ConVar sv_transmit_cache( "sv_transmit_cache", "1", 0, "Reuse each client's PVS test results for entities whose PVS information hasn't changed while that client's PVS and areas stay the same." );
+
+//-----------------------------------------------------------------------------
+// Purpose: Remembers the result of CServerNetworkProperty::IsInPVS() per client.
+//			A result stays valid while the entity's PVS information isn't rebuilt
+//			(see GetPVSInfoSerial) and the client's PVS, networked areas and area
+//			flood numbers are unchanged, which for most entities and clients is
+//			most snapshots.  ShouldTransmit() is never cached, it can depend on
+//			anything.
+//-----------------------------------------------------------------------------
+class CTransmitPVSCache : public CAutoGameSystem
+{
+public:
+	struct ClientView_t
+	{
+		// What the client could see when the results were computed
+		int		m_nPVSSize;
+		byte	m_PVS[ PAD_NUMBER( MAX_MAP_CLUSTERS, 8 ) / 8 ];
+		int		m_AreasNetworked;
+		int		m_Areas[ MAX_WORLD_AREAS ];
+		int		m_nMapAreas;
+		byte	m_AreaFloodNums[ MAX_MAP_AREAS ];
+
+		// PVS info serial each result was computed against, 0 if none
+		int						m_nPVSInfoSerial[ MAX_EDICTS ];
+		CBitVec< MAX_EDICTS >	m_InPVS;
+	};
+
+	CTransmitPVSCache() : CAutoGameSystem( "CTransmitPVSCache" )
+	{
+		m_nTests = 0;
+		m_nHits = 0;
+		m_nViewChanges = 0;
+	}
+
+	virtual void LevelShutdownPostEntity()
+	{
+		m_Clients.PurgeAndDeleteElements();
+	}
+
+	ClientView_t *GetClientView( const CCheckTransmitInfo *pInfo, int iClient );
+	bool IsInPVS( ClientView_t *pView, CServerNetworkProperty *pNetProp, const CCheckTransmitInfo *pInfo );
+
+	void Report();
+
+private:
+	CUtlVector< ClientView_t * >	m_Clients;	// by client entindex
+
+	int		m_nTests;
+	int		m_nHits;
+	int		m_nViewChanges;
+};
+
+static CTransmitPVSCache g_TransmitPVSCache;
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the cached view of a client, dropping its results if what
+//			the client can see has changed.  NULL if caching is off.
+//-----------------------------------------------------------------------------
+CTransmitPVSCache::ClientView_t *CTransmitPVSCache::GetClientView( const CCheckTransmitInfo *pInfo, int iClient )
+{
+	if ( !sv_transmit_cache.GetBool() || iClient < 0 )
+		return NULL;
+
+	while ( m_Clients.Count() <= iClient )
+	{
+		m_Clients.AddToTail( NULL );
+	}
+
+	ClientView_t *pView = m_Clients[ iClient ];
+	if ( !pView )
+	{
+		pView = new ClientView_t;
+		pView->m_nPVSSize = -1;
+		m_Clients[ iClient ] = pView;
+	}
+
+	bool bSameView = pView->m_nPVSSize == pInfo->m_nPVSSize &&
+		pView->m_AreasNetworked == pInfo->m_AreasNetworked &&
+		pView->m_nMapAreas == pInfo->m_nMapAreas &&
+		!memcmp( pView->m_PVS, pInfo->m_PVS, pInfo->m_nPVSSize ) &&
+		!memcmp( pView->m_Areas, pInfo->m_Areas, pInfo->m_AreasNetworked * sizeof( int ) ) &&
+		!memcmp( pView->m_AreaFloodNums, pInfo->m_AreaFloodNums, pInfo->m_nMapAreas );
+
+	if ( !bSameView )
+	{
+		pView->m_nPVSSize = pInfo->m_nPVSSize;
+		pView->m_AreasNetworked = pInfo->m_AreasNetworked;
+		pView->m_nMapAreas = pInfo->m_nMapAreas;
+		memcpy( pView->m_PVS, pInfo->m_PVS, pInfo->m_nPVSSize );
+		memcpy( pView->m_Areas, pInfo->m_Areas, pInfo->m_AreasNetworked * sizeof( int ) );
+		memcpy( pView->m_AreaFloodNums, pInfo->m_AreaFloodNums, pInfo->m_nMapAreas );
+		memset( pView->m_nPVSInfoSerial, 0, sizeof( pView->m_nPVSInfoSerial ) );
+		++m_nViewChanges;
+	}
+
+	return pView;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Same as pNetProp->IsInPVS( pInfo ), the PVS information must already
+//			be up to date
+//-----------------------------------------------------------------------------
+inline bool CTransmitPVSCache::IsInPVS( ClientView_t *pView, CServerNetworkProperty *pNetProp, const CCheckTransmitInfo *pInfo )
+{
+	if ( !pView )
+		return pNetProp->IsInPVS( pInfo );
+
+	++m_nTests;
+
+	int iEdict = pNetProp->entindex();
+	int nSerial = pNetProp->GetPVSInfoSerial();
+	if ( pView->m_nPVSInfoSerial[ iEdict ] == nSerial )
+	{
+		++m_nHits;
+		return pView->m_InPVS.IsBitSet( iEdict );
+	}
+
+	bool bInPVS = pNetProp->IsInPVS( pInfo );
+	pView->m_nPVSInfoSerial[ iEdict ] = nSerial;
+	pView->m_InPVS.Set( iEdict, bInPVS );
+	return bInPVS;
+}
+
+void CTransmitPVSCache::Report()
+{
+	Msg( "Transmit PVS cache: %d tests, %d hits (%.1f%%), %d client view changes\n",
+		m_nTests, m_nHits, m_nTests ? 100.0f * m_nHits / m_nTests : 0.0f, m_nViewChanges );
+	m_nTests = 0;
+	m_nHits = 0;
+	m_nViewChanges = 0;
+}
+
+CON_COMMAND( sv_transmit_cache_report, "Report and reset sv_transmit_cache hit counts" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	g_TransmitPVSCache.Report();
+}
+
 void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned short *pEdictIndices, int nEdicts )
 {
 	// NOTE: for speed's sake, this assumes that all networkables are CBaseEntities and that the edict list
@@ -2447,6 +2588,8 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 		    bIsReplay == ( pInfo->m_pTransmitAlways != NULL) );
 #endif
 
+	CTransmitPVSCache::ClientView_t *pView = g_TransmitPVSCache.GetClientView( pInfo, pRecipientPlayer->entindex() );
+
 	for ( int i=0; i < nEdicts; i++ )
 	{
 		int iEdict = pEdictIndices[i];
@@ -2541,7 +2684,7 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 			continue;
 		}
 
-		bool bInPVS = netProp->IsInPVS( pInfo );
+		bool bInPVS = g_TransmitPVSCache.IsInPVS( pView, netProp, pInfo );
 		if ( bInPVS || sv_force_transmit_ents.GetBool() )
 		{
 			// only send if entity is in PVS
@@ -2596,7 +2739,7 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 			{
 				// Check pvs
 				check->RecomputePVSInformation();
-				bool bMoveParentInPVS = check->IsInPVS( pInfo );
+				bool bMoveParentInPVS = g_TransmitPVSCache.IsInPVS( pView, check, pInfo );
 				if ( bMoveParentInPVS )
 				{
 					orig->SetTransmit( pInfo, true );
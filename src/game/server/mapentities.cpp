@@ -32,6 +32,123 @@ struct HierarchicalSpawnMapData_t
 static CStringRegistry *g_pClassnameSpawnPriority = NULL;
 extern edict_t *g_pForceAttachEdict;
 
+ConVar sv_map_entity_index( "sv_map_entity_index", "1", 0, "Tokenize the map's entity lump in a single pass before spawning the map entities." );
+
+//-----------------------------------------------------------------------------
+// Purpose: Tokenizes a whole entity lump in one pass into a flat table of keys
+//			and values.  The classic path tokenizes every entity three times:
+//			once to find the classname, once for the keyvalues and once more
+//			to find the closing brace.
+//
+//			Uses MapEntity_ParseToken so the tokens come out exactly as before;
+//			anything the classic path would treat specially (stray braces, a
+//			missing classname, EOF inside an entity) makes Parse() fail so the
+//			caller can fall back to it.
+//-----------------------------------------------------------------------------
+class CMapEntityLumpIndex
+{
+public:
+	struct Entity_t
+	{
+		const char	*m_pData;			// just past the opening brace
+		const char	*m_pDataEnd;		// where the classic parser stops, right before the closing brace
+		const char	*m_pszClassName;
+		int			m_iFirstKeyValue;
+		int			m_nKeyValues;
+	};
+
+	CMapEntityLumpIndex() : m_nStringsUsed( 0 ) {}
+
+	bool Parse( const char *pMapData );
+
+	int EntityCount() const { return m_Entities.Count(); }
+	const Entity_t &GetEntity( int i ) const { return m_Entities[i]; }
+	const MapEntityKeyValue_t *GetKeyValues( const Entity_t &entity ) const { return m_KeyValues.Base() + entity.m_iFirstKeyValue; }
+
+private:
+	const char *AddString( const char *pszToken );
+
+	CUtlVector< Entity_t >				m_Entities;
+	CUtlVector< MapEntityKeyValue_t >	m_KeyValues;
+	CUtlMemory< char >					m_Strings;
+	int									m_nStringsUsed;
+};
+
+const char *CMapEntityLumpIndex::AddString( const char *pszToken )
+{
+	int nLength = Q_strlen( pszToken ) + 1;
+	Assert( m_nStringsUsed + nLength <= m_Strings.NumAllocated() );
+
+	char *pszString = m_Strings.Base() + m_nStringsUsed;
+	memcpy( pszString, pszToken, nLength );
+	m_nStringsUsed += nLength;
+	return pszString;
+}
+
+bool CMapEntityLumpIndex::Parse( const char *pMapData )
+{
+	MEM_ALLOC_CREDIT();
+
+	// Every token is at most as long as its text, plus a terminator, so this never grows
+	int nMapDataLength = pMapData ? Q_strlen( pMapData ) : 0;
+	m_Strings.EnsureCapacity( 2 * nMapDataLength + 2 );
+	m_nStringsUsed = 0;
+
+	char token[MAPKEY_MAXLENGTH];
+	const char *pData = pMapData;
+	while ( true )
+	{
+		pData = MapEntity_ParseToken( pData, token );
+		if ( !pData )
+			return true;
+
+		if ( token[0] != '{' )
+			return false;
+
+		Entity_t &entity = m_Entities[ m_Entities.AddToTail() ];
+		entity.m_pData = pData;
+		entity.m_pDataEnd = NULL;
+		entity.m_pszClassName = NULL;
+		entity.m_iFirstKeyValue = m_KeyValues.Count();
+		entity.m_nKeyValues = 0;
+
+		while ( true )
+		{
+			const char *pKeyStart = pData;
+			pData = MapEntity_ParseToken( pData, token );
+			if ( !pData || FStrEq( token, "{" ) )
+				return false;
+
+			if ( token[0] == '}' )
+			{
+				if ( token[1] )
+					return false;
+
+				entity.m_pDataEnd = pKeyStart;
+				break;
+			}
+
+			MapEntityKeyValue_t &keyValue = m_KeyValues[ m_KeyValues.AddToTail() ];
+			keyValue.m_pszKey = AddString( token );
+
+			pData = MapEntity_ParseToken( pData, token );
+			if ( !pData || token[0] == '}' || FStrEq( token, "{" ) )
+				return false;
+
+			keyValue.m_pszValue = AddString( token );
+			entity.m_nKeyValues++;
+
+			if ( !entity.m_pszClassName && !strcmp( keyValue.m_pszKey, "classname" ) )
+			{
+				entity.m_pszClassName = keyValue.m_pszValue;
+			}
+		}
+
+		if ( !entity.m_pszClassName )
+			return false;
+	}
+}
+
 // creates an entity by string name, but does not spawn it
 CBaseEntity *CreateEntityByName( const char *className, int iForceEdictIndex )
 {
@@ -101,15 +218,11 @@ static int __cdecl CompareSpawnOrder(HierarchicalSpawn_t *pEnt1, HierarchicalSpa
 {
 	if (pEnt1->m_nDepth == pEnt2->m_nDepth)
 	{
-		if ( g_pClassnameSpawnPriority )
-		{
-			int o1 = pEnt1->m_pEntity ? g_pClassnameSpawnPriority->GetStringID( pEnt1->m_pEntity->GetClassname() ) : -1;
-			int o2 = pEnt2->m_pEntity ? g_pClassnameSpawnPriority->GetStringID( pEnt2->m_pEntity->GetClassname() ) : -1;
-			if ( o1 < o2 )
-				return 1;
-			if ( o2 < o1 )
-				return -1;
-		}
+		// Spawn priorities are looked up once per entity before the sort
+		if ( pEnt1->m_nSpawnPriority < pEnt2->m_nSpawnPriority )
+			return 1;
+		if ( pEnt2->m_nSpawnPriority < pEnt1->m_nSpawnPriority )
+			return -1;
 		return 0;
 	}
 
@@ -122,8 +235,10 @@ static int __cdecl CompareSpawnOrder(HierarchicalSpawn_t *pEnt1, HierarchicalSpa
 
 //-----------------------------------------------------------------------------
 // Computes the hierarchical depth of the entities to spawn..
+// pDepths caches the depth of each entity by entity list slot (0 = not computed
+// yet, -1 = being computed) so shared parent chains are only walked once
 //-----------------------------------------------------------------------------
-static int ComputeSpawnHierarchyDepth_r( CBaseEntity *pEntity )
+static int ComputeSpawnHierarchyDepth_r( CBaseEntity *pEntity, int *pDepths )
 {
 	if ( !pEntity )
 		return 1;
@@ -131,6 +246,10 @@ static int ComputeSpawnHierarchyDepth_r( CBaseEntity *pEntity )
 	if (pEntity->m_iParent == NULL_STRING)
 		return 1;
 
+	int iSlot = pEntity->GetRefEHandle().GetEntryIndex();
+	if ( pDepths[iSlot] > 0 )
+		return pDepths[iSlot];
+
 	CBaseEntity *pParent = gEntList.FindEntityByName( NULL, ExtractParentName(pEntity->m_iParent) );
 	if (!pParent)
 		return 1;
@@ -141,7 +260,15 @@ static int ComputeSpawnHierarchyDepth_r( CBaseEntity *pEntity )
 		return 1;
 	}
 
-	return 1 + ComputeSpawnHierarchyDepth_r( pParent );
+	if ( pDepths[iSlot] < 0 )
+	{
+		Warning( "LEVEL DESIGN ERROR: Entity %s is part of a parenting loop!\n", pEntity->GetDebugName() );
+		return 1;
+	}
+
+	pDepths[iSlot] = -1;
+	pDepths[iSlot] = 1 + ComputeSpawnHierarchyDepth_r( pParent, pDepths );
+	return pDepths[iSlot];
 }
 
 static void ComputeSpawnHierarchyDepth( int nEntities, HierarchicalSpawn_t *pSpawnList )
@@ -149,13 +276,17 @@ static void ComputeSpawnHierarchyDepth( int nEntities, HierarchicalSpawn_t *pSpa
 	// NOTE: This isn't particularly efficient, but so what? It's at the beginning of time
 	// I did it this way because it simplified the parent setting in hierarchy (basically
 	// eliminated questions about whether you should transform origin from global to local or not)
+	CUtlVector< int > depths;
+	depths.SetCount( NUM_ENT_ENTRIES );
+	memset( depths.Base(), 0, NUM_ENT_ENTRIES * sizeof(int) );
+
 	int nEntity;
 	for (nEntity = 0; nEntity < nEntities; nEntity++)
 	{
 		CBaseEntity *pEntity = pSpawnList[nEntity].m_pEntity;
 		if (pEntity && !pEntity->IsDormant())
 		{
-			pSpawnList[nEntity].m_nDepth = ComputeSpawnHierarchyDepth_r( pEntity );
+			pSpawnList[nEntity].m_nDepth = ComputeSpawnHierarchyDepth_r( pEntity, depths.Base() );
 		}
 		else
 		{
@@ -185,6 +316,13 @@ static void SortSpawnListByHierarchy( int nEntities, HierarchicalSpawn_t *pSpawn
 
 	g_pClassnameSpawnPriority->AddString( "prop_physics", 7 );
 	g_pClassnameSpawnPriority->AddString( "prop_ragdoll", 7 );
+
+	for ( int i = 0; i < nEntities; i++ )
+	{
+		CBaseEntity *pEntity = pSpawnList[i].m_pEntity;
+		pSpawnList[i].m_nSpawnPriority = pEntity ? g_pClassnameSpawnPriority->GetStringID( pEntity->GetClassname() ) : -1;
+	}
+
 	// Sort the entities (other than the world) by hierarchy depth, in order to spawn them in
 	// that order. This insures that each entity's parent spawns before it does so that
 	// it can properly set up anything that relies on hierarchy.
@@ -325,33 +463,62 @@ void MapEntity_ParseAllEntities(const char *pMapData, IMapEntityFilter *pFilter,
 		pMapData = serverenginetools->GetEntityData( pMapData );
 	}
 
+	CMapEntityLumpIndex lumpIndex;
+	bool bUseLumpIndex = sv_map_entity_index.GetBool() && lumpIndex.Parse( pMapData );
+
 	//  Loop through all entities in the map data, creating each.
-	for ( ; true; pMapData = MapEntity_SkipToNextEntity(pMapData, szTokenBuffer) )
+	for ( int iEntity = 0; true; iEntity++ )
 	{
-		//
-		// Parse the opening brace.
-		//
-		char token[MAPKEY_MAXLENGTH];
-		pMapData = MapEntity_ParseToken( pMapData, token );
+		CBaseEntity *pEntity;
+		const char *pCurMapData;
 
-		//
-		// Check to see if we've finished or not.
-		//
-		if (!pMapData)
-			break;
+		if ( bUseLumpIndex )
+		{
+			if ( iEntity == lumpIndex.EntityCount() )
+				break;
+
+			//
+			// Create the entity from its pre-tokenized keys.
+			//
+			const CMapEntityLumpIndex::Entity_t &indexedEntity = lumpIndex.GetEntity( iEntity );
+			CEntityMapData entData( (char *)indexedEntity.m_pData, (char *)indexedEntity.m_pDataEnd, lumpIndex.GetKeyValues( indexedEntity ), indexedEntity.m_nKeyValues );
 
-		if (token[0] != '{')
+			pCurMapData = indexedEntity.m_pData;
+			MapEntity_ParseEntity( pEntity, &entData, indexedEntity.m_pszClassName, pFilter );
+			pMapData = indexedEntity.m_pDataEnd;
+		}
+		else
 		{
-			Error( "MapEntity_ParseAllEntities: found %s when expecting {", token);
-			continue;
+			if ( iEntity )
+			{
+				pMapData = MapEntity_SkipToNextEntity( pMapData, szTokenBuffer );
+			}
+
+			//
+			// Parse the opening brace.
+			//
+			char token[MAPKEY_MAXLENGTH];
+			pMapData = MapEntity_ParseToken( pMapData, token );
+
+			//
+			// Check to see if we've finished or not.
+			//
+			if (!pMapData)
+				break;
+
+			if (token[0] != '{')
+			{
+				Error( "MapEntity_ParseAllEntities: found %s when expecting {", token);
+				continue;
+			}
+
+			//
+			// Parse the entity and add it to the spawn list.
+			//
+			pCurMapData = pMapData;
+			pMapData = MapEntity_ParseEntity(pEntity, pMapData, pFilter);
 		}
 
-		//
-		// Parse the entity and add it to the spawn list.
-		//
-		CBaseEntity *pEntity;
-		const char *pCurMapData = pMapData;
-		pMapData = MapEntity_ParseEntity(pEntity, pMapData, pFilter);
 		if (pEntity == NULL)
 			continue;
 
@@ -555,6 +722,19 @@ const char *MapEntity_ParseEntity(CBaseEntity *&pEntity, const char *pEntData, I
 		Error( "classname missing from entity!\n" );
 	}
 
+	return MapEntity_ParseEntity( pEntity, &entData, className, pFilter );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Creates an entity from map data whose classname is already known
+// Input  : pEntity - Receives the newly constructed entity, NULL on failure.
+//			pEntData - Keys to set up the entity with.
+// Output : Returns the current position in the entity data block.
+//-----------------------------------------------------------------------------
+const char *MapEntity_ParseEntity( CBaseEntity *&pEntity, CEntityMapData *pEntData, const char *className, IMapEntityFilter *pFilter )
+{
+	CEntityMapData &entData = *pEntData;
+
 	pEntity = NULL;
 	if ( !pFilter || pFilter->ShouldCreateEntity( className ) )
 	{
@@ -28,6 +28,7 @@ public:
 void MapEntity_ParseAllEntities( const char *pMapData, IMapEntityFilter *pFilter=NULL, bool bActivateEntities=false );
 
 const char *MapEntity_ParseEntity( CBaseEntity *&pEntity, const char *pEntData, IMapEntityFilter *pFilter );
+const char *MapEntity_ParseEntity( CBaseEntity *&pEntity, CEntityMapData *pEntData, const char *className, IMapEntityFilter *pFilter );
 void MapEntity_PrecacheEntity( const char *pEntData, int &nStringSize );
 
 
@@ -38,6 +39,7 @@ struct HierarchicalSpawn_t
 {
 	CBaseEntity *m_pEntity;
 	int			m_nDepth;
+	int			m_nSpawnPriority;			// classname spawn priority, filled in by SortSpawnListByHierarchy
 	CBaseEntity	*m_pDeferredParent;			// attachment parents can't be set until the parents are spawned
 	const char	*m_pDeferredParentAttachment; // so defer setting them up until the second pass
 };
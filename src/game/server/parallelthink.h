@@ -0,0 +1,86 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Deferred side effects for entities that think on the job thread pool
+//
+//=============================================================================
+#ifndef PARALLELTHINK_H
+#define PARALLELTHINK_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+#include "variant_t.h"
+
+class CBaseEntity;
+class CBaseEntityOutput;
+
+//-----------------------------------------------------------------------------
+// Purpose: Records what an entity's ParallelThink() wants done to the world so
+//			it can be applied on the main thread once the whole batch has run.
+//			Buffers are applied in think list order, so the result does not
+//			depend on which worker ran which entity.
+//
+//			String arguments are stored by pointer and must stay valid until
+//			the end of the tick (literals, string_t's or member strings).
+//-----------------------------------------------------------------------------
+class CThinkCommandBuffer
+{
+public:
+	DECLARE_CLASS_NOBASE( CThinkCommandBuffer );
+
+	// Reschedules the thinking entity's base think
+	void SetNextThink( float flNextThinkTime );
+
+	// Fires one of the thinking entity's outputs
+	void FireOutput( CBaseEntityOutput *pOutput, const variant_t &value, CBaseEntity *pActivator, CBaseEntity *pCaller, float flDelay = 0 );
+
+	// Posts an input to the named target(s) through g_EventQueue
+	void AddEvent( const char *pszTarget, const char *pszInput, const variant_t &value, float flDelay, CBaseEntity *pActivator, CBaseEntity *pCaller );
+
+	// Plays a sound script entry on the thinking entity
+	void EmitSound( const char *pszSoundName );
+
+	// Creates and spawns a new entity
+	void Create( const char *pszClassName, const Vector &vecOrigin, const QAngle &vecAngles, CBaseEntity *pOwner = NULL );
+
+	// Removes an entity
+	void Remove( CBaseEntity *pEntity );
+
+	int Count( void ) const { return m_Commands.Count(); }
+
+	// Main thread only: applies and clears the recorded commands
+	void Execute( CBaseEntity *pThinker );
+
+private:
+	enum ThinkCommandType_t
+	{
+		THINK_COMMAND_SET_NEXT_THINK = 0,
+		THINK_COMMAND_FIRE_OUTPUT,
+		THINK_COMMAND_ADD_EVENT,
+		THINK_COMMAND_EMIT_SOUND,
+		THINK_COMMAND_CREATE,
+		THINK_COMMAND_REMOVE,
+	};
+
+	struct ThinkCommand_t
+	{
+		ThinkCommandType_t	m_Type;
+		EHANDLE				m_hEntity;		// entity to remove, or owner of a new entity
+		EHANDLE				m_hActivator;
+		EHANDLE				m_hCaller;
+		CBaseEntityOutput	*m_pOutput;
+		const char			*m_pszName;		// event target, sound or classname
+		const char			*m_pszInput;
+		variant_t			m_Value;
+		float				m_flTime;		// next think time or event delay
+		Vector				m_vecOrigin;
+		QAngle				m_vecAngles;
+	};
+
+	ThinkCommand_t &AddCommand( ThinkCommandType_t type );
+
+	CUtlVector< ThinkCommand_t > m_Commands;
+};
+
+#endif // PARALLELTHINK_H
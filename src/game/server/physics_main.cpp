@@ -33,6 +33,11 @@
 #include "vphysicsupdateai.h"
 #include "tier0/vcrmode.h"
 #include "pushentity.h"
+#include "parallelthink.h"
+#include "eventqueue.h"
+#include "vstdlib/jobthread.h"
+#include "entityprofile.h"
+#include "utldict.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -46,6 +51,10 @@ ConVar vprof_scope_entity_thinks( "vprof_scope_entity_thinks", "0" );
 ConVar vprof_scope_entity_gamephys( "vprof_scope_entity_gamephys", "0" );
 
 ConVar	npc_vphysics	( "npc_vphysics","0");
+
+ConVar sv_parallel_think( "sv_parallel_think", "0", 0, "Run the thinks of entities that support it (PrepareParallelThink) on the job thread pool." );
+
+#define VPROF_BUDGETGROUP_PARALLEL_THINK	_T("Parallel Think")
 //-----------------------------------------------------------------------------
 // helper method for trace hull as used by physics...
 //-----------------------------------------------------------------------------
@@ -974,6 +983,150 @@ void CBaseEntity::PhysicsDispatchThink( BASEPTR thinkFunc )
 	VPROF_EXIT_SCOPE();
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Main thread half of a parallel think.  Does the bookkeeping that
+//			PhysicsSimulate/PhysicsRunSpecificThink would do for the base think
+//			of a stationary entity, so it can be run as ParallelThink() instead.
+// Output : true if the entity was claimed for this tick's parallel batch
+//-----------------------------------------------------------------------------
+bool CBaseEntity::PhysicsBeginParallelThink( void )
+{
+	// Only the base think of an entity that doesn't move itself can be split off;
+	// anything else still needs PhysicsSimulate
+	if ( !edict() || IsEFlagSet( EFL_NO_THINK_FUNCTION ) || m_aThinkFunctions.Count() )
+		return false;
+
+	if ( m_nSimulationTick == gpGlobals->tickcount )
+		return false;
+
+	if ( GetMoveParent() || ( GetMoveType() != MOVETYPE_NONE && GetMoveType() != MOVETYPE_VPHYSICS ) )
+		return false;
+
+#if !defined( NO_ENTITY_PREDICTION )
+	if ( IsPlayerSimulated() )
+		return false;
+#endif
+
+	if ( m_nNextThinkTick <= 0 || m_nNextThinkTick > gpGlobals->tickcount )
+		return false;
+
+	if ( !PrepareParallelThink() )
+		return false;
+
+	// Keeps the serial pass from simulating us again this tick
+	m_nSimulationTick = gpGlobals->tickcount;
+
+	SetNextThink( -1, TICK_NEVER_THINK );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Main thread half of a parallel think, run in think list order once
+//			the batch is done.
+//-----------------------------------------------------------------------------
+void CBaseEntity::PhysicsEndParallelThink( CThinkCommandBuffer &commands )
+{
+	commands.Execute( this );
+	SetLastThink( -1, gpGlobals->curtime );
+}
+
+//-----------------------------------------------------------------------------
+// CThinkCommandBuffer
+//-----------------------------------------------------------------------------
+CThinkCommandBuffer::ThinkCommand_t &CThinkCommandBuffer::AddCommand( ThinkCommandType_t type )
+{
+	ThinkCommand_t &command = m_Commands[ m_Commands.AddToTail() ];
+	command.m_Type = type;
+	command.m_pOutput = NULL;
+	command.m_pszName = NULL;
+	command.m_pszInput = NULL;
+	command.m_flTime = 0;
+	return command;
+}
+
+void CThinkCommandBuffer::SetNextThink( float flNextThinkTime )
+{
+	AddCommand( THINK_COMMAND_SET_NEXT_THINK ).m_flTime = flNextThinkTime;
+}
+
+void CThinkCommandBuffer::FireOutput( CBaseEntityOutput *pOutput, const variant_t &value, CBaseEntity *pActivator, CBaseEntity *pCaller, float flDelay )
+{
+	ThinkCommand_t &command = AddCommand( THINK_COMMAND_FIRE_OUTPUT );
+	command.m_pOutput = pOutput;
+	command.m_Value = value;
+	command.m_hActivator = pActivator;
+	command.m_hCaller = pCaller;
+	command.m_flTime = flDelay;
+}
+
+void CThinkCommandBuffer::AddEvent( const char *pszTarget, const char *pszInput, const variant_t &value, float flDelay, CBaseEntity *pActivator, CBaseEntity *pCaller )
+{
+	ThinkCommand_t &command = AddCommand( THINK_COMMAND_ADD_EVENT );
+	command.m_pszName = pszTarget;
+	command.m_pszInput = pszInput;
+	command.m_Value = value;
+	command.m_hActivator = pActivator;
+	command.m_hCaller = pCaller;
+	command.m_flTime = flDelay;
+}
+
+void CThinkCommandBuffer::EmitSound( const char *pszSoundName )
+{
+	AddCommand( THINK_COMMAND_EMIT_SOUND ).m_pszName = pszSoundName;
+}
+
+void CThinkCommandBuffer::Create( const char *pszClassName, const Vector &vecOrigin, const QAngle &vecAngles, CBaseEntity *pOwner )
+{
+	ThinkCommand_t &command = AddCommand( THINK_COMMAND_CREATE );
+	command.m_pszName = pszClassName;
+	command.m_vecOrigin = vecOrigin;
+	command.m_vecAngles = vecAngles;
+	command.m_hEntity = pOwner;
+}
+
+void CThinkCommandBuffer::Remove( CBaseEntity *pEntity )
+{
+	AddCommand( THINK_COMMAND_REMOVE ).m_hEntity = pEntity;
+}
+
+void CThinkCommandBuffer::Execute( CBaseEntity *pThinker )
+{
+	Assert( ThreadInMainThread() );
+
+	for ( int i = 0; i < m_Commands.Count(); i++ )
+	{
+		ThinkCommand_t &command = m_Commands[i];
+		switch ( command.m_Type )
+		{
+		case THINK_COMMAND_SET_NEXT_THINK:
+			pThinker->SetNextThink( command.m_flTime );
+			break;
+
+		case THINK_COMMAND_FIRE_OUTPUT:
+			command.m_pOutput->FireOutput( command.m_Value, command.m_hActivator, command.m_hCaller, command.m_flTime );
+			break;
+
+		case THINK_COMMAND_ADD_EVENT:
+			g_EventQueue.AddEvent( command.m_pszName, command.m_pszInput, command.m_Value, command.m_flTime, command.m_hActivator, command.m_hCaller );
+			break;
+
+		case THINK_COMMAND_EMIT_SOUND:
+			pThinker->EmitSound( command.m_pszName );
+			break;
+
+		case THINK_COMMAND_CREATE:
+			CBaseEntity::Create( command.m_pszName, command.m_vecOrigin, command.m_vecAngles, command.m_hEntity );
+			break;
+
+		case THINK_COMMAND_REMOVE:
+			UTIL_Remove( command.m_hEntity );
+			break;
+		}
+	}
+
+	m_Commands.RemoveAll();
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Does not change the entities velocity at all
 // Input  : push - 
@@ -1944,6 +2097,7 @@ void Physics_SimulateEntity( CBaseEntity *pEntity )
 	VPROF( ( !vprof_scope_entity_gamephys.GetBool() ) ? 
 			"Physics_SimulateEntity" : 
 			EntityFactoryDictionary()->GetCannonicalName( pEntity->GetClassname() ) );
+	ENTITY_PROFILE_SCOPE( pEntity, ENTITY_PROFILE_SIMULATE );
 
 	if ( pEntity->edict() )
 	{
@@ -2013,6 +2167,63 @@ void Physics_SimulateEntity( CBaseEntity *pEntity )
 		pEntity->PhysicsRunThink();
 	}
 }
+//-----------------------------------------------------------------------------
+// Parallel think batch
+//-----------------------------------------------------------------------------
+struct ParallelThinkItem_t
+{
+	CBaseEntity			*m_pEntity;
+	CThinkCommandBuffer	m_Commands;
+};
+
+static CUtlVector< ParallelThinkItem_t > s_ParallelThinkItems;
+
+static void RunParallelThink( ParallelThinkItem_t &item )
+{
+	item.m_pEntity->ParallelThink( item.m_Commands );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Pulls the entities whose think can run off the main thread out of
+//			the think list, runs them on the job pool, then applies their
+//			deferred commands in list order.  The serial pass afterwards skips
+//			them because they have already been simulated this tick.
+//-----------------------------------------------------------------------------
+static void Physics_RunParallelThinks( CBaseEntity **list, int count )
+{
+	{
+		VPROF_BUDGET( "Physics_RunParallelThinks - gather", VPROF_BUDGETGROUP_PARALLEL_THINK );
+
+		for ( int i = 0; i < count; i++ )
+		{
+			if ( list[i] && list[i]->PhysicsBeginParallelThink() )
+			{
+				s_ParallelThinkItems[ s_ParallelThinkItems.AddToTail() ].m_pEntity = list[i];
+			}
+		}
+	}
+
+	if ( !s_ParallelThinkItems.Count() )
+		return;
+
+	{
+		// Wall clock time of the batch; the workers themselves don't show up in vprof
+		VPROF_BUDGET( "Physics_RunParallelThinks - jobs", VPROF_BUDGETGROUP_PARALLEL_THINK );
+		ParallelProcess( "ParallelThink", s_ParallelThinkItems.Base(), s_ParallelThinkItems.Count(), &RunParallelThink );
+	}
+
+	{
+		VPROF_BUDGET( "Physics_RunParallelThinks - apply", VPROF_BUDGETGROUP_PARALLEL_THINK );
+
+		for ( int i = 0; i < s_ParallelThinkItems.Count(); i++ )
+		{
+			s_ParallelThinkItems[i].m_pEntity->PhysicsEndParallelThink( s_ParallelThinkItems[i].m_Commands );
+		}
+	}
+
+	s_ParallelThinkItems.RemoveAll();
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Runs the main physics simulation loop against all entities ( except players )
 //-----------------------------------------------------------------------------
@@ -2054,7 +2265,14 @@ void Physics_RunThinkFunctions( bool simulating )
 		// Do we really need UTIL_RemoveImmediate()?
 		int count = SimThink_ListCopy( list, listMax );
 
+		if ( sv_parallel_think.GetBool() && g_pThreadPool && g_pThreadPool->NumThreads() )
+		{
+			gpGlobals->curtime = starttime;
+			Physics_RunParallelThinks( list, count );
+		}
+
 		//DevMsg(1, "Count: %d\n", count );
+		VPROF_SCOPE_BEGIN( "Physics_RunThinkFunctions - serial" );
 		for ( int i = 0; i < count; i++ )
 		{
 			if ( !list[i] )
@@ -2063,6 +2281,7 @@ void Physics_RunThinkFunctions( bool simulating )
 			gpGlobals->curtime = starttime;
 			Physics_SimulateEntity( list[i] );
 		}
+		VPROF_SCOPE_END();
 
 		stackfree( list );
 		UTIL_EnableRemoveImmediate();
@@ -2071,3 +2290,257 @@ void Physics_RunThinkFunctions( bool simulating )
 	gpGlobals->curtime = starttime;
 }
 
+
+
+//-----------------------------------------------------------------------------
+// Per-entity CPU profiling (see entityprofile.h)
+//-----------------------------------------------------------------------------
+#define ENTITY_PROFILE_MAX_SAMPLES	65536
+
+bool g_bEntityProfile = false;
+
+struct EntityProfileSample_t
+{
+	unsigned long	m_hEntity;
+	string_t		m_iClassname;
+	string_t		m_iName;
+	int				m_nTick;
+	int				m_Category;
+	uint64			m_nCycles;
+};
+
+// Ring buffer of the most recent samples
+static CUtlVector< EntityProfileSample_t > g_EntityProfileSamples;
+static int g_iNextEntityProfileSample = 0;
+static CEntityProfileScope *g_pCurrentEntityProfileScope = NULL;
+
+static const char *s_pEntityProfileCategoryNames[ENTITY_PROFILE_CATEGORY_COUNT] =
+{
+	"simulate",
+	"think",
+	"ai",
+	"input",
+};
+
+static void EntityProfileChanged( IConVar *pConVar, const char *pOldString, float flOldValue )
+{
+	ConVarRef var( pConVar );
+	g_bEntityProfile = var.GetBool();
+
+	// Keep the samples when turning it off so they can still be dumped
+	if ( g_bEntityProfile )
+	{
+		g_EntityProfileSamples.RemoveAll();
+		g_EntityProfileSamples.EnsureCapacity( ENTITY_PROFILE_MAX_SAMPLES );
+		g_iNextEntityProfileSample = 0;
+	}
+}
+
+ConVar sv_entity_profile( "sv_entity_profile", "0", 0, "Record the CPU time entities spend simulating, thinking, running AI and handling inputs. See sv_entity_profile_dump.", EntityProfileChanged );
+
+void CEntityProfileScope::Begin( CBaseEntity *pEntity, EntityProfileCategory_t category )
+{
+	Assert( ThreadInMainThread() );
+
+	m_Category = category;
+	m_hEntity = pEntity->GetRefEHandle().ToInt();
+	m_iClassname = pEntity->m_iClassname;
+	m_iName = pEntity->GetEntityName();
+	m_nChildCycles = 0;
+
+	m_pParent = g_pCurrentEntityProfileScope;
+	g_pCurrentEntityProfileScope = this;
+
+	m_Timer.Start();
+}
+
+void CEntityProfileScope::End()
+{
+	m_Timer.End();
+	uint64 nCycles = m_Timer.GetDuration().GetLongCycles();
+
+	g_pCurrentEntityProfileScope = m_pParent;
+	if ( m_pParent )
+	{
+		m_pParent->m_nChildCycles += nCycles;
+	}
+
+	int i = g_iNextEntityProfileSample;
+	if ( i == g_EntityProfileSamples.Count() )
+	{
+		g_EntityProfileSamples.AddToTail();
+	}
+	g_iNextEntityProfileSample = ( i + 1 ) % ENTITY_PROFILE_MAX_SAMPLES;
+
+	EntityProfileSample_t &sample = g_EntityProfileSamples[i];
+	sample.m_hEntity = m_hEntity;
+	sample.m_iClassname = m_iClassname;
+	sample.m_iName = m_iName;
+	sample.m_nTick = gpGlobals->tickcount;
+	sample.m_Category = m_Category;
+	sample.m_nCycles = ( nCycles > m_nChildCycles ) ? nCycles - m_nChildCycles : 0;
+}
+
+struct EntityProfileTotal_t
+{
+	unsigned long	m_hEntity;
+	string_t		m_iClassname;
+	string_t		m_iName;
+	int				m_nSamples;
+	uint64			m_nTotalCycles;
+	uint64			m_nCycles[ENTITY_PROFILE_CATEGORY_COUNT];
+};
+
+static void EntityProfile_Accumulate( EntityProfileTotal_t &total, const EntityProfileSample_t &sample )
+{
+	total.m_nSamples++;
+	total.m_nTotalCycles += sample.m_nCycles;
+	total.m_nCycles[sample.m_Category] += sample.m_nCycles;
+}
+
+static int EntityProfile_CompareTotals( const EntityProfileTotal_t *pLeft, const EntityProfileTotal_t *pRight )
+{
+	if ( pLeft->m_nTotalCycles != pRight->m_nTotalCycles )
+		return ( pLeft->m_nTotalCycles > pRight->m_nTotalCycles ) ? -1 : 1;
+	return 0;
+}
+
+static double EntityProfile_Milliseconds( uint64 nCycles )
+{
+	return CCycleCount( nCycles ).GetMillisecondsF();
+}
+
+// Names come from the map, so they may need escaping in JSON output
+static const char *EntityProfile_JSONString( const char *pszString, char *pszBuffer, int nBufferSize )
+{
+	int j = 0;
+	for ( int i = 0; pszString[i] && j < nBufferSize - 2; i++ )
+	{
+		if ( pszString[i] == '"' || pszString[i] == '\\' )
+		{
+			pszBuffer[j++] = '\\';
+		}
+		pszBuffer[j++] = pszString[i];
+	}
+	pszBuffer[j] = 0;
+	return pszBuffer;
+}
+
+static void EntityProfile_PrintTotals( const char *pszType, const CUtlVector< EntityProfileTotal_t > &totals, int nCount, bool bJSON )
+{
+	nCount = MIN( nCount, totals.Count() );
+	if ( bJSON )
+	{
+		Msg( "  \"%s\": [\n", pszType );
+	}
+
+	for ( int i = 0; i < nCount; i++ )
+	{
+		const EntityProfileTotal_t &total = totals[i];
+		bool bEntity = ( total.m_hEntity != INVALID_EHANDLE_INDEX );
+		int iEntity = bEntity ? (int)( total.m_hEntity & ENT_ENTRY_MASK ) : -1;
+		const char *pszName = ( bEntity && total.m_iName != NULL_STRING ) ? STRING( total.m_iName ) : "";
+
+		if ( bJSON )
+		{
+			char szClassName[256], szName[256];
+			Msg( "    { \"index\": %d, \"classname\": \"%s\", \"name\": \"%s\", \"samples\": %d, \"total_ms\": %.4f",
+				iEntity,
+				EntityProfile_JSONString( STRING( total.m_iClassname ), szClassName, sizeof( szClassName ) ),
+				EntityProfile_JSONString( pszName, szName, sizeof( szName ) ),
+				total.m_nSamples, EntityProfile_Milliseconds( total.m_nTotalCycles ) );
+			for ( int j = 0; j < ENTITY_PROFILE_CATEGORY_COUNT; j++ )
+			{
+				Msg( ", \"%s_ms\": %.4f", s_pEntityProfileCategoryNames[j], EntityProfile_Milliseconds( total.m_nCycles[j] ) );
+			}
+			Msg( " }%s\n", ( i < nCount - 1 ) ? "," : "" );
+		}
+		else
+		{
+			Msg( "%s,%d,%s,%s,%d,%.4f", pszType, iEntity, STRING( total.m_iClassname ), pszName,
+				total.m_nSamples, EntityProfile_Milliseconds( total.m_nTotalCycles ) );
+			for ( int j = 0; j < ENTITY_PROFILE_CATEGORY_COUNT; j++ )
+			{
+				Msg( ",%.4f", EntityProfile_Milliseconds( total.m_nCycles[j] ) );
+			}
+			Msg( "\n" );
+		}
+	}
+
+	if ( bJSON )
+	{
+		Msg( "  ]" );
+	}
+}
+
+CON_COMMAND( sv_entity_profile_dump, "Prints the entities and classes that used the most CPU while sv_entity_profile was on: sv_entity_profile_dump [csv|json] [count]" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	bool bJSON = ( args.ArgC() > 1 ) && !Q_stricmp( args[1], "json" );
+	int nCount = ( args.ArgC() > 2 ) ? MAX( atoi( args[2] ), 1 ) : 20;
+
+	CUtlVector< EntityProfileTotal_t > entityTotals;
+	CUtlVector< EntityProfileTotal_t > classTotals;
+	CUtlMap< unsigned long, int > entityLookup( DefLessFunc( unsigned long ) );
+	CUtlDict< int, int > classLookup;
+
+	int nFirstTick = INT_MAX;
+	int nLastTick = INT_MIN;
+	for ( int i = 0; i < g_EntityProfileSamples.Count(); i++ )
+	{
+		const EntityProfileSample_t &sample = g_EntityProfileSamples[i];
+		nFirstTick = MIN( nFirstTick, sample.m_nTick );
+		nLastTick = MAX( nLastTick, sample.m_nTick );
+
+		unsigned short iEntity = entityLookup.Find( sample.m_hEntity );
+		if ( iEntity == entityLookup.InvalidIndex() )
+		{
+			int iTotal = entityTotals.AddToTail();
+			memset( &entityTotals[iTotal], 0, sizeof( EntityProfileTotal_t ) );
+			entityTotals[iTotal].m_hEntity = sample.m_hEntity;
+			entityTotals[iTotal].m_iClassname = sample.m_iClassname;
+			entityTotals[iTotal].m_iName = sample.m_iName;
+			iEntity = entityLookup.Insert( sample.m_hEntity, iTotal );
+		}
+		EntityProfile_Accumulate( entityTotals[ entityLookup[iEntity] ], sample );
+
+		int iClass = classLookup.Find( STRING( sample.m_iClassname ) );
+		if ( iClass == classLookup.InvalidIndex() )
+		{
+			int iTotal = classTotals.AddToTail();
+			memset( &classTotals[iTotal], 0, sizeof( EntityProfileTotal_t ) );
+			classTotals[iTotal].m_hEntity = INVALID_EHANDLE_INDEX;
+			classTotals[iTotal].m_iClassname = sample.m_iClassname;
+			classTotals[iTotal].m_iName = NULL_STRING;
+			iClass = classLookup.Insert( STRING( sample.m_iClassname ), iTotal );
+		}
+		EntityProfile_Accumulate( classTotals[ classLookup[iClass] ], sample );
+	}
+
+	entityTotals.Sort( EntityProfile_CompareTotals );
+	classTotals.Sort( EntityProfile_CompareTotals );
+
+	int nTicks = g_EntityProfileSamples.Count() ? ( nLastTick - nFirstTick + 1 ) : 0;
+	if ( bJSON )
+	{
+		Msg( "{\n  \"samples\": %d,\n  \"ticks\": %d,\n", g_EntityProfileSamples.Count(), nTicks );
+		EntityProfile_PrintTotals( "entities", entityTotals, nCount, true );
+		Msg( ",\n" );
+		EntityProfile_PrintTotals( "classes", classTotals, nCount, true );
+		Msg( "\n}\n" );
+	}
+	else
+	{
+		Msg( "# %d samples over %d ticks\n", g_EntityProfileSamples.Count(), nTicks );
+		Msg( "type,index,classname,name,samples,total_ms" );
+		for ( int j = 0; j < ENTITY_PROFILE_CATEGORY_COUNT; j++ )
+		{
+			Msg( ",%s_ms", s_pEntityProfileCategoryNames[j] );
+		}
+		Msg( "\n" );
+		EntityProfile_PrintTotals( "entity", entityTotals, nCount, false );
+		EntityProfile_PrintTotals( "class", classTotals, nCount, false );
+	}
+}
@@ -10,7 +10,6 @@
 #include "igamesystem.h"
 #include "ilagcompensationmanager.h"
 #include "inetchannelinfo.h"
-#include "utllinkedlist.h"
 #include "BaseAnimatingOverlay.h"
 #include "tier0/vprof.h"
 
@@ -37,6 +36,12 @@ ConVar sv_showlagcompensation( "sv_showlagcompensation", "0", FCVAR_CHEAT, "Show
 
 ConVar sv_unlag_fixstuck( "sv_unlag_fixstuck", "0", FCVAR_DEVELOPMENTONLY, "Disallow backtracking a player for lag compensation if it will cause them to become stuck" );
 
+ConVar sv_unlag_broadphase( "sv_unlag_broadphase", "1", FCVAR_DEVELOPMENTONLY, "Skip backtracking players whose recent history lies outside the shooter's fire cone" );
+ConVar sv_unlag_broadphase_cone( "sv_unlag_broadphase_cone", "45", FCVAR_DEVELOPMENTONLY, "Half angle (degrees) of the fire cone used by sv_unlag_broadphase", true, 0.0f, true, 180.0f );
+
+// Longest history we ever need to keep (the upper limit of sv_maxunlag)
+#define LAG_HISTORY_MAX_TIME	1.0f
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 //-----------------------------------------------------------------------------
@@ -115,6 +120,182 @@ public:
 };
 
 
+//-----------------------------------------------------------------------------
+// Purpose: History of lag records for one player, kept in a ring buffer with
+//			index 0 being the newest record. The fields searched on every
+//			backtrack (simulation time and origin) are stored apart from the
+//			full records so a lookup only touches a few cache lines.
+//-----------------------------------------------------------------------------
+class CLagRecordTrack
+{
+public:
+	CLagRecordTrack()
+	{
+		m_nHead = 0;
+		m_nCount = 0;
+		m_flNewestBreakTime = -FLT_MAX;
+		m_vecSweptMins.Init();
+		m_vecSweptMaxs.Init();
+	}
+
+	void Purge()
+	{
+		m_flSimulationTime.Purge();
+		m_vecOrigin.Purge();
+		m_Records.Purge();
+		RemoveAll();
+	}
+
+	void RemoveAll()
+	{
+		m_nHead = 0;
+		m_nCount = 0;
+		m_flNewestBreakTime = -FLT_MAX;
+	}
+
+	int Count() const								{ return m_nCount; }
+
+	float SimulationTime( int i ) const				{ return m_flSimulationTime[ Slot( i ) ]; }
+	const Vector &Origin( int i ) const				{ return m_vecOrigin[ Slot( i ) ]; }
+	LagRecord &Record( int i )						{ return m_Records[ Slot( i ) ]; }
+
+	// Adds a new, reset record at the head, overwriting the oldest if the buffer is full.
+	// Call CommitHead() once the record has been filled in.
+	LagRecord &AddToHead();
+	void CommitHead( float flTeleportDistanceSqr );
+
+	// Drops records older than the given time from the tail
+	void RemoveOlderThan( float flDeadTime );
+
+	// Returns the newest record at or before the target time, or the oldest record
+	// if they are all newer. Adds the number of records looked at to *pExamined.
+	int FindRecord( float flTargetTime, int *pExamined ) const;
+
+	// Is the player's history broken (death or teleport) between the head and record i?
+	bool HasBreakSince( int i ) const				{ return ( m_flNewestBreakTime >= SimulationTime( i ) ); }
+
+	// Bounds of the recorded origins
+	void UpdateSweptBounds();
+	const Vector &SweptMins() const					{ return m_vecSweptMins; }
+	const Vector &SweptMaxs() const					{ return m_vecSweptMaxs; }
+
+private:
+	int Capacity() const							{ return m_Records.Count(); }
+	int Slot( int i ) const
+	{
+		Assert( i >= 0 && i < m_nCount );
+		int slot = m_nHead - i;
+		return ( slot < 0 ) ? slot + Capacity() : slot;
+	}
+
+	CUtlVector< float >		m_flSimulationTime;
+	CUtlVector< Vector >	m_vecOrigin;
+	CUtlVector< LagRecord >	m_Records;
+
+	int						m_nHead;
+	int						m_nCount;
+
+	// Simulation time of the newest record that can't be backtracked through
+	float					m_flNewestBreakTime;
+
+	Vector					m_vecSweptMins;
+	Vector					m_vecSweptMaxs;
+};
+
+LagRecord &CLagRecordTrack::AddToHead()
+{
+	if ( !Capacity() )
+	{
+		// One record per tick is the most we'll ever add
+		int nCapacity = TIME_TO_TICKS( LAG_HISTORY_MAX_TIME ) + 2;
+		m_flSimulationTime.SetCount( nCapacity );
+		m_vecOrigin.SetCount( nCapacity );
+		m_Records.SetCount( nCapacity );
+		m_nHead = 0;
+		m_nCount = 0;
+	}
+
+	m_nHead = ( m_nHead + 1 ) % Capacity();
+	if ( m_nCount < Capacity() )
+	{
+		m_nCount++;
+	}
+
+	LagRecord &record = m_Records[ m_nHead ];
+	record = LagRecord();
+	return record;
+}
+
+void CLagRecordTrack::CommitHead( float flTeleportDistanceSqr )
+{
+	int slot = Slot( 0 );
+	const LagRecord &record = m_Records[ slot ];
+	m_flSimulationTime[ slot ] = record.m_flSimulationTime;
+	m_vecOrigin[ slot ] = record.m_vecOrigin;
+
+	if ( !( record.m_fFlags & LC_ALIVE ) )
+	{
+		m_flNewestBreakTime = record.m_flSimulationTime;
+	}
+	else if ( m_nCount > 1 )
+	{
+		// Can't backtrack past the previous record if the player teleported since then
+		Vector delta = Origin( 1 ) - record.m_vecOrigin;
+		if ( delta.Length2DSqr() > flTeleportDistanceSqr )
+		{
+			m_flNewestBreakTime = MAX( m_flNewestBreakTime, SimulationTime( 1 ) );
+		}
+	}
+}
+
+void CLagRecordTrack::RemoveOlderThan( float flDeadTime )
+{
+	while ( m_nCount > 0 && SimulationTime( m_nCount - 1 ) < flDeadTime )
+	{
+		m_nCount--;
+	}
+}
+
+int CLagRecordTrack::FindRecord( float flTargetTime, int *pExamined ) const
+{
+	Assert( m_nCount > 0 );
+
+	// Simulation times decrease with the index
+	int lo = 0;
+	int hi = m_nCount - 1;
+	int nExamined = 0;
+	while ( lo < hi )
+	{
+		int mid = ( lo + hi ) / 2;
+		nExamined++;
+		if ( SimulationTime( mid ) <= flTargetTime )
+		{
+			hi = mid;
+		}
+		else
+		{
+			lo = mid + 1;
+		}
+	}
+
+	*pExamined += nExamined + 1;
+	return lo;
+}
+
+void CLagRecordTrack::UpdateSweptBounds()
+{
+	if ( !m_nCount )
+		return;
+
+	m_vecSweptMins = m_vecSweptMaxs = Origin( 0 );
+	for ( int i = 1; i < m_nCount; i++ )
+	{
+		VectorMin( m_vecSweptMins, Origin( i ), m_vecSweptMins );
+		VectorMax( m_vecSweptMaxs, Origin( i ), m_vecSweptMaxs );
+	}
+}
+
+
 //
 // Try to take the player from his current origin to vWantedPos.
 // If it can't get there, leave the player where he is.
@@ -172,6 +353,7 @@ class CLagCompensationManager : public CAutoGameSystemPerFrame, public ILagCompe
 public:
 	CLagCompensationManager( char const *name ) : CAutoGameSystemPerFrame( name ), m_flTeleportDistanceSqr( 64 *64 )
 	{
+		memset( &m_Stats, 0, sizeof( m_Stats ) );
 	}
 
 	// IServerSystem stuff
@@ -194,8 +376,11 @@ public:
 	void			StartLagCompensation( CBasePlayer *player, CUserCmd *cmd );
 	void			FinishLagCompensation( CBasePlayer *player );
 
+	void			ReportStats();
+
 private:
 	void			BacktrackPlayer( CBasePlayer *player, float flTargetTime );
+	bool			IsInFireCone( CBasePlayer *pPlayer, const Vector &vecEye, const Vector &vecForward, float flConeRadians );
 
 	void ClearHistory()
 	{
@@ -203,8 +388,8 @@ private:
 			m_PlayerTrack[i].Purge();
 	}
 
-	// keep a list of lag records for each player
-	CUtlFixedLinkedList< LagRecord >	m_PlayerTrack[ MAX_PLAYERS ];
+	// keep a history of lag records for each player
+	CLagRecordTrack			m_PlayerTrack[ MAX_PLAYERS ];
 
 	// Scratchpad for determining what needs to be restored
 	CBitVec<MAX_PLAYERS>	m_RestorePlayer;
@@ -216,6 +401,17 @@ private:
 	CBasePlayer				*m_pCurrentPlayer;	// The player we are doing lag compensation for
 
 	float					m_flTeleportDistanceSqr;
+
+	struct Stats_t
+	{
+		int		nSessions;			// lag compensated user commands
+		int		nConsidered;		// players that passed WantsLagCompensationOnEntity
+		int		nCulled;			// players rejected by the fire cone broad-phase
+		int		nExamined;			// history records looked at
+		int		nRestored;			// players actually moved back in time
+	};
+
+	Stats_t					m_Stats;
 };
 
 static CLagCompensationManager g_LagCompensationManager( "CLagCompensationManager" );
@@ -238,14 +434,14 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 	VPROF_BUDGET( "FrameUpdatePostEntityThink", "CLagCompensationManager" );
 
 	// remove all records before that time:
-	int flDeadtime = gpGlobals->curtime - sv_maxunlag.GetFloat();
+	float flDeadtime = gpGlobals->curtime - sv_maxunlag.GetFloat();
 
 	// Iterate all active players
 	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
 	{
 		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
 
-		CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[i-1];
+		CLagRecordTrack *track = &m_PlayerTrack[i-1];
 
 		if ( !pPlayer )
 		{
@@ -257,35 +453,22 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 			continue;
 		}
 
-		Assert( track->Count() < 1000 ); // insanity check
-
 		// remove tail records that are too old
-		int tailIndex = track->Tail();
-		while ( track->IsValidIndex( tailIndex ) )
-		{
-			LagRecord &tail = track->Element( tailIndex );
-
-			// if tail is within limits, stop
-			if ( tail.m_flSimulationTime >= flDeadtime )
-				break;
-			
-			// remove tail, get new tail
-			track->Remove( tailIndex );
-			tailIndex = track->Tail();
-		}
+		track->RemoveOlderThan( flDeadtime );
 
 		// check if head has same simulation time
 		if ( track->Count() > 0 )
 		{
-			LagRecord &head = track->Element( track->Head() );
-
 			// check if player changed simulation time since last time updated
-			if ( head.m_flSimulationTime >= pPlayer->GetSimulationTime() )
+			if ( track->SimulationTime( 0 ) >= pPlayer->GetSimulationTime() )
+			{
+				track->UpdateSweptBounds();
 				continue; // don't add new entry for same or older time
+			}
 		}
 
 		// add new record to player track
-		LagRecord &record = track->Element( track->AddToHead() );
+		LagRecord &record = track->AddToHead();
 
 		record.m_fFlags = 0;
 		if ( pPlayer->IsAlive() )
@@ -313,6 +496,9 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 		}
 		record.m_masterSequence = pPlayer->GetSequence();
 		record.m_masterCycle = pPlayer->GetCycle();
+
+		track->CommitHead( m_flTeleportDistanceSqr );
+		track->UpdateSweptBounds();
 	}
 
 	//Clear the current player.
@@ -384,6 +570,15 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		// DevMsg("StartLagCompensation: delta too big (%.3f)\n", deltaTime );
 		targettick = gpGlobals->tickcount - TIME_TO_TICKS( correct );
 	}
+
+	m_Stats.nSessions++;
+
+	// Only players whose recent history passes through the fire cone can be hit
+	bool bBroadPhase = sv_unlag_broadphase.GetBool();
+	float flConeRadians = DEG2RAD( sv_unlag_broadphase_cone.GetFloat() );
+	Vector vecEye = player->EyePosition();
+	Vector vecForward;
+	AngleVectors( cmd->viewangles, &vecForward );
 	
 	// Iterate all active players
 	const CBitVec<MAX_EDICTS> *pEntityTransmitBits = engine->GetEntityTransmitBitsForClient( player->entindex() - 1 );
@@ -406,11 +601,50 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		if ( !player->WantsLagCompensationOnEntity( pPlayer, cmd, pEntityTransmitBits ) )
 			continue;
 
+		m_Stats.nConsidered++;
+
+		if ( bBroadPhase && !IsInFireCone( pPlayer, vecEye, vecForward, flConeRadians ) )
+		{
+			m_Stats.nCulled++;
+			continue;
+		}
+
 		// Move other player back in time
 		BacktrackPlayer( pPlayer, TICKS_TO_TIME( targettick ) );
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Broad-phase test of a player's recorded positions against the cone
+//			the shooter could be firing into
+//-----------------------------------------------------------------------------
+bool CLagCompensationManager::IsInFireCone( CBasePlayer *pPlayer, const Vector &vecEye, const Vector &vecForward, float flConeRadians )
+{
+	const CLagRecordTrack &track = m_PlayerTrack[ pPlayer->entindex() - 1 ];
+	if ( track.Count() <= 0 )
+		return true;
+
+	// Bound the swept hull with a sphere around the recorded origins and the current one
+	Vector vecMins, vecMaxs;
+	VectorMin( track.SweptMins(), pPlayer->GetLocalOrigin(), vecMins );
+	VectorMax( track.SweptMaxs(), pPlayer->GetLocalOrigin(), vecMaxs );
+
+	CCollisionProperty *pCollision = pPlayer->CollisionProp();
+	Vector vecCenter = ( vecMins + vecMaxs ) * 0.5f + pCollision->OBBCenter();
+	float flRadius = ( vecMaxs - vecMins ).Length() * 0.5f + pCollision->BoundingRadius();
+
+	Vector vecToCenter = vecCenter - vecEye;
+	float flDist = vecToCenter.Length();
+	if ( flDist <= flRadius )
+		return true;
+
+	// The sphere touches the cone if the angle to its center is within the cone
+	// angle plus the angle the sphere subtends
+	float flCos = clamp( DotProduct( vecToCenter, vecForward ) / flDist, -1.0f, 1.0f );
+	float flAngle = acos( flCos );
+	return ( flAngle <= flConeRadians + asin( flRadius / flDist ) );
+}
+
 void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
 {
 	Vector org;
@@ -422,63 +656,33 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	int pl_index = pPlayer->entindex() - 1;
 
 	// get track history of this player
-	CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[ pl_index ];
+	CLagRecordTrack *track = &m_PlayerTrack[ pl_index ];
 
 	// check if we have at leat one entry
 	if ( track->Count() <= 0 )
 		return;
 
-	int curr = track->Head();
+	// find a context smaller than target time
+	int iRecord = track->FindRecord( flTargetTime, &m_Stats.nExamined );
 
-	LagRecord *prevRecord = NULL;
-	LagRecord *record = NULL;
-
-	Vector prevOrg = pPlayer->GetLocalOrigin();
-	
-	// Walk context looking for any invalidating event
-	while( track->IsValidIndex(curr) )
+	// Deaths and teleports between recorded positions were found when the
+	// records were added, only the move since the newest record is left to check
+	Vector delta = track->Origin( 0 ) - pPlayer->GetLocalOrigin();
+	if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
 	{
-		// remember last record
-		prevRecord = record;
-
-		// get next record
-		record = &track->Element( curr );
-
-		if ( !(record->m_fFlags & LC_ALIVE) )
-		{
-			// player most be alive, lost track
-			return;
-		}
-
-		Vector delta = record->m_vecOrigin - prevOrg;
-		if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
-		{
-			// lost track, too much difference
-			return; 
-		}
-
-		// did we find a context smaller than target time ?
-		if ( record->m_flSimulationTime <= flTargetTime )
-			break; // hurra, stop
-
-		prevOrg = record->m_vecOrigin;
-
-		// go one step back
-		curr = track->Next( curr );
+		// lost track, too much difference
+		return; 
 	}
 
-	Assert( record );
-
-	if ( !record )
+	if ( track->HasBreakSince( iRecord ) )
 	{
-		if ( sv_unlag_debug.GetBool() )
-		{
-			DevMsg( "No valid positions in history for BacktrackPlayer client ( %s )\n", pPlayer->GetPlayerName() );
-		}
-
-		return; // that should never happen
+		// player must be alive and not have teleported, lost track
+		return;
 	}
 
+	LagRecord *record = &track->Record( iRecord );
+	LagRecord *prevRecord = ( iRecord > 0 ) ? &track->Record( iRecord - 1 ) : NULL;
+
 	float frac = 0.0f;
 	if ( prevRecord && 
 		 (record->m_flSimulationTime < flTargetTime) &&
@@ -717,6 +921,7 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 
 	m_RestorePlayer.Set( pl_index ); //remember that we changed this player
 	m_bNeedToRestore = true;  // we changed at least one player
+	m_Stats.nRestored++;
 	restore->m_fFlags = flags; // we need to restore these flags
 	change->m_fFlags = flags; // we have changed these flags
 
@@ -828,4 +1033,29 @@ void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Print and reset the lag compensation counters
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::ReportStats()
+{
+	if ( !m_Stats.nSessions )
+	{
+		Msg( "No lag compensated commands\n" );
+		return;
+	}
+
+	Msg( "Lag compensated commands: %d\n", m_Stats.nSessions );
+	Msg( "Players considered:       %d (%d culled by broad-phase)\n", m_Stats.nConsidered, m_Stats.nCulled );
+	Msg( "Records examined:         %d\n", m_Stats.nExamined );
+	Msg( "Players restored:         %d\n", m_Stats.nRestored );
+
+	memset( &m_Stats, 0, sizeof( m_Stats ) );
+}
+
+CON_COMMAND( sv_unlag_stats_report, "Report and reset lag compensation statistics" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
 
+	g_LagCompensationManager.ReportStats();
+}
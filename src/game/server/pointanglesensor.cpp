@@ -14,6 +14,7 @@
 #include "entityinput.h"
 #include "entityoutput.h"
 #include "eventqueue.h"
+#include "parallelthink.h"
 #include "mathlib/mathlib.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -406,6 +407,8 @@ public:
 protected:
 
 	void Think( void );
+	bool PrepareParallelThink( void );
+	void ParallelThink( CThinkCommandBuffer &commands );
 	void Enable( void );
 	void Disable( void );
 
@@ -417,6 +420,8 @@ protected:
 
 private:
 
+	float	GetTargetDistance( void );
+
 	bool	m_bDisabled;			// When disabled, we do not think or fire outputs.
 	EHANDLE m_hTargetEntity;		// Entity whose angles are being monitored.
 
@@ -539,24 +544,54 @@ void CPointProximitySensor::Disable( void )
 //-----------------------------------------------------------------------------
 // Purpose: Called every frame
 //-----------------------------------------------------------------------------
-void CPointProximitySensor::Think( void )
+float CPointProximitySensor::GetTargetDistance( void )
 {
-	if ( m_hTargetEntity != NULL )
+	Vector vecTestDir = ( m_hTargetEntity->GetAbsOrigin() - GetAbsOrigin() );
+	float flDist = VectorNormalize( vecTestDir );
+
+	// If we're only interested in the distance along a vector, modify the length the accomodate that
+	if ( HasSpawnFlags( SF_PROXIMITY_TEST_AGAINST_AXIS ) )
 	{
-		Vector vecTestDir = ( m_hTargetEntity->GetAbsOrigin() - GetAbsOrigin() );
-		float flDist = VectorNormalize( vecTestDir );
+		Vector vecDir;
+		GetVectors( &vecDir, NULL, NULL );
 
-		// If we're only interested in the distance along a vector, modify the length the accomodate that
-		if ( HasSpawnFlags( SF_PROXIMITY_TEST_AGAINST_AXIS ) )
-		{
-			Vector vecDir;
-			GetVectors( &vecDir, NULL, NULL );
+		float flDot = DotProduct( vecTestDir, vecDir );
+		flDist *= fabs( flDot );
+	}
 
-			float flDot = DotProduct( vecTestDir, vecDir );
-			flDist *= fabs( flDot );
-		}
+	return flDist;
+}
 
-		m_Distance.Set( flDist, this, this );
+void CPointProximitySensor::Think( void )
+{
+	if ( m_hTargetEntity != NULL )
+	{
+		m_Distance.Set( GetTargetDistance(), this, this );
 		SetNextThink( gpGlobals->curtime );
 	}
 }
+
+//-----------------------------------------------------------------------------
+// Purpose: The distance test only reads two transforms, so it can run as a
+//			parallel think.  Resolve both here so the worker doesn't have to.
+//-----------------------------------------------------------------------------
+bool CPointProximitySensor::PrepareParallelThink( void )
+{
+	if ( m_hTargetEntity == NULL )
+		return false;
+
+	GetAbsOrigin();
+	m_hTargetEntity->GetAbsOrigin();
+	return true;
+}
+
+void CPointProximitySensor::ParallelThink( CThinkCommandBuffer &commands )
+{
+	float flDist = GetTargetDistance();
+	m_Distance.Init( flDist );
+
+	variant_t value;
+	value.SetFloat( flDist );
+	commands.FireOutput( &m_Distance, value, this, this );
+	commands.SetNextThink( gpGlobals->curtime );
+}
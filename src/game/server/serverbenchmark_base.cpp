@@ -9,6 +9,7 @@
 #include "props.h"
 #include "filesystem.h"
 #include "tier0/icommandline.h"
+#include "tier0/vprof.h"
 
 
 // Server benchmark. Only works on specified maps.
@@ -17,16 +18,31 @@
 // Create 20 players and move them around and have them shoot.
 // At the end, report the # seconds it took to complete the test.
 // Don't start measuring for the first N ticks to account for HD load.
+//
+// The scenario (bots, NPCs, physics props and the random seed) is set with the
+// sv_benchmark_* convars, so the same settings on the same map always simulate
+// the same ticks. Besides the total time, the time of every measured tick is
+// kept so the results can report percentiles and a histogram.
 
 static ConVar sv_benchmark_numticks( "sv_benchmark_numticks", "3300", 0, "If > 0, then it only runs the benchmark for this # of ticks." );
 static ConVar sv_benchmark_autovprofrecord( "sv_benchmark_autovprofrecord", "0", 0, "If running a benchmark and this is set, it will record a vprof file over the duration of the benchmark with filename benchmark.vprof." );
+static ConVar sv_benchmark_warmupticks( "sv_benchmark_warmupticks", "0", 0, "Simulate this many ticks of the benchmark scenario before starting to measure." );
+static ConVar sv_benchmark_seed( "sv_benchmark_seed", "0", 0, "Random seed for the benchmark scenario." );
+static ConVar sv_benchmark_numbots( "sv_benchmark_numbots", "22", 0, "Number of bots the benchmark creates." );
+static ConVar sv_benchmark_numphysics( "sv_benchmark_numphysics", "100", 0, "Number of physics props the benchmark creates." );
+static ConVar sv_benchmark_numnpcs( "sv_benchmark_numnpcs", "0", 0, "Number of NPCs (sv_benchmark_npcclass) the benchmark creates." );
+static ConVar sv_benchmark_npcclass( "sv_benchmark_npcclass", "npc_citizen", 0, "Classname of the NPCs the benchmark creates." );
+static ConVar sv_benchmark_vprof( "sv_benchmark_vprof", "0", 0, "If set, turns on vprof during the benchmark and reports the time of each budget group. Profiling adds some overhead to the tick times." );
+static ConVar sv_benchmark_output( "sv_benchmark_output", "", 0, "If set, the benchmark results are also written to this file as JSON." );
 
 static float s_flBenchmarkStartWaitSeconds = 3;	// Wait this many seconds after level load before starting the benchmark.
 
-static int s_nBenchmarkBotsToCreate = 22;		// Create this many bots.
 static int s_nBenchmarkBotCreateInterval = 50;	// Create a bot every N ticks.
+static int s_nBenchmarkNPCCreateInterval = 10;	// Create an NPC every N ticks.
 
-static int s_nBenchmarkPhysicsObjects = 100;	// Create this many physics objects.
+// Upper bounds (in milliseconds) of the tick time histogram buckets; the last bucket is unbounded
+static const float s_flBenchmarkHistogramBuckets[] = { 1, 2, 4, 8, 16, 33, 66 };
+#define BENCHMARK_HISTOGRAM_BUCKETS	( ARRAYSIZE( s_flBenchmarkHistogramBuckets ) + 1 )
 
 
 static double Benchmark_ValidTime()
@@ -40,6 +56,47 @@ static double Benchmark_ValidTime()
 }
 
 
+static int __cdecl Benchmark_CompareTickTimes( const float *pLeft, const float *pRight )
+{
+	if ( *pLeft < *pRight )
+		return -1;
+	if ( *pLeft > *pRight )
+		return 1;
+	return 0;
+}
+
+// Nearest-rank percentile of a sorted list
+static float Benchmark_Percentile( const CUtlVector< float > &sortedTimes, float flPercentile )
+{
+	if ( !sortedTimes.Count() )
+		return 0.0f;
+
+	int iRank = (int)ceil( flPercentile * 0.01f * sortedTimes.Count() ) - 1;
+	return sortedTimes[ clamp( iRank, 0, sortedTimes.Count() - 1 ) ];
+}
+
+#ifdef VPROF_ENABLED
+// Adds up the time of every vprof node (less its children) by budget group
+static void Benchmark_SumBudgetGroupTimes_r( CVProfNode *pNode, CUtlVector< double > &groupTimes )
+{
+	int iGroup = pNode->GetBudgetGroupID();
+	if ( iGroup >= 0 )
+	{
+		while ( groupTimes.Count() <= iGroup )
+		{
+			groupTimes.AddToTail( 0.0 );
+		}
+		groupTimes[iGroup] += pNode->GetTotalTimeLessChildren();
+	}
+
+	for ( CVProfNode *pChild = pNode->GetChild(); pChild; pChild = pChild->GetSibling() )
+	{
+		Benchmark_SumBudgetGroupTimes_r( pChild, groupTimes );
+	}
+}
+#endif
+
+
 // ---------------------------------------------------------------------------------------------- //
 // CServerBenchmark implementation.
 // ---------------------------------------------------------------------------------------------- //
@@ -86,7 +143,12 @@ public:
 		m_flBenchmarkStartWaitTime = flCountdown;
 
 		m_nBotsCreated = 0;
+		m_nNPCsCreated = 0;
 		m_nStartWaitCounter = -1;
+		m_PhysicsObjects.Purge();
+		m_TickTimes.Purge();
+		m_bMeasuring = false;
+		m_bTurnedOnVProf = false;
 
 		// Setup the benchmark environment.
 		engine->SetDedicatedServerBenchmarkMode( true );	// Run 1 tick per frame and ignore all timing stuff.
@@ -122,18 +184,30 @@ public:
 				m_nLastPhysicsObjectTick = m_nLastPhysicsForceTick = 0;
 				m_BenchmarkState = BENCHMARKSTATE_RUNNING;
 
-				StartVProfRecord();
-
-				RandomSeed( 0 );
-				m_RandomStream.SetSeed( 0 );
+				RandomSeed( sv_benchmark_seed.GetInt() );
+				m_RandomStream.SetSeed( sv_benchmark_seed.GetInt() );
 			}
 		}
 
 		int nTicksRunSoFar = gpGlobals->tickcount - m_nBenchmarkStartTick;
+		int nWarmupTicks = MAX( sv_benchmark_warmupticks.GetInt(), 0 );
 		UpdateBenchmarkCounter();
+
+		// Time the tick that just ran.
+		double flTickTime = Benchmark_ValidTime();
+		if ( m_bMeasuring )
+		{
+			m_TickTimes.AddToTail( (float)( ( flTickTime - m_flLastTickTime ) * 1000.0 ) );
+		}
+		m_flLastTickTime = flTickTime;
+
+		if ( !m_bMeasuring && nTicksRunSoFar >= nWarmupTicks )
+		{
+			StartMeasuring();
+		}
 	
 		// Are we finished with the benchmark?
-		if ( nTicksRunSoFar >= sv_benchmark_numticks.GetInt() )
+		if ( nTicksRunSoFar >= nWarmupTicks + sv_benchmark_numticks.GetInt() )
 		{
 			EndVProfRecord();
 			OutputResults();
@@ -143,10 +217,30 @@ public:
 
 		// Ok, update whatever we're doing in the benchmark.
 		UpdatePlayerCreation();
+		UpdateNPCCreation();
 		UpdateVPhysicsObjects();
 		CServerBenchmarkHook::s_pBenchmarkHook->UpdateBenchmark();
 	}
 
+	// Called once the warmup ticks have run.
+	void StartMeasuring()
+	{
+		m_bMeasuring = true;
+		m_fl_ValidTime_BenchmarkStartTime = Benchmark_ValidTime();
+		m_flLastTickTime = m_fl_ValidTime_BenchmarkStartTime;
+
+		StartVProfRecord();
+
+#ifdef VPROF_ENABLED
+		// Budget group times are reported relative to what vprof has already accumulated.
+		m_BudgetGroupStartTimes.Purge();
+		if ( g_VProfCurrentProfile.IsEnabled() && g_VProfCurrentProfile.GetRoot() )
+		{
+			Benchmark_SumBudgetGroupTimes_r( g_VProfCurrentProfile.GetRoot(), m_BudgetGroupStartTimes );
+		}
+#endif
+	}
+
 	void StartVProfRecord()
 	{
 		if ( sv_benchmark_autovprofrecord.GetInt() )
@@ -154,6 +248,15 @@ public:
 			engine->ServerCommand( "vprof_record_start benchmark\n" );
 			engine->ServerExecute();
 		}
+
+#ifdef VPROF_ENABLED
+		if ( sv_benchmark_vprof.GetBool() && !g_VProfCurrentProfile.IsEnabled() )
+		{
+			engine->ServerCommand( "vprof_on\n" );
+			engine->ServerExecute();
+			m_bTurnedOnVProf = true;
+		}
+#endif
 	}
 
 	void EndVProfRecord()
@@ -184,6 +287,12 @@ public:
 			engine->ServerCommand( "quit\n" );
 		}
 		
+		if ( m_bTurnedOnVProf )
+		{
+			engine->ServerCommand( "vprof_off\n" );
+			m_bTurnedOnVProf = false;
+		}
+
 		m_BenchmarkState = BENCHMARKSTATE_NOT_RUNNING;
 		engine->SetDedicatedServerBenchmarkMode( false );
 	}
@@ -201,14 +310,18 @@ public:
 
 	void UpdateVPhysicsObjects()
 	{
-		int nPhysicsObjectInterval = sv_benchmark_numticks.GetInt() / s_nBenchmarkPhysicsObjects;
+		int nPhysicsObjects = sv_benchmark_numphysics.GetInt();
+		if ( nPhysicsObjects <= 0 )
+			return;
+
+		int nPhysicsObjectInterval = MAX( sv_benchmark_numticks.GetInt() / nPhysicsObjects, 1 );
 
 		int nNextSpawnTick = m_nLastPhysicsObjectTick + nPhysicsObjectInterval;
 		if ( GetTickOffset() >= nNextSpawnTick )
 		{
 			m_nLastPhysicsObjectTick = nNextSpawnTick;
 			
-			if ( m_PhysicsObjects.Count() < s_nBenchmarkPhysicsObjects )
+			if ( m_PhysicsObjects.Count() < nPhysicsObjects )
 			{
 				// Find a bot to spawn it from.
 				CUtlVector<CBasePlayer*> curPlayers;
@@ -247,7 +360,7 @@ public:
 		}
 
 		// Give them all a boost periodically.
-		int nPhysicsForceInterval = sv_benchmark_numticks.GetInt() / 20;
+		int nPhysicsForceInterval = MAX( sv_benchmark_numticks.GetInt() / 20, 1 );
 
 		int nNextForceTick = m_nLastPhysicsForceTick + nPhysicsForceInterval;
 		if ( GetTickOffset() >= nNextForceTick )
@@ -288,7 +401,8 @@ public:
 		if ( (flCurTime - m_flLastBenchmarkCounterUpdate) > 3.0f )
 		{
 			m_flLastBenchmarkCounterUpdate = flCurTime;
-			Msg( "Benchmark: %d%% complete.\n", ((gpGlobals->tickcount - m_nBenchmarkStartTick) * 100) / sv_benchmark_numticks.GetInt() );
+			int nTotalTicks = MAX( sv_benchmark_warmupticks.GetInt(), 0 ) + sv_benchmark_numticks.GetInt();
+			Msg( "Benchmark: %d%% complete.\n", ((gpGlobals->tickcount - m_nBenchmarkStartTick) * 100) / MAX( nTotalTicks, 1 ) );
 		}
 	}
 
@@ -311,9 +425,64 @@ public:
 	}
 
 
+	// Bots the benchmark can spawn things around.
+	void GetBenchmarkBots( CUtlVector<CBasePlayer*> &bots )
+	{
+		for ( int i = 1; i <= gpGlobals->maxClients; i++ )
+		{
+			CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
+			if ( pPlayer && (pPlayer->GetFlags() & FL_FAKECLIENT) )
+			{
+				bots.AddToTail( pPlayer );
+			}
+		}
+	}
+
+	void UpdateNPCCreation()
+	{
+		if ( m_nNPCsCreated >= sv_benchmark_numnpcs.GetInt() )
+			return;
+
+		int nTicksRunSoFar = gpGlobals->tickcount - m_nBenchmarkStartTick;
+		if ( (nTicksRunSoFar % s_nBenchmarkNPCCreateInterval) != 0 )
+			return;
+
+		// NPCs are spread out around the bots, like the physics props.
+		CUtlVector<CBasePlayer*> curPlayers;
+		GetBenchmarkBots( curPlayers );
+		if ( curPlayers.Count() == 0 )
+			return;
+
+		// Count it even if it fails so a bad classname doesn't retry every interval.
+		++m_nNPCsCreated;
+
+		CBaseEntity *pNPC = CreateEntityByName( sv_benchmark_npcclass.GetString() );
+		if ( !pNPC )
+		{
+			Warning( "Benchmark: can't create NPC %s\n", sv_benchmark_npcclass.GetString() );
+			return;
+		}
+
+		int iPlayer = this->RandomInt( 0, curPlayers.Count() - 1 );
+		Vector vSpawnPos = curPlayers[iPlayer]->GetAbsOrigin();
+		Vector vOffset( this->RandomFloat( -1000, 1000 ), this->RandomFloat( -1000, 1000 ), 0 );
+		QAngle vAngles( 0, this->RandomFloat( -180, 180 ), 0 );
+
+		pNPC->SetAbsOrigin( vSpawnPos );
+		pNPC->SetAbsAngles( vAngles );
+		DispatchSpawn( pNPC );
+
+		// Walk it out from the bot as far as its hull fits.
+		trace_t tr;
+		UTIL_TraceHull( vSpawnPos, vSpawnPos + vOffset, pNPC->WorldAlignMins(), pNPC->WorldAlignMaxs(), MASK_NPCSOLID, pNPC, COLLISION_GROUP_NONE, &tr );
+		UTIL_SetOrigin( pNPC, tr.endpos );
+
+		pNPC->Activate();
+	}
+
 	void UpdatePlayerCreation()
 	{
-		if ( m_nBotsCreated >= s_nBenchmarkBotsToCreate )
+		if ( m_nBotsCreated >= sv_benchmark_numbots.GetInt() )
 			return;
 
 		// Spawn the player.
@@ -329,13 +498,116 @@ public:
 	void OutputResults()
 	{
 		float flRunTime = Benchmark_ValidTime() - m_fl_ValidTime_BenchmarkStartTime;
+		int nCRC = CalculateBenchmarkCRC();
+
+		// Tick time statistics
+		CUtlVector< float > sortedTimes;
+		sortedTimes.CopyArray( m_TickTimes.Base(), m_TickTimes.Count() );
+		sortedTimes.Sort( Benchmark_CompareTickTimes );
+
+		float flP50 = Benchmark_Percentile( sortedTimes, 50 );
+		float flP99 = Benchmark_Percentile( sortedTimes, 99 );
+		float flMax = sortedTimes.Count() ? sortedTimes.Tail() : 0.0f;
+
+		int histogram[BENCHMARK_HISTOGRAM_BUCKETS];
+		memset( histogram, 0, sizeof( histogram ) );
+		for ( int i = 0; i < sortedTimes.Count(); i++ )
+		{
+			int iBucket = 0;
+			while ( iBucket < BENCHMARK_HISTOGRAM_BUCKETS - 1 && sortedTimes[i] > s_flBenchmarkHistogramBuckets[iBucket] )
+			{
+				++iBucket;
+			}
+			++histogram[iBucket];
+		}
+
+		// Budget group times
+		CUtlVector< double > groupTimes;
+#ifdef VPROF_ENABLED
+		if ( g_VProfCurrentProfile.IsEnabled() && g_VProfCurrentProfile.GetRoot() )
+		{
+			Benchmark_SumBudgetGroupTimes_r( g_VProfCurrentProfile.GetRoot(), groupTimes );
+			for ( int i = 0; i < groupTimes.Count() && i < m_BudgetGroupStartTimes.Count(); i++ )
+			{
+				groupTimes[i] -= m_BudgetGroupStartTimes[i];
+			}
+		}
+#endif
 
 		Warning( "------------------ SERVER BENCHMARK RESULTS ------------------\n" );
 		Warning( "Total time          : %.2f seconds\n", flRunTime );
 		Warning( "Num ticks simulated : %d\n", sv_benchmark_numticks.GetInt() );
 		Warning( "Ticks per second    : %.2f\n", sv_benchmark_numticks.GetInt() / flRunTime );
-		Warning( "Benchmark CRC       : %d\n", CalculateBenchmarkCRC() );
+		Warning( "Benchmark CRC       : %d\n", nCRC );
+		Warning( "Tick time p50       : %.3f ms\n", flP50 );
+		Warning( "Tick time p99       : %.3f ms\n", flP99 );
+		Warning( "Tick time max       : %.3f ms\n", flMax );
+		for ( int i = 0; i < BENCHMARK_HISTOGRAM_BUCKETS; i++ )
+		{
+			if ( i < BENCHMARK_HISTOGRAM_BUCKETS - 1 )
+				Warning( "  <= %3.0f ms        : %d\n", s_flBenchmarkHistogramBuckets[i], histogram[i] );
+			else
+				Warning( "   > %3.0f ms        : %d\n", s_flBenchmarkHistogramBuckets[i - 1], histogram[i] );
+		}
+#ifdef VPROF_ENABLED
+		for ( int i = 0; i < groupTimes.Count(); i++ )
+		{
+			if ( groupTimes[i] > 0.0 )
+			{
+				Warning( "  %-18s: %.2f ms\n", g_VProfCurrentProfile.GetBudgetGroupName( i ), groupTimes[i] );
+			}
+		}
+#endif
 		Warning( "--------------------------------------------------------------\n" );
+
+		// Machine-readable copy for regression tracking.
+		const char *pszOutput = sv_benchmark_output.GetString();
+		if ( pszOutput[0] )
+		{
+			FileHandle_t fh = filesystem->Open( pszOutput, "wt", "DEFAULT_WRITE_PATH" );
+			if ( fh )
+			{
+				filesystem->FPrintf( fh, "{\n" );
+				filesystem->FPrintf( fh, "\t\"map\": \"%s\",\n", STRING( gpGlobals->mapname ) );
+				filesystem->FPrintf( fh, "\t\"seed\": %d,\n", sv_benchmark_seed.GetInt() );
+				filesystem->FPrintf( fh, "\t\"bots\": %d,\n", m_nBotsCreated );
+				filesystem->FPrintf( fh, "\t\"npcs\": %d,\n", m_nNPCsCreated );
+				filesystem->FPrintf( fh, "\t\"physics_props\": %d,\n", m_PhysicsObjects.Count() );
+				filesystem->FPrintf( fh, "\t\"warmup_ticks\": %d,\n", MAX( sv_benchmark_warmupticks.GetInt(), 0 ) );
+				filesystem->FPrintf( fh, "\t\"ticks\": %d,\n", sv_benchmark_numticks.GetInt() );
+				filesystem->FPrintf( fh, "\t\"total_seconds\": %.4f,\n", flRunTime );
+				filesystem->FPrintf( fh, "\t\"ticks_per_second\": %.2f,\n", sv_benchmark_numticks.GetInt() / flRunTime );
+				filesystem->FPrintf( fh, "\t\"crc\": %d,\n", nCRC );
+				filesystem->FPrintf( fh, "\t\"tick_ms\": { \"p50\": %.4f, \"p99\": %.4f, \"max\": %.4f },\n", flP50, flP99, flMax );
+				filesystem->FPrintf( fh, "\t\"tick_ms_histogram\": [" );
+				for ( int i = 0; i < BENCHMARK_HISTOGRAM_BUCKETS; i++ )
+				{
+					if ( i < BENCHMARK_HISTOGRAM_BUCKETS - 1 )
+						filesystem->FPrintf( fh, "%s{ \"max\": %.0f, \"count\": %d }", i ? ", " : " ", s_flBenchmarkHistogramBuckets[i], histogram[i] );
+					else
+						filesystem->FPrintf( fh, ", { \"max\": null, \"count\": %d } ],\n", histogram[i] );
+				}
+				filesystem->FPrintf( fh, "\t\"budget_group_ms\": {" );
+				bool bFirstGroup = true;
+#ifdef VPROF_ENABLED
+				for ( int i = 0; i < groupTimes.Count(); i++ )
+				{
+					if ( groupTimes[i] > 0.0 )
+					{
+						filesystem->FPrintf( fh, "%s\n\t\t\"%s\": %.4f", bFirstGroup ? "" : ",", g_VProfCurrentProfile.GetBudgetGroupName( i ), groupTimes[i] );
+						bFirstGroup = false;
+					}
+				}
+#endif
+				filesystem->FPrintf( fh, "%s}\n", bFirstGroup ? " " : "\n\t" );
+				filesystem->FPrintf( fh, "}\n" );
+				filesystem->Close( fh );
+			}
+			else
+			{
+				Warning( "Benchmark: couldn't write %s\n", pszOutput );
+			}
+		}
 	}
 
 	int CalculateBenchmarkCRC()
@@ -389,8 +661,15 @@ private:
 	int m_nLastPhysicsForceTick;
 
 	int m_nBotsCreated;
+	int m_nNPCsCreated;
 	CUtlVector< EHANDLE > m_PhysicsObjects;
 
+	bool m_bMeasuring;					// Past the warmup ticks?
+	bool m_bTurnedOnVProf;
+	double m_flLastTickTime;
+	CUtlVector< float > m_TickTimes;	// Milliseconds per measured tick.
+	CUtlVector< double > m_BudgetGroupStartTimes;
+
 	CUtlVector<char*> m_PhysicsModelNames;
 	int m_nBenchmarkMode;
 
@@ -71,6 +71,10 @@ void Test_InitRandomEntitySpawner( const CCommand &args )
 	if ( args.ArgC() >= 2 )
 		nSlots = atoi( args[ 1 ] );
 
+	// An optional seed makes the following Test_ commands spawn and move the same entities each run.
+	if ( args.ArgC() >= 3 )
+		RandomSeed( atoi( args[ 2 ] ) );
+
 	g_StressEntities.Purge();
 	g_StressEntities.SetSize( nSlots );
 
@@ -145,7 +149,7 @@ void Test_RemoveAllRandomEntities()
 }
 
 
-ConCommand cc_Test_InitRandomEntitySpawner( "Test_InitRandomEntitySpawner", Test_InitRandomEntitySpawner, 0, FCVAR_CHEAT );
+ConCommand cc_Test_InitRandomEntitySpawner( "Test_InitRandomEntitySpawner", Test_InitRandomEntitySpawner, "Test_InitRandomEntitySpawner [# slots] [random seed]", FCVAR_CHEAT );
 ConCommand cc_Test_SpawnRandomEntities( "Test_SpawnRandomEntities", Test_SpawnRandomEntities, 0, FCVAR_CHEAT );
 ConCommand cc_Test_RandomizeInPVS( "Test_RandomizeInPVS", Test_RandomizeInPVS, 0, FCVAR_CHEAT );
 ConCommand cc_Test_RemoveAllRandomEntities( "Test_RemoveAllRandomEntities", Test_RemoveAllRandomEntities, 0, FCVAR_CHEAT );
@@ -207,12 +207,26 @@ skipwhite:
 
 bool CEntityMapData::ExtractValue( const char *keyName, char *value )
 {
+	if ( m_pKeyValues )
+	{
+		for ( int i = 0; i < m_nKeyValues; i++ )
+		{
+			if ( !strcmp( m_pKeyValues[i].m_pszKey, keyName ) )
+			{
+				Q_strncpy( value, m_pKeyValues[i].m_pszValue, MAPKEY_MAXLENGTH );
+				return true;
+			}
+		}
+		return false;
+	}
+
 	return MapEntity_ExtractValue( m_pEntData, keyName, value );
 }
 
 bool CEntityMapData::GetFirstKey( char *keyName, char *value )
 {
 	m_pCurrentKey = m_pEntData; // reset the status pointer
+	m_iCurrentKeyValue = 0;
 	return GetNextKey( keyName, value );
 }
 
@@ -223,6 +237,29 @@ const char *CEntityMapData::CurrentBufferPosition( void )
 
 bool CEntityMapData::GetNextKey( char *keyName, char *value )
 {
+	if ( m_pKeyValues )
+	{
+		if ( m_iCurrentKeyValue >= m_nKeyValues )
+		{
+			m_pCurrentKey = m_pEntDataEnd;
+			return false;
+		}
+
+		const MapEntityKeyValue_t &keyValue = m_pKeyValues[m_iCurrentKeyValue++];
+		Q_strncpy( keyName, keyValue.m_pszKey, MAPKEY_MAXLENGTH );
+
+		// fix up keynames with trailing spaces
+		int n = strlen(keyName);
+		while (n && keyName[n-1] == ' ')
+		{
+			keyName[n-1] = 0;
+			n--;
+		}
+
+		Q_strncpy( value, keyValue.m_pszValue, MAPKEY_MAXLENGTH );
+		return true;
+	}
+
 	char token[MAPKEY_MAXLENGTH];
 
 	// parse key
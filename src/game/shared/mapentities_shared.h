@@ -12,6 +12,15 @@
 
 #define MAPKEY_MAXLENGTH	2048
 
+//-----------------------------------------------------------------------------
+// A key and its value, already tokenized out of the entity data string
+//-----------------------------------------------------------------------------
+struct MapEntityKeyValue_t
+{
+	const char	*m_pszKey;
+	const char	*m_pszValue;
+};
+
 
 //-----------------------------------------------------------------------------
 // Purpose: encapsulates the data string in the map file 
@@ -25,9 +34,22 @@ private:
 	int		m_nEntDataSize;
 	char	*m_pCurrentKey;
 
+	// Set when the keys have already been tokenized (see CMapEntityLumpIndex); the
+	// text is then only used for its position
+	const MapEntityKeyValue_t	*m_pKeyValues;
+	int		m_nKeyValues;
+	int		m_iCurrentKeyValue;
+	char	*m_pEntDataEnd;
+
 public:
 	explicit CEntityMapData( char *entBlock, int nEntBlockSize = -1 ) : 
-		m_pEntData(entBlock), m_nEntDataSize(nEntBlockSize), m_pCurrentKey(entBlock) {}
+		m_pEntData(entBlock), m_nEntDataSize(nEntBlockSize), m_pCurrentKey(entBlock),
+		m_pKeyValues(NULL), m_nKeyValues(0), m_iCurrentKeyValue(0), m_pEntDataEnd(NULL) {}
+
+	// entBlockEnd points at the entity's closing brace
+	CEntityMapData( char *entBlock, char *entBlockEnd, const MapEntityKeyValue_t *pKeyValues, int nKeyValues ) : 
+		m_pEntData(entBlock), m_nEntDataSize(-1), m_pCurrentKey(entBlock),
+		m_pKeyValues(pKeyValues), m_nKeyValues(nKeyValues), m_iCurrentKeyValue(0), m_pEntDataEnd(entBlockEnd) {}
 
 	// find the keyName in the entdata and puts it's value into Value.  returns false if key is not found
 	bool ExtractValue( const char *keyName, char *Value );
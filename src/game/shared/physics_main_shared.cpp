@@ -18,6 +18,9 @@
 #include "igamesystem.h"
 #include "utlmultilist.h"
 #include "tier1/callqueue.h"
+#ifdef GAME_DLL
+#include "entityprofile.h"
+#endif
 
 #ifdef PORTAL
 	#include "portal_util_shared.h"
@@ -1905,6 +1908,10 @@ bool CBaseEntity::PhysicsRunThink( thinkmethods_t thinkMethod )
 {
 	if ( IsEFlagSet( EFL_NO_THINK_FUNCTION ) )
 		return true;
+
+#ifdef GAME_DLL
+	ENTITY_PROFILE_SCOPE( this, ENTITY_PROFILE_THINK );
+#endif
 	
 	bool bAlive = true;
 
@@ -24,6 +24,9 @@
 #include "vphysics/object_hash.h"
 #include "datacache/imdlcache.h"
 #include "tier0/vprof.h"
+#include "tier1/generichash.h"
+#include "tier0/fasttimer.h"
+#include "tier1/snappy.h"
 
 #if !defined( CLIENT_DLL )
 
@@ -36,6 +39,13 @@
 
 #endif
 
+#if !defined( CLIENT_DLL )
+ConVar save_block_timing( "save_block_timing", "0", 0, "Print how long each save/restore block takes to build during a save, and how well it would compress." );
+#define SAVE_BLOCK_TIMING()		save_block_timing.GetBool()
+#else
+#define SAVE_BLOCK_TIMING()		false
+#endif
+
 // HACKHACK: Builds a global list of entities that were restored from all levels
 #if !defined( CLIENT_DLL )
 void AddRestoredEntity( CBaseEntity *pEntity );
@@ -94,6 +104,230 @@ static int gSizes[FIELD_TYPECOUNT] =
 };
 
 
+//-----------------------------------------------------------------------------
+// Purpose: What save/restore needs to know about a typedescription_t table,
+//			worked out the first time the table is saved or restored instead
+//			of on every entity: which fields are saved at all, how to tell
+//			that one is empty, and a case insensitive name hash for restore.
+//-----------------------------------------------------------------------------
+enum SavePlanEmptyTest_t
+{
+	SAVEPLAN_EMPTY_INT = 0,		// a single zero int
+	SAVEPLAN_EMPTY_WORDS,		// all zero, size is a multiple of 4
+	SAVEPLAN_EMPTY_BYTES,		// all zero
+	SAVEPLAN_EMPTY_EHANDLE,		// all invalid handles
+	SAVEPLAN_EMPTY_GENERIC,		// embedded and custom types, or a bad field type; ask ShouldSaveField
+};
+
+struct SavePlanField_t
+{
+	unsigned short	iField;
+	unsigned short	emptyTest;
+	int				offset;
+	int				count;		// bytes, words or handles, depending on emptyTest
+};
+
+// The parts of a typedescription_t a plan depends on
+struct SavePlanFieldKey_t
+{
+	const char *	fieldName;
+	int				fieldType;
+	int				flags;
+	int				fieldSize;
+	int				fieldSizeInBytes;
+	int				offset;
+};
+
+class CDataDescSavePlan
+{
+public:
+	CDataDescSavePlan( typedescription_t *pFields, int fieldCount );
+
+	bool Matches( const typedescription_t *pFields, int fieldCount ) const;
+	int FindField( const char *pszFieldName, const typedescription_t *pFields ) const;
+
+	int							m_nFields;
+	CUtlVector<SavePlanField_t>	m_SaveFields;		// FTYPEDESC_SAVE fields, in table order
+
+private:
+	CUtlVector<SavePlanFieldKey_t>	m_FieldKeys;
+
+	// Open addressed; field index + 1, 0 for an empty slot
+	CUtlVector<unsigned short>	m_NameHash;
+	unsigned					m_nHashMask;
+};
+
+CDataDescSavePlan::CDataDescSavePlan( typedescription_t *pFields, int fieldCount )
+{
+	m_nFields = fieldCount;
+
+	int i;
+	m_FieldKeys.SetCount( fieldCount );
+	for ( i = 0; i < fieldCount; i++ )
+	{
+		SavePlanFieldKey_t &key = m_FieldKeys[i];
+		key.fieldName = pFields[i].fieldName;
+		key.fieldType = pFields[i].fieldType;
+		key.flags = pFields[i].flags;
+		key.fieldSize = pFields[i].fieldSize;
+		key.fieldSizeInBytes = pFields[i].fieldSizeInBytes;
+		key.offset = pFields[i].fieldOffset[ TD_OFFSET_NORMAL ];
+	}
+
+	for ( i = 0; i < fieldCount; i++ )
+	{
+		typedescription_t *pField = &pFields[i];
+		if ( !(pField->flags & FTYPEDESC_SAVE) || pField->fieldType == FIELD_VOID )
+			continue;
+
+		SavePlanField_t &saveField = m_SaveFields[ m_SaveFields.AddToTail() ];
+		saveField.iField = i;
+		saveField.offset = pField->fieldOffset[ TD_OFFSET_NORMAL ];
+		saveField.emptyTest = SAVEPLAN_EMPTY_GENERIC;
+		saveField.count = 0;
+
+		// Fields with the wrong FIELD_ type stay generic so they keep warning
+		if ( pField->fieldType == FIELD_EMBEDDED || pField->fieldType == FIELD_CUSTOM ||
+			 pField->fieldSizeInBytes != pField->fieldSize * gSizes[pField->fieldType] )
+			continue;
+
+		int size = pField->fieldSize * gSizes[pField->fieldType];
+		if ( pField->fieldType == FIELD_EHANDLE )
+		{
+			saveField.emptyTest = SAVEPLAN_EMPTY_EHANDLE;
+			saveField.count = pField->fieldSize;
+		}
+		else if ( size == 4 )
+		{
+			saveField.emptyTest = SAVEPLAN_EMPTY_INT;
+			saveField.count = 1;
+		}
+		else if ( ( size & 3 ) == 0 && ( saveField.offset & 3 ) == 0 )
+		{
+			saveField.emptyTest = SAVEPLAN_EMPTY_WORDS;
+			saveField.count = size / 4;
+		}
+		else
+		{
+			saveField.emptyTest = SAVEPLAN_EMPTY_BYTES;
+			saveField.count = size;
+		}
+	}
+
+	int nSlots = 8;
+	while ( nSlots < fieldCount * 2 )
+	{
+		nSlots <<= 1;
+	}
+	m_nHashMask = nSlots - 1;
+	m_NameHash.SetCount( nSlots );
+	memset( m_NameHash.Base(), 0, nSlots * sizeof(unsigned short) );
+
+	for ( i = 0; i < fieldCount; i++ )
+	{
+		if ( !pFields[i].fieldName )
+			continue;
+
+		unsigned slot = HashStringCaseless( pFields[i].fieldName ) & m_nHashMask;
+		while ( m_NameHash[slot] )
+		{
+			// On a duplicate name prefer the entry that is actually saved
+			typedescription_t *pOther = &pFields[ m_NameHash[slot] - 1 ];
+			if ( stricmp( pOther->fieldName, pFields[i].fieldName ) == 0 )
+				break;
+			slot = ( slot + 1 ) & m_nHashMask;
+		}
+
+		if ( !m_NameHash[slot] || ( !( pFields[ m_NameHash[slot] - 1 ].flags & FTYPEDESC_SAVE ) && ( pFields[i].flags & FTYPEDESC_SAVE ) ) )
+		{
+			m_NameHash[slot] = i + 1;
+		}
+	}
+}
+
+bool CDataDescSavePlan::Matches( const typedescription_t *pFields, int fieldCount ) const
+{
+	if ( fieldCount != m_nFields )
+		return false;
+
+	for ( int i = 0; i < fieldCount; i++ )
+	{
+		const SavePlanFieldKey_t &key = m_FieldKeys[i];
+		const typedescription_t &field = pFields[i];
+		if ( key.fieldType != field.fieldType ||
+			 key.fieldSize != field.fieldSize ||
+			 key.fieldSizeInBytes != field.fieldSizeInBytes ||
+			 key.offset != field.fieldOffset[ TD_OFFSET_NORMAL ] ||
+			 key.flags != field.flags ||
+			 key.fieldName != field.fieldName )
+			return false;
+	}
+
+	return true;
+}
+
+int CDataDescSavePlan::FindField( const char *pszFieldName, const typedescription_t *pFields ) const
+{
+	unsigned slot = HashStringCaseless( pszFieldName ) & m_nHashMask;
+	while ( m_NameHash[slot] )
+	{
+		int iField = m_NameHash[slot] - 1;
+		if ( stricmp( pFields[iField].fieldName, pszFieldName ) == 0 )
+			return iField;
+		slot = ( slot + 1 ) & m_nHashMask;
+	}
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The CUtlVector, CUtlMap and CUtlRBTree data ops describe their
+//			elements with a datamap built on the stack, which can come back at
+//			the same address with different contents.
+//-----------------------------------------------------------------------------
+static bool IsStackDataMap( const datamap_t *pRootMap )
+{
+	if ( !pRootMap || !pRootMap->dataClassName )
+		return false;
+
+	const char *pszName = pRootMap->dataClassName;
+	return ( strcmp( pszName, "uv" ) == 0 || strcmp( pszName, "um" ) == 0 || strcmp( pszName, "urb" ) == 0 );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Plans live as long as the dll does, like the static tables they
+//			describe, and are found by table address alone. Stack tables are
+//			checked against the plan and it is rebuilt if they changed.
+//-----------------------------------------------------------------------------
+class CDataDescSavePlanCache
+{
+public:
+	CDataDescSavePlanCache() : m_Plans( 0, 0, DefLessFunc( const typedescription_t * ) ) {}
+	~CDataDescSavePlanCache() { m_Plans.PurgeAndDeleteElements(); }
+
+	const CDataDescSavePlan *GetPlan( typedescription_t *pFields, int fieldCount, bool bStackTable )
+	{
+		unsigned short i = m_Plans.Find( pFields );
+		if ( i == m_Plans.InvalidIndex() )
+		{
+			MEM_ALLOC_CREDIT();
+			i = m_Plans.Insert( pFields, new CDataDescSavePlan( pFields, fieldCount ) );
+		}
+		else if ( bStackTable && !m_Plans[i]->Matches( pFields, fieldCount ) )
+		{
+			MEM_ALLOC_CREDIT();
+			delete m_Plans[i];
+			m_Plans[i] = new CDataDescSavePlan( pFields, fieldCount );
+		}
+
+		return m_Plans[i];
+	}
+
+private:
+	CUtlMap< const typedescription_t *, CDataDescSavePlan * > m_Plans;
+};
+
+static CDataDescSavePlanCache g_DataDescSavePlans;
+
 // helpers to offset worldspace matrices
 static void VMatrixOffset( VMatrix &dest, const VMatrix &matrixIn, const Vector &offset )
 {
@@ -835,12 +1069,60 @@ int CSave::WriteFields( const char *pname, const void *pBaseData, datamap_t *pRo
 	__dcbt( 512, pDest );
 #endif
 
-	for ( int i = 0; i < fieldCount; i++ )
+	const CDataDescSavePlan *pPlan = g_DataDescSavePlans.GetPlan( pFields, fieldCount, IsStackDataMap( pRootMap ) );
+
+	int nSaveFields = pPlan->m_SaveFields.Count();
+	for ( int i = 0; i < nSaveFields; i++ )
 	{
-		pTest = &pFields[ i ];
-		void *pOutputData = ( (char *)pBaseData + pTest->fieldOffset[ TD_OFFSET_NORMAL ] );
-			
-		if ( !ShouldSaveField( pOutputData, pTest ) )
+		const SavePlanField_t &saveField = pPlan->m_SaveFields[ i ];
+		pTest = &pFields[ saveField.iField ];
+		void *pOutputData = ( (char *)pBaseData + saveField.offset );
+
+		bool bEmpty = true;
+		switch ( saveField.emptyTest )
+		{
+		case SAVEPLAN_EMPTY_INT:
+			bEmpty = ( *((int *)pOutputData) == 0 );
+			break;
+
+		case SAVEPLAN_EMPTY_WORDS:
+			{
+				const int *pWord = (const int *)pOutputData;
+				for ( int j = 0; j < saveField.count; j++ )
+				{
+					if ( pWord[j] )
+					{
+						bEmpty = false;
+						break;
+					}
+				}
+			}
+			break;
+
+		case SAVEPLAN_EMPTY_BYTES:
+			bEmpty = ( DataEmpty( (const char *)pOutputData, saveField.count ) != 0 );
+			break;
+
+		case SAVEPLAN_EMPTY_EHANDLE:
+			{
+				const int *pEHandle = (const int *)pOutputData;
+				for ( int j = 0; j < saveField.count; j++ )
+				{
+					if ( pEHandle[j] != (int)0xFFFFFFFF )
+					{
+						bEmpty = false;
+						break;
+					}
+				}
+			}
+			break;
+
+		default:
+			bEmpty = !ShouldSaveField( pOutputData, pTest );
+			break;
+		}
+
+		if ( bEmpty )
 			continue;
 
 		if ( !WriteField( pname, pOutputData, pRootMap, pTest ) )
@@ -1498,23 +1780,26 @@ bool CRestore::ShouldReadField( typedescription_t *pField )
 
 //-------------------------------------
 
-typedescription_t *CRestore::FindField( const char *pszFieldName, typedescription_t *pFields, int fieldCount, int *pCookie )
+typedescription_t *CRestore::FindField( const char *pszFieldName, const CDataDescSavePlan *pPlan, typedescription_t *pFields, int fieldCount, int *pCookie )
 {
 	int &fieldNumber = *pCookie;
-	if ( pszFieldName )
+	if ( pszFieldName && fieldCount )
 	{
-		typedescription_t *pTest;
-		
-		for ( int i = 0; i < fieldCount; i++ )
+		// Most data is read in the order it was written, so try the field after the last one first
+		typedescription_t *pTest = &pFields[fieldNumber];
+		int iField = fieldNumber;
+		if ( stricmp( pTest->fieldName, pszFieldName ) != 0 )
 		{
-			pTest = &pFields[fieldNumber];
-			
-			++fieldNumber;
+			iField = pPlan->FindField( pszFieldName, pFields );
+		}
+
+		if ( iField != -1 )
+		{
+			fieldNumber = iField + 1;
 			if ( fieldNumber == fieldCount )
 				fieldNumber = 0;
-			
-			if ( stricmp( pTest->fieldName, pszFieldName ) == 0 )
-				return pTest;
+
+			return &pFields[iField];
 		}
 	}
 
@@ -1656,11 +1941,13 @@ int CRestore::ReadFields( const char *pname, void *pBaseData, datamap_t *pRootMa
 	int searchCookie = 0;								// Make searches faster, most data is read/written in the same order
 	SaveRestoreRecordHeader_t header;
 
+	const CDataDescSavePlan *pPlan = g_DataDescSavePlans.GetPlan( pFields, fieldCount, IsStackDataMap( pRootMap ) );
+
 	for ( i = 0; i < nFieldsSaved; i++ )
 	{
 		ReadHeader( &header );
 
-		typedescription_t *pField = FindField( m_pData->StringFromSymbol( header.symbol ), pFields, fieldCount, &searchCookie);
+		typedescription_t *pField = FindField( m_pData->StringFromSymbol( header.symbol ), pPlan, pFields, fieldCount, &searchCookie);
 		if ( pField && ShouldReadField( pField ) )
 		{
 			ReadField( header, ((char *)pBaseData + pField->fieldOffset[ TD_OFFSET_NORMAL ]), pRootMap, pField );
@@ -2457,6 +2744,9 @@ void CEntitySaveRestoreBlockHandler::Save( ISave *pSave )
 {
 	CGameSaveRestoreInfo *pSaveData = pSave->GetGameSaveRestoreInfo();
 	
+	// One critical section for the whole pass rather than one per entity
+	MDLCACHE_CRITICAL_SECTION();
+
 	// write entity list that was previously built by SaveInitEntities()
 	for ( int i = 0; i < pSaveData->NumEntities(); i++ )
 	{
@@ -2467,7 +2757,6 @@ void CEntitySaveRestoreBlockHandler::Save( ISave *pSave )
 		CBaseEntity *pEnt = pEntInfo->hEnt;
 		if ( pEnt && !( pEnt->ObjectCaps() & FCAP_DONT_SAVE ) )
 		{
-			MDLCACHE_CRITICAL_SECTION();
 #if !defined( CLIENT_DLL )
 			AssertMsg( !pEnt->edict() || ( pEnt->m_iClassname != NULL_STRING && 
 										   (STRING(pEnt->m_iClassname)[0] != 0) && 
@@ -3081,6 +3370,22 @@ struct SaveRestoreBlockHeader_t
 };
 
 
+//-------------------------------------
+// Purpose: Size of a block body after snappy compression, for save_block_timing
+
+static int GetCompressedBlockSize( const char *pData, int nBytes )
+{
+	if ( nBytes <= 0 )
+		return 0;
+
+	CUtlMemory<char> compressed;
+	compressed.EnsureCapacity( snappy::MaxCompressedLength( nBytes ) );
+
+	size_t nCompressed = 0;
+	snappy::RawCompress( pData, nBytes, compressed.Base(), &nCompressed );
+	return (int)nCompressed;
+}
+
 //-------------------------------------
 
 class CSaveRestoreBlockSet : public ISaveRestoreBlockSet
@@ -3100,21 +3405,45 @@ public:
 
 	void PreSave( CSaveRestoreData *pData )
 	{
+		VPROF( "CSaveRestoreBlockSet::PreSave" );
+
 		m_BlockHeaders.SetCount( m_Handlers.Count() );
 		for ( int i = 0; i < m_Handlers.Count(); i++ )
 		{
 			Q_strncpy( m_BlockHeaders[i].szName, m_Handlers[i]->GetBlockName(), MAX_BLOCK_NAME_LEN + 1 );
+
+			CFastTimer timer;
+			timer.Start();
 			m_Handlers[i]->PreSave( pData );
+			timer.End();
+
+			if ( SAVE_BLOCK_TIMING() )
+			{
+				Msg( "Save block %-24s presave %7.2f ms\n", m_Handlers[i]->GetBlockName(), timer.GetDuration().GetMillisecondsF() );
+			}
 		}
 	}
 	
 	void Save( ISave *pSave )
 	{
+		VPROF( "CSaveRestoreBlockSet::Save" );
+
 		int base = pSave->GetWritePos();
 		for ( int i = 0; i < m_Handlers.Count(); i++ )
 		{
 			m_BlockHeaders[i].locBody = pSave->GetWritePos() - base;
+
+			CFastTimer timer;
+			timer.Start();
 			m_Handlers[i]->Save( pSave );
+			timer.End();
+
+			if ( SAVE_BLOCK_TIMING() )
+			{
+				int nBytes = pSave->GetWritePos() - base - m_BlockHeaders[i].locBody;
+				const char *pBody = static_cast<CSaveRestoreData *>( pSave->GetGameSaveRestoreInfo() )->GetBuffer() + base + m_BlockHeaders[i].locBody;
+				Msg( "Save block %-24s save    %7.2f ms, %d bytes (%d snappy)\n", m_Handlers[i]->GetBlockName(), timer.GetDuration().GetMillisecondsF(), nBytes, GetCompressedBlockSize( pBody, nBytes ) );
+			}
 		}
 		m_SizeBodies = pSave->GetWritePos() - base;
 	}
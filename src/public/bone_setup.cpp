@@ -18,6 +18,7 @@
 #include "mathlib/ssequaternion.h"
 #include "bitvec.h"
 #include "datamanager.h"
+#include "utlmap.h"
 #include "convar.h"
 #include "tier0/tslist.h"
 #include "vphysics_interface.h"
@@ -564,6 +565,374 @@ inline void CalcBonePosition( int frame, float s,
 }
 
 
+//-----------------------------------------------------------------------------
+// Decoded animation frame cache.  Crowds of NPCs tend to play the same
+// sequences at nearby cycles, so rather than unpacking the RLE animation
+// streams for every entity, each (animation, frame) is decoded once into both
+// keyframes of CalcBoneQuaternion/CalcBonePosition and later lookups only do
+// the sub-frame blend.  Entries live in a CDataManager LRU like the bone cache.
+//-----------------------------------------------------------------------------
+static ConVar anim_decode_cache( "anim_decode_cache", "1", FCVAR_REPLICATED, "Cache decoded animation frames so entities playing the same animation share the decompression work." );
+
+// One animated bone at an integer frame: the two keyframes CalcBoneQuaternion
+// and CalcBonePosition would blend between
+struct DecodedAnimBone_t
+{
+	Quaternion	m_q1;			// already aligned when m_bAlign is set
+	Quaternion	m_q2;
+	Vector		m_pos1;
+	Vector		m_pos2;
+	bool		m_bBlendRot;	// keyframe rotations differ
+	bool		m_bAlign;		// align the blended rotation to the bone's qAlignment
+};
+
+struct AnimDecodeKey_t
+{
+	const mstudioanimdesc_t	*m_pAnimDesc;
+	int						m_nChecksum;	// of the studiohdr_t owning m_pAnimDesc, in case it's reloaded at the same address
+	int						m_iFrame;
+};
+
+static bool AnimDecodeKeyLessFunc( const AnimDecodeKey_t &lhs, const AnimDecodeKey_t &rhs )
+{
+	if ( lhs.m_pAnimDesc != rhs.m_pAnimDesc )
+		return lhs.m_pAnimDesc < rhs.m_pAnimDesc;
+	if ( lhs.m_nChecksum != rhs.m_nChecksum )
+		return lhs.m_nChecksum < rhs.m_nChecksum;
+	return lhs.m_iFrame < rhs.m_iFrame;
+}
+
+class CDecodedAnimFrame;
+
+struct decodedanimparams_t
+{
+	AnimDecodeKey_t			key;
+	const studiohdr_t		*pAnimStudioHdr;
+	const mstudioanim_t		*panim;
+	int						iLocalFrame;
+	CDecodedAnimFrame		*pDecoded;		// already decoded outside the cache lock, or NULL to decode in CreateResource
+};
+
+class CDecodedAnimFrame
+{
+public:
+	// public interface for CDataManager
+	static CDecodedAnimFrame *CreateResource( const decodedanimparams_t &params );
+	static CDecodedAnimFrame *Decode( const decodedanimparams_t &params );
+	static unsigned int	EstimatedSize( const decodedanimparams_t &params );
+	void				DestroyResource();
+	CDecodedAnimFrame	*GetData() { return this; }
+	unsigned int		Size() { return m_size; }
+
+	// One entry per mstudioanim_t in the animation's list, in the same order
+	DecodedAnimBone_t	*Bones() { return (DecodedAnimBone_t *)( this + 1 ); }
+
+	AnimDecodeKey_t		m_key;
+	unsigned int		m_size;
+	int					m_boneCount;
+};
+
+// Guarded by g_AnimDecodeCache's mutex; declared first so it outlives the cache
+static CUtlMap< AnimDecodeKey_t, memhandle_t > g_AnimDecodeMap( AnimDecodeKeyLessFunc );
+static CDataManager< CDecodedAnimFrame, decodedanimparams_t, CDecodedAnimFrame *, CThreadFastMutex > g_AnimDecodeCache( 1024 * 1024L );
+static int g_nAnimDecodeHits;
+static int g_nAnimDecodeMisses;
+
+static void DecodeAnimBone( int frame, const mstudiobone_t *pBone, const mstudiolinearbone_t *pLinearBones, const mstudioanim_t *panim, DecodedAnimBone_t &out )
+{
+	int iBone = panim->bone;
+	const Quaternion &baseQuat = pLinearBones ? pLinearBones->quat( iBone ) : pBone[iBone].quat;
+	const RadianEuler &baseRot = pLinearBones ? pLinearBones->rot( iBone ) : pBone[iBone].rot;
+	const Vector &baseRotScale = pLinearBones ? pLinearBones->rotscale( iBone ) : pBone[iBone].rotscale;
+	const Vector &basePos = pLinearBones ? pLinearBones->pos( iBone ) : pBone[iBone].pos;
+	const Vector &basePosScale = pLinearBones ? pLinearBones->posscale( iBone ) : pBone[iBone].posscale;
+	int iBaseFlags = pLinearBones ? pLinearBones->flags( iBone ) : pBone[iBone].flags;
+	bool bDelta = ( panim->flags & STUDIO_ANIM_DELTA ) != 0;
+
+	out.m_bBlendRot = false;
+	out.m_bAlign = false;
+	if ( panim->flags & STUDIO_ANIM_RAWROT )
+	{
+		out.m_q1 = *(panim->pQuat48());
+	} 
+	else if ( panim->flags & STUDIO_ANIM_RAWROT2 )
+	{
+		out.m_q1 = *(panim->pQuat64());
+	}
+	else if ( !(panim->flags & STUDIO_ANIM_ANIMROT) )
+	{
+		if ( bDelta )
+		{
+			out.m_q1.Init( 0.0f, 0.0f, 0.0f, 1.0f );
+		}
+		else
+		{
+			out.m_q1 = baseQuat;
+		}
+	}
+	else
+	{
+		mstudioanim_valueptr_t *pValuesPtr = panim->pRotV();
+		RadianEuler angle1, angle2;
+		ExtractAnimValue( frame, pValuesPtr->pAnimvalue( 0 ), baseRotScale.x, angle1.x, angle2.x );
+		ExtractAnimValue( frame, pValuesPtr->pAnimvalue( 1 ), baseRotScale.y, angle1.y, angle2.y );
+		ExtractAnimValue( frame, pValuesPtr->pAnimvalue( 2 ), baseRotScale.z, angle1.z, angle2.z );
+
+		if ( !bDelta )
+		{
+			angle1.x = angle1.x + baseRot.x;
+			angle1.y = angle1.y + baseRot.y;
+			angle1.z = angle1.z + baseRot.z;
+			angle2.x = angle2.x + baseRot.x;
+			angle2.y = angle2.y + baseRot.y;
+			angle2.z = angle2.z + baseRot.z;
+		}
+
+		Assert( angle1.IsValid() && angle2.IsValid() );
+		AngleQuaternion( angle1, out.m_q1 );
+		out.m_bBlendRot = ( angle1.x != angle2.x || angle1.y != angle2.y || angle1.z != angle2.z );
+		if ( out.m_bBlendRot )
+		{
+			AngleQuaternion( angle2, out.m_q2 );
+		}
+
+		out.m_bAlign = !bDelta && ( iBaseFlags & BONE_FIXED_ALIGNMENT );
+		if ( out.m_bAlign )
+		{
+			const Quaternion &baseAlignment = pLinearBones ? pLinearBones->qalignment( iBone ) : pBone[iBone].qAlignment;
+			QuaternionAlign( baseAlignment, out.m_q1, out.m_q1 );
+		}
+	}
+
+	if ( !out.m_bBlendRot )
+	{
+		out.m_q2 = out.m_q1;
+	}
+	Assert( out.m_q1.IsValid() );
+
+	if ( panim->flags & STUDIO_ANIM_RAWPOS )
+	{
+		out.m_pos1 = *(panim->pPos());
+		out.m_pos2 = out.m_pos1;
+	}
+	else if ( !(panim->flags & STUDIO_ANIM_ANIMPOS) )
+	{
+		if ( bDelta )
+		{
+			out.m_pos1.Init( 0.0f, 0.0f, 0.0f );
+		}
+		else
+		{
+			out.m_pos1 = basePos;
+		}
+		out.m_pos2 = out.m_pos1;
+	}
+	else
+	{
+		mstudioanim_valueptr_t *pPosV = panim->pPosV();
+		for ( int j = 0; j < 3; j++ )
+		{
+			ExtractAnimValue( frame, pPosV->pAnimvalue( j ), basePosScale[j], out.m_pos1[j], out.m_pos2[j] );
+		}
+
+		if ( !bDelta )
+		{
+			out.m_pos1 += basePos;
+			out.m_pos2 += basePos;
+		}
+	}
+	Assert( out.m_pos1.IsValid() );
+}
+
+CDecodedAnimFrame *CDecodedAnimFrame::CreateResource( const decodedanimparams_t &params )
+{
+	return params.pDecoded ? params.pDecoded : Decode( params );
+}
+
+CDecodedAnimFrame *CDecodedAnimFrame::Decode( const decodedanimparams_t &params )
+{
+	int boneCount = 0;
+	for ( const mstudioanim_t *panim = params.panim; panim && panim->bone < 255; panim = panim->pNext() )
+	{
+		boneCount++;
+	}
+
+	unsigned int size = sizeof(CDecodedAnimFrame) + boneCount * sizeof(DecodedAnimBone_t);
+	CDecodedAnimFrame *pMem = (CDecodedAnimFrame *)malloc( size );
+	Construct( pMem );
+	pMem->m_key = params.key;
+	pMem->m_size = size;
+	pMem->m_boneCount = boneCount;
+
+	const mstudiobone_t *pBone = params.pAnimStudioHdr->pBone( 0 );
+	const mstudiolinearbone_t *pLinearBones = params.pAnimStudioHdr->pLinearBones();
+	DecodedAnimBone_t *pBones = pMem->Bones();
+	for ( const mstudioanim_t *panim = params.panim; panim && panim->bone < 255; panim = panim->pNext() )
+	{
+		DecodeAnimBone( params.iLocalFrame, pBone, pLinearBones, panim, *pBones++ );
+	}
+	return pMem;
+}
+
+unsigned int CDecodedAnimFrame::EstimatedSize( const decodedanimparams_t &params )
+{
+	if ( params.pDecoded )
+		return params.pDecoded->m_size;
+
+	// conservative estimate - every bone animated
+	return sizeof(CDecodedAnimFrame) + params.pAnimStudioHdr->numbones * sizeof(DecodedAnimBone_t);
+}
+
+void CDecodedAnimFrame::DestroyResource()
+{
+	// Called with the cache's mutex held
+	g_AnimDecodeMap.Remove( m_key );
+	free( this );
+}
+
+// Called with the cache's mutex held
+static CDecodedAnimFrame *LockCachedAnimFrame( const AnimDecodeKey_t &key, memhandle_t *phFrame )
+{
+	unsigned short iMap = g_AnimDecodeMap.Find( key );
+	if ( iMap == g_AnimDecodeMap.InvalidIndex() )
+		return NULL;
+
+	*phFrame = g_AnimDecodeMap[iMap];
+	return g_AnimDecodeCache.LockResource( *phFrame );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds or decodes an integer frame of an animation and locks it in
+//			the cache.  *ppBones gets one entry per mstudioanim_t in panim's
+//			list, or NULL if the cache is off.  Pass the returned handle to
+//			UnlockDecodedAnimFrame when done.
+//-----------------------------------------------------------------------------
+static memhandle_t LockDecodedAnimFrame( const studiohdr_t *pAnimStudioHdr, const mstudioanimdesc_t &animdesc, int iFrame, 
+	const mstudioanim_t *panim, int iLocalFrame, const DecodedAnimBone_t **ppBones )
+{
+	*ppBones = NULL;
+	if ( !panim || !anim_decode_cache.GetBool() )
+		return INVALID_MEMHANDLE;
+
+	decodedanimparams_t params;
+	params.key.m_pAnimDesc = &animdesc;
+	params.key.m_nChecksum = pAnimStudioHdr->checksum;
+	params.key.m_iFrame = iFrame;
+	params.pAnimStudioHdr = pAnimStudioHdr;
+	params.panim = panim;
+	params.iLocalFrame = iLocalFrame;
+	params.pDecoded = NULL;
+
+	memhandle_t hFrame = INVALID_MEMHANDLE;
+	CDecodedAnimFrame *pFrame = NULL;
+
+	// Hits only hold the lock for the lookup
+	{
+		AUTO_LOCK( g_AnimDecodeCache.AccessMutex() );
+		pFrame = LockCachedAnimFrame( params.key, &hFrame );
+		if ( pFrame )
+		{
+			g_nAnimDecodeHits++;
+			*ppBones = pFrame->Bones();
+			return hFrame;
+		}
+	}
+
+	// Decode unlocked so other threads' lookups aren't stuck behind the RLE unpacking
+	params.pDecoded = CDecodedAnimFrame::Decode( params );
+
+	AUTO_LOCK( g_AnimDecodeCache.AccessMutex() );
+	g_nAnimDecodeMisses++;
+
+	// Another thread may have decoded the same frame meanwhile
+	pFrame = LockCachedAnimFrame( params.key, &hFrame );
+	if ( pFrame )
+	{
+		free( params.pDecoded );
+	}
+	else
+	{
+		hFrame = g_AnimDecodeCache.CreateResource( params, true );
+		pFrame = params.pDecoded;
+		g_AnimDecodeMap.InsertOrReplace( params.key, hFrame );
+	}
+
+	*ppBones = pFrame->Bones();
+	return hFrame;
+}
+
+static void UnlockDecodedAnimFrame( memhandle_t hFrame )
+{
+	if ( hFrame != INVALID_MEMHANDLE )
+	{
+		g_AnimDecodeCache.UnlockResource( hFrame );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: CalcBoneQuaternion and CalcBonePosition for one animated bone,
+//			from the decoded frame cache when pDecoded is set
+//-----------------------------------------------------------------------------
+inline void CalcBoneAnimation( int frame, float s, 
+						const mstudiobone_t *pBone,
+						const mstudiolinearbone_t *pLinearBones,
+						const mstudioanim_t *panim, const DecodedAnimBone_t *pDecoded,
+						Quaternion &q, Vector &pos )
+{
+	if ( !pDecoded )
+	{
+		CalcBoneQuaternion( frame, s, pBone, pLinearBones, panim, q );
+		CalcBonePosition  ( frame, s, pBone, pLinearBones, panim, pos );
+		return;
+	}
+
+	if ( s > 0.001f )
+	{
+		if ( pDecoded->m_bBlendRot )
+		{
+			QuaternionBlend( pDecoded->m_q1, pDecoded->m_q2, s, q );
+			if ( pDecoded->m_bAlign )
+			{
+				QuaternionAlign( pLinearBones ? pLinearBones->qalignment( panim->bone ) : pBone->qAlignment, q, q );
+			}
+		}
+		else
+		{
+			q = pDecoded->m_q1;
+		}
+
+		pos.x = pDecoded->m_pos1.x * (1.0 - s) + pDecoded->m_pos2.x * s;
+		pos.y = pDecoded->m_pos1.y * (1.0 - s) + pDecoded->m_pos2.y * s;
+		pos.z = pDecoded->m_pos1.z * (1.0 - s) + pDecoded->m_pos2.z * s;
+	}
+	else
+	{
+		q = pDecoded->m_q1;
+		pos = pDecoded->m_pos1;
+	}
+}
+
+#ifdef CLIENT_DLL
+CON_COMMAND( cl_anim_decode_cache_stats, "Prints the decoded animation frame cache hit rate and memory use" )
+#else
+CON_COMMAND( anim_decode_cache_stats, "Prints the decoded animation frame cache hit rate and memory use" )
+#endif
+{
+	AUTO_LOCK( g_AnimDecodeCache.AccessMutex() );
+
+	int nLookups = g_nAnimDecodeHits + g_nAnimDecodeMisses;
+	Msg( "Animation decode cache: %d frames, %u/%u bytes, %d hits, %d misses (%.1f%% hit rate)\n",
+		g_AnimDecodeMap.Count(), g_AnimDecodeCache.UsedSize(), g_AnimDecodeCache.TargetSize(),
+		g_nAnimDecodeHits, g_nAnimDecodeMisses, nLookups ? 100.0f * g_nAnimDecodeHits / nLookups : 0.0f );
+
+	if ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) )
+	{
+		g_nAnimDecodeHits = 0;
+		g_nAnimDecodeMisses = 0;
+	}
+}
+
+
 
 void SetupSingleBoneMatrix( 
 	CStudioHdr *pOwnerHdr, 
@@ -950,6 +1319,9 @@ static void CalcVirtualAnimation( virtualmodel_t *pVModel, const CStudioHdr *pSt
 		return;
 	}
 
+	const DecodedAnimBone_t *pDecoded;
+	memhandle_t hDecoded = LockDecodedAnimFrame( pAnimStudioHdr, animdesc, iFrame, panim, iLocalFrame, &pDecoded );
+
 	// FIXME: change encoding so that bone -1 is never the case
 	while (panim && panim->bone < 255)
 	{
@@ -960,16 +1332,21 @@ static void CalcVirtualAnimation( virtualmodel_t *pVModel, const CStudioHdr *pSt
 
 			if (k >= 0 && pweight[k] > 0.0f)
 			{
-				CalcBoneQuaternion( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, q[j] );
-				CalcBonePosition  ( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, pos[j] );
+				CalcBoneAnimation( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, pDecoded, q[j], pos[j] );
 #ifdef STUDIO_ENABLE_PERF_COUNTERS
 				pStudioHdr->m_nPerfAnimatedBones++;
 #endif
 			}
 		}
 		panim = panim->pNext();
+		if ( pDecoded )
+		{
+			pDecoded++;
+		}
 	}
 
+	UnlockDecodedAnimFrame( hDecoded );
+
 	// cross fade in previous zeroframe data
 	if (flStall > 0.0f)
 	{
@@ -1074,6 +1451,9 @@ static void CalcAnimation( const CStudioHdr *pStudioHdr,	Vector *pos, Quaternion
 		return;
 	}
 
+	const DecodedAnimBone_t *pDecoded;
+	memhandle_t hDecoded = LockDecodedAnimFrame( pStudioHdr->GetRenderHdr(), animdesc, iFrame, panim, iLocalFrame, &pDecoded );
+
 	// BUGBUG: the sequence, the anim, and the model can have all different bone mappings.
 	for (i = 0; i < pStudioHdr->numbones(); i++, pbone++, pweight++)
 	{
@@ -1081,14 +1461,17 @@ static void CalcAnimation( const CStudioHdr *pStudioHdr,	Vector *pos, Quaternion
 		{
 			if (*pweight > 0 && (pStudioHdr->boneFlags(i) & boneMask))
 			{
-				CalcBoneQuaternion( iLocalFrame, s, pbone, pLinearBones, panim, q[i] );
-				CalcBonePosition  ( iLocalFrame, s, pbone, pLinearBones, panim, pos[i] );
+				CalcBoneAnimation( iLocalFrame, s, pbone, pLinearBones, panim, pDecoded, q[i], pos[i] );
 #ifdef STUDIO_ENABLE_PERF_COUNTERS
 				pStudioHdr->m_nPerfAnimatedBones++;
 				pStudioHdr->m_nPerfUsedBones++;
 #endif
 			}
 			panim = panim->pNext();
+			if ( pDecoded )
+			{
+				pDecoded++;
+			}
 		}
 		else if (*pweight > 0 && (pStudioHdr->boneFlags(i) & boneMask))
 		{
@@ -1108,6 +1491,8 @@ static void CalcAnimation( const CStudioHdr *pStudioHdr,	Vector *pos, Quaternion
 		}
 	}
 
+	UnlockDecodedAnimFrame( hDecoded );
+
 	// cross fade in previous zeroframe data
 	if (flStall > 0.0f)
 	{
@@ -1223,6 +1608,411 @@ FORCEINLINE fltx4 QuaternionAccumulateSIMD( const fltx4 &p, float s, const fltx4
 #endif
 
 
+//-----------------------------------------------------------------------------
+// Four-bone SIMD blending.  The quaternions of four bones are transposed into
+// structure-of-arrays form (one component per fltx4) so that the alignment,
+// slerp, blend, delta accumulate and scale math runs on all four at once.
+// Results match the scalar quaternion functions to within float precision;
+// see anim_simd_blend_validate.  Off until that has been run on the target
+// platforms.
+//-----------------------------------------------------------------------------
+static ConVar anim_simd_blend( "anim_simd_blend", "0", FCVAR_REPLICATED, "Blend bones four at a time with SIMD math in SlerpBones, BlendBones and ScaleBones." );
+
+struct BoneQuaternions4_t
+{
+	fltx4 x, y, z, w;
+
+	template< class T >
+	FORCEINLINE void Load( const T *pQ, const int *pBones )
+	{
+		x = LoadUnalignedSIMD( pQ[ pBones[0] ].Base() );
+		y = LoadUnalignedSIMD( pQ[ pBones[1] ].Base() );
+		z = LoadUnalignedSIMD( pQ[ pBones[2] ].Base() );
+		w = LoadUnalignedSIMD( pQ[ pBones[3] ].Base() );
+		TransposeSIMD( x, y, z, w );
+	}
+
+	FORCEINLINE void Store( Quaternion *pQ, const int *pBones ) const
+	{
+		fltx4 a = x, b = y, c = z, d = w;
+		TransposeSIMD( a, b, c, d );
+		StoreUnalignedSIMD( pQ[ pBones[0] ].Base(), a );
+		StoreUnalignedSIMD( pQ[ pBones[1] ].Base(), b );
+		StoreUnalignedSIMD( pQ[ pBones[2] ].Base(), c );
+		StoreUnalignedSIMD( pQ[ pBones[3] ].Base(), d );
+	}
+};
+
+// QuaternionNormalize, which leaves zero quaternions alone
+FORCEINLINE void QuaternionNormalizeSoA( BoneQuaternions4_t &q )
+{
+	fltx4 radius = MaddSIMD( q.x, q.x, MaddSIMD( q.y, q.y, MaddSIMD( q.z, q.z, MulSIMD( q.w, q.w ) ) ) );
+	fltx4 nonZero = CmpGtSIMD( radius, Four_Zeros );
+	fltx4 iradius = MaskedAssign( nonZero, ReciprocalSqrtSIMD( radius ), Four_Ones );
+	q.x = MulSIMD( q.x, iradius );
+	q.y = MulSIMD( q.y, iradius );
+	q.z = MulSIMD( q.z, iradius );
+	q.w = MulSIMD( q.w, iradius );
+}
+
+// QuaternionAlign on the lanes set in alignMask: flips q where it's closer to -p
+FORCEINLINE void QuaternionAlignSoA( const BoneQuaternions4_t &p, BoneQuaternions4_t &q, const fltx4 &alignMask )
+{
+	fltx4 dx = SubSIMD( p.x, q.x ), dy = SubSIMD( p.y, q.y ), dz = SubSIMD( p.z, q.z ), dw = SubSIMD( p.w, q.w );
+	fltx4 a = MaddSIMD( dx, dx, MaddSIMD( dy, dy, MaddSIMD( dz, dz, MulSIMD( dw, dw ) ) ) );
+
+	fltx4 sx = AddSIMD( p.x, q.x ), sy = AddSIMD( p.y, q.y ), sz = AddSIMD( p.z, q.z ), sw = AddSIMD( p.w, q.w );
+	fltx4 b = MaddSIMD( sx, sx, MaddSIMD( sy, sy, MaddSIMD( sz, sz, MulSIMD( sw, sw ) ) ) );
+
+	fltx4 flip = AndSIMD( CmpGtSIMD( a, b ), alignMask );
+	q.x = MaskedAssign( flip, NegSIMD( q.x ), q.x );
+	q.y = MaskedAssign( flip, NegSIMD( q.y ), q.y );
+	q.z = MaskedAssign( flip, NegSIMD( q.z ), q.z );
+	q.w = MaskedAssign( flip, NegSIMD( q.w ), q.w );
+}
+
+// QuaternionSlerpNoAlign on four quaternions.  Returns false, without touching qt, if
+// any pair is nearly opposite; the scalar code has a special case for those.
+FORCEINLINE bool QuaternionSlerpNoAlignSoA( const BoneQuaternions4_t &p, const BoneQuaternions4_t &q, const fltx4 &t, BoneQuaternions4_t &qt )
+{
+	fltx4 cosom = MaddSIMD( p.x, q.x, MaddSIMD( p.y, q.y, MaddSIMD( p.z, q.z, MulSIMD( p.w, q.w ) ) ) );
+	fltx4 epsilon = ReplicateX4( 0.000001f );
+
+	if ( TestSignSIMD( CmpLeSIMD( AddSIMD( Four_Ones, cosom ), epsilon ) ) )
+		return false;
+
+	// Nearly identical quaternions fall back to a linear blend
+	fltx4 sclp = SubSIMD( Four_Ones, t );
+	fltx4 sclq = t;
+	fltx4 useSlerp = CmpGtSIMD( SubSIMD( Four_Ones, cosom ), epsilon );
+	if ( TestSignSIMD( useSlerp ) )
+	{
+		fltx4 omega = ArcCosSIMD( MinSIMD( cosom, Four_Ones ) );
+		fltx4 sinom = MaskedAssign( useSlerp, SinSIMD( omega ), Four_Ones );
+		sclp = MaskedAssign( useSlerp, DivSIMD( SinSIMD( MulSIMD( sclp, omega ) ), sinom ), sclp );
+		sclq = MaskedAssign( useSlerp, DivSIMD( SinSIMD( MulSIMD( t, omega ) ), sinom ), sclq );
+	}
+
+	qt.x = MaddSIMD( sclp, p.x, MulSIMD( sclq, q.x ) );
+	qt.y = MaddSIMD( sclp, p.y, MulSIMD( sclq, q.y ) );
+	qt.z = MaddSIMD( sclp, p.z, MulSIMD( sclq, q.z ) );
+	qt.w = MaddSIMD( sclp, p.w, MulSIMD( sclq, q.w ) );
+	return true;
+}
+
+// QuaternionBlendNoAlign on four quaternions
+FORCEINLINE void QuaternionBlendNoAlignSoA( const BoneQuaternions4_t &p, const BoneQuaternions4_t &q, const fltx4 &t, BoneQuaternions4_t &qt )
+{
+	fltx4 sclp = SubSIMD( Four_Ones, t );
+	qt.x = MaddSIMD( sclp, p.x, MulSIMD( t, q.x ) );
+	qt.y = MaddSIMD( sclp, p.y, MulSIMD( t, q.y ) );
+	qt.z = MaddSIMD( sclp, p.z, MulSIMD( t, q.z ) );
+	qt.w = MaddSIMD( sclp, p.w, MulSIMD( t, q.w ) );
+	QuaternionNormalizeSoA( qt );
+}
+
+// QuaternionIdentityBlend on four quaternions, for qt == p as ScaleBones calls it
+FORCEINLINE void QuaternionIdentityBlendSoA( const BoneQuaternions4_t &p, const fltx4 &t, BoneQuaternions4_t &qt )
+{
+	fltx4 sclp = SubSIMD( Four_Ones, t );
+	fltx4 negative = CmpLtSIMD( p.w, Four_Zeros );
+	qt.x = MulSIMD( p.x, sclp );
+	qt.y = MulSIMD( p.y, sclp );
+	qt.z = MulSIMD( p.z, sclp );
+	qt.w = MaddSIMD( p.w, sclp, MaskedAssign( negative, NegSIMD( t ), t ) );
+	QuaternionNormalizeSoA( qt );
+}
+
+// QuaternionScale on four quaternions
+FORCEINLINE void QuaternionScaleSoA( const BoneQuaternions4_t &p, const fltx4 &t, BoneQuaternions4_t &qt )
+{
+	// Summed in the scalar order; asin is ill-conditioned near half turns
+	fltx4 sinom = SqrtSIMD( MaddSIMD( p.z, p.z, MaddSIMD( p.y, p.y, MulSIMD( p.x, p.x ) ) ) );
+	sinom = MinSIMD( sinom, Four_Ones );
+
+	fltx4 sinsom = SinSIMD( MulSIMD( ArcSinSIMD( sinom ), t ) );
+	fltx4 scale = DivSIMD( sinsom, AddSIMD( sinom, ReplicateX4( FLT_EPSILON ) ) );
+	qt.x = MulSIMD( p.x, scale );
+	qt.y = MulSIMD( p.y, scale );
+	qt.z = MulSIMD( p.z, scale );
+
+	// Rescale the rotation, keeping its sign
+	fltx4 r = SqrtSIMD( MaxSIMD( SubSIMD( Four_Ones, MulSIMD( sinsom, sinsom ) ), Four_Zeros ) );
+	qt.w = MaskedAssign( CmpLtSIMD( p.w, Four_Zeros ), NegSIMD( r ), r );
+}
+
+// QuaternionMult on four quaternions, qt = p * q with q aligned to p
+FORCEINLINE void QuaternionMultSoA( const BoneQuaternions4_t &p, const BoneQuaternions4_t &q, BoneQuaternions4_t &qt )
+{
+	BoneQuaternions4_t q2 = q;
+	QuaternionAlignSoA( p, q2, LoadAlignedSIMD( g_SIMD_AllOnesMask ) );
+
+	qt.x = MaddSIMD( p.w, q2.x, MsubSIMD( p.z, q2.y, MaddSIMD( p.y, q2.z, MulSIMD( p.x, q2.w ) ) ) );
+	qt.y = MaddSIMD( p.w, q2.y, MaddSIMD( p.z, q2.x, MsubSIMD( p.x, q2.z, MulSIMD( p.y, q2.w ) ) ) );
+	qt.z = MaddSIMD( p.w, q2.z, MaddSIMD( p.z, q2.w, MsubSIMD( p.y, q2.x, MulSIMD( p.x, q2.y ) ) ) );
+	qt.w = MaddSIMD( p.w, q2.w, MsubSIMD( p.z, q2.z, MsubSIMD( p.y, q2.y, NegSIMD( MulSIMD( p.x, q2.x ) ) ) ) );
+}
+
+// QuaternionSM ( qt = ( s * p ) * q ) or, with bPost, QuaternionMA ( qt = q * ( s * p ) )
+FORCEINLINE void QuaternionAccumulateDeltaSoA( const BoneQuaternions4_t &p, const fltx4 &s, const BoneQuaternions4_t &q, bool bPost, BoneQuaternions4_t &qt )
+{
+	BoneQuaternions4_t p1;
+	QuaternionScaleSoA( p, s, p1 );
+	if ( bPost )
+	{
+		QuaternionMultSoA( q, p1, qt );
+	}
+	else
+	{
+		QuaternionMultSoA( p1, q, qt );
+	}
+	QuaternionNormalizeSoA( qt );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Builds the list of bones with a blend weight, padded to a multiple
+//			of four by repeating the last bone.  Padding lanes compute the same
+//			result as the lane they copy, so storing them is harmless.
+// Output : Returns the number of bones before padding.
+//-----------------------------------------------------------------------------
+static int BuildSIMDBoneList( const float *pWeights, int nBoneCount, int *pBones )
+{
+	int nBones = 0;
+	for ( int i = 0; i < nBoneCount; i++ )
+	{
+		if ( pWeights[i] > 0.0f )
+		{
+			pBones[nBones++] = i;
+		}
+	}
+
+	for ( int i = nBones; nBones && ( i & 3 ); i++ )
+	{
+		pBones[i] = pBones[nBones - 1];
+	}
+	return nBones;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The non-delta part of SlerpBones, four bones at a time.
+//			Slerps q1 towards q2 by each bone's weight in pS2.
+//-----------------------------------------------------------------------------
+static void SlerpBonesSIMD( 
+	const CStudioHdr *pStudioHdr,
+	Quaternion q1[MAXSTUDIOBONES], 
+	Vector pos1[MAXSTUDIOBONES], 
+	const QuaternionAligned q2[MAXSTUDIOBONES], 
+	const Vector pos2[MAXSTUDIOBONES], 
+	const float *pS2,
+	int nBoneCount )
+{
+	int *pBones = (int*)stackalloc( ( nBoneCount + 3 ) * sizeof(int) );
+	int nBones = BuildSIMDBoneList( pS2, nBoneCount, pBones );
+
+	for ( int i = 0; i < nBones; i += 4 )
+	{
+		const int *pGroup = &pBones[i];
+
+		fltx4 s1, alignMask;
+		for ( int k = 0; k < 4; k++ )
+		{
+			SubFloat( s1, k ) = 1.0f - pS2[ pGroup[k] ];
+			SubInt( alignMask, k ) = ( pStudioHdr->boneFlags( pGroup[k] ) & BONE_FIXED_ALIGNMENT ) ? 0 : 0xFFFFFFFF;
+		}
+
+		BoneQuaternions4_t p, q, qt;
+		p.Load( q2, pGroup );
+		q.Load( q1, pGroup );
+		QuaternionAlignSoA( p, q, alignMask );
+
+		if ( QuaternionSlerpNoAlignSoA( p, q, s1, qt ) )
+		{
+			qt.Store( q1, pGroup );
+			continue;
+		}
+
+		// Some pair is nearly opposite, do this group the scalar way
+		for ( int k = 0; k < 4 && i + k < nBones; k++ )
+		{
+			int iBone = pGroup[k];
+			Quaternion q3;
+			if ( pStudioHdr->boneFlags( iBone ) & BONE_FIXED_ALIGNMENT )
+			{
+				QuaternionSlerpNoAlign( q2[iBone], q1[iBone], SubFloat( s1, k ), q3 );
+			}
+			else
+			{
+				QuaternionSlerp( q2[iBone], q1[iBone], SubFloat( s1, k ), q3 );
+			}
+			q1[iBone] = q3;
+		}
+	}
+
+	for ( int i = 0; i < nBones; i++ )
+	{
+		int iBone = pBones[i];
+		float s2 = pS2[iBone];
+		float s1 = 1.0 - s2;
+		pos1[iBone][0] = pos1[iBone][0] * s1 + pos2[iBone][0] * s2;
+		pos1[iBone][1] = pos1[iBone][1] * s1 + pos2[iBone][1] * s2;
+		pos1[iBone][2] = pos1[iBone][2] * s1 + pos2[iBone][2] * s2;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The delta part of SlerpBones, four bones at a time.  Adds each
+//			bone's weight in pS2 of the delta q2 onto q1, after q1 with
+//			STUDIO_POST and before it otherwise.
+//-----------------------------------------------------------------------------
+static void AccumulateDeltaBonesSIMD( 
+	Quaternion q1[MAXSTUDIOBONES], 
+	Vector pos1[MAXSTUDIOBONES], 
+	const QuaternionAligned q2[MAXSTUDIOBONES], 
+	const Vector pos2[MAXSTUDIOBONES], 
+	const float *pS2,
+	int nBoneCount,
+	bool bPost )
+{
+	int *pBones = (int*)stackalloc( ( nBoneCount + 3 ) * sizeof(int) );
+	int nBones = BuildSIMDBoneList( pS2, nBoneCount, pBones );
+
+	for ( int i = 0; i < nBones; i += 4 )
+	{
+		const int *pGroup = &pBones[i];
+
+		fltx4 s2;
+		for ( int k = 0; k < 4; k++ )
+		{
+			SubFloat( s2, k ) = pS2[ pGroup[k] ];
+		}
+
+		BoneQuaternions4_t p, q, qt;
+		p.Load( q2, pGroup );
+		q.Load( q1, pGroup );
+		QuaternionAccumulateDeltaSoA( p, s2, q, bPost, qt );
+		qt.Store( q1, pGroup );
+	}
+
+	for ( int i = 0; i < nBones; i++ )
+	{
+		int iBone = pBones[i];
+		float s2 = pS2[iBone];
+		pos1[iBone][0] = pos1[iBone][0] + pos2[iBone][0] * s2;
+		pos1[iBone][1] = pos1[iBone][1] + pos2[iBone][1] * s2;
+		pos1[iBone][2] = pos1[iBone][2] + pos2[iBone][2] * s2;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Checks the SIMD slerp, blend, scale and delta accumulate against
+//			the scalar versions on random quaternions, including identical and
+//			opposite pairs.
+// Output : Returns the largest difference in any quaternion component.
+//-----------------------------------------------------------------------------
+static float ValidateSIMDBoneBlending( int nTests )
+{
+	CUniformRandomStream random;
+	random.SetSeed( 1 );
+
+	int pGroup[4] = { 0, 1, 2, 3 };
+	float flMaxError = 0.0f;
+	for ( int iTest = 0; iTest < nTests; iTest++ )
+	{
+		QuaternionAligned p[4];
+		Quaternion q[4];
+		fltx4 t, alignMask;
+		for ( int k = 0; k < 4; k++ )
+		{
+			QAngle angles( random.RandomFloat( -180, 180 ), random.RandomFloat( -180, 180 ), random.RandomFloat( -180, 180 ) );
+			AngleQuaternion( angles, p[k] );
+
+			// Every few tests, make q equal to p or to -p
+			switch ( ( iTest + k ) % 8 )
+			{
+			case 0:
+				q[k] = p[k];
+				break;
+			case 1:
+				q[k].Init( -p[k].x, -p[k].y, -p[k].z, -p[k].w );
+				break;
+			default:
+				angles.Init( random.RandomFloat( -180, 180 ), random.RandomFloat( -180, 180 ), random.RandomFloat( -180, 180 ) );
+				AngleQuaternion( angles, q[k] );
+				break;
+			}
+
+			SubFloat( t, k ) = random.RandomFloat( 0.0f, 1.0f );
+			SubInt( alignMask, k ) = ( k & 1 ) ? 0 : 0xFFFFFFFF;
+		}
+
+		BoneQuaternions4_t ps, qs, slerped, blended, scaled, deltaPre, deltaPost;
+		ps.Load( p, pGroup );
+		qs.Load( q, pGroup );
+		QuaternionIdentityBlendSoA( qs, t, scaled );
+		QuaternionAccumulateDeltaSoA( ps, t, qs, false, deltaPre );
+		QuaternionAccumulateDeltaSoA( ps, t, qs, true, deltaPost );
+		QuaternionAlignSoA( ps, qs, alignMask );
+		bool bSlerped = QuaternionSlerpNoAlignSoA( ps, qs, t, slerped );
+		QuaternionBlendNoAlignSoA( ps, qs, t, blended );
+
+		Quaternion slerpResult[4], blendResult[4], scaleResult[4], deltaPreResult[4], deltaPostResult[4];
+		slerped.Store( slerpResult, pGroup );
+		blended.Store( blendResult, pGroup );
+		scaled.Store( scaleResult, pGroup );
+		deltaPre.Store( deltaPreResult, pGroup );
+		deltaPost.Store( deltaPostResult, pGroup );
+
+		for ( int k = 0; k < 4; k++ )
+		{
+			Quaternion scaleExpected = q[k], deltaPreExpected, deltaPostExpected;
+			QuaternionIdentityBlend( scaleExpected, SubFloat( t, k ), scaleExpected );
+			QuaternionSM( SubFloat( t, k ), p[k], q[k], deltaPreExpected );
+			QuaternionMA( q[k], SubFloat( t, k ), p[k], deltaPostExpected );
+
+			Quaternion slerpExpected, blendExpected;
+			if ( k & 1 )
+			{
+				QuaternionSlerpNoAlign( p[k], q[k], SubFloat( t, k ), slerpExpected );
+				QuaternionBlendNoAlign( p[k], q[k], SubFloat( t, k ), blendExpected );
+			}
+			else
+			{
+				QuaternionSlerp( p[k], q[k], SubFloat( t, k ), slerpExpected );
+				QuaternionBlend( p[k], q[k], SubFloat( t, k ), blendExpected );
+			}
+
+			for ( int j = 0; j < 4; j++ )
+			{
+				if ( bSlerped )
+				{
+					flMaxError = MAX( flMaxError, fabs( slerpResult[k][j] - slerpExpected[j] ) );
+				}
+				flMaxError = MAX( flMaxError, fabs( blendResult[k][j] - blendExpected[j] ) );
+				flMaxError = MAX( flMaxError, fabs( scaleResult[k][j] - scaleExpected[j] ) );
+				flMaxError = MAX( flMaxError, fabs( deltaPreResult[k][j] - deltaPreExpected[j] ) );
+				flMaxError = MAX( flMaxError, fabs( deltaPostResult[k][j] - deltaPostExpected[j] ) );
+			}
+		}
+	}
+
+	return flMaxError;
+}
+
+#ifdef CLIENT_DLL
+CON_COMMAND( cl_anim_simd_blend_validate, "Compares the SIMD bone blending math against the scalar math: cl_anim_simd_blend_validate [tests]" )
+#else
+CON_COMMAND( anim_simd_blend_validate, "Compares the SIMD bone blending math against the scalar math: anim_simd_blend_validate [tests]" )
+#endif
+{
+	int nTests = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 10000;
+	float flMaxError = ValidateSIMDBoneBlending( nTests );
+
+	// Slerp goes through acos and sin, so allow a little more than float epsilon
+	const float flTolerance = 1e-4f;
+	Msg( "SIMD bone blending: %d x 4 quaternions, max error %g (%s)\n", nTests, flMaxError, ( flMaxError <= flTolerance ) ? "ok" : "FAILED" );
+}
+
+
 
 //-----------------------------------------------------------------------------
 // Purpose: blend together in world space q1,pos1 with q2,pos2.  Return result in q1,pos1.  
@@ -1418,6 +2208,12 @@ void SlerpBones(
 	float s1, s2;
 	if ( seqdesc.flags & STUDIO_DELTA )
 	{
+		if ( anim_simd_blend.GetBool() )
+		{
+			AccumulateDeltaBonesSIMD( q1, pos1, q2, pos2, pS2, nBoneCount, ( seqdesc.flags & STUDIO_POST ) != 0 );
+			return;
+		}
+
 		for ( i = 0; i < nBoneCount; i++ )
 		{
 			s2 = pS2[i];
@@ -1459,6 +2255,12 @@ void SlerpBones(
 		return;
 	}
 
+	if ( anim_simd_blend.GetBool() )
+	{
+		SlerpBonesSIMD( pStudioHdr, q1, pos1, q2, pos2, pS2, nBoneCount );
+		return;
+	}
+
 	QuaternionAligned q3;
 	for (i = 0; i < nBoneCount; i++)
 	{
@@ -1570,6 +2372,48 @@ void BlendBones(
 	float s2 = s;
 	float s1 = 1.0 - s2;
 
+	if ( anim_simd_blend.GetBool() )
+	{
+		// Same bone selection as below, but blended four at a time
+		int nBoneCount = pStudioHdr->numbones();
+		float *pWeights = (float*)stackalloc( nBoneCount * sizeof(float) );
+		for (i = 0; i < nBoneCount; i++)
+		{
+			j = pSeqGroup ? pSeqGroup->boneMap[i] : i;
+			pWeights[i] = ( ( pStudioHdr->boneFlags(i) & boneMask ) && j >= 0 && seqdesc.weight( j ) > 0.0 ) ? 1.0f : 0.0f;
+		}
+
+		int *pBones = (int*)stackalloc( ( nBoneCount + 3 ) * sizeof(int) );
+		int nBones = BuildSIMDBoneList( pWeights, nBoneCount, pBones );
+		fltx4 t = ReplicateX4( s1 );
+		for (i = 0; i < nBones; i += 4)
+		{
+			const int *pGroup = &pBones[i];
+
+			fltx4 alignMask;
+			for ( int k = 0; k < 4; k++ )
+			{
+				SubInt( alignMask, k ) = ( pStudioHdr->boneFlags( pGroup[k] ) & BONE_FIXED_ALIGNMENT ) ? 0 : 0xFFFFFFFF;
+			}
+
+			BoneQuaternions4_t p, q, qt;
+			p.Load( q2, pGroup );
+			q.Load( q1, pGroup );
+			QuaternionAlignSoA( p, q, alignMask );
+			QuaternionBlendNoAlignSoA( p, q, t, qt );
+			qt.Store( q1, pGroup );
+		}
+
+		for (i = 0; i < nBones; i++)
+		{
+			int iBone = pBones[i];
+			pos1[iBone][0] = pos1[iBone][0] * s1 + pos2[iBone][0] * s2;
+			pos1[iBone][1] = pos1[iBone][1] * s1 + pos2[iBone][1] * s2;
+			pos1[iBone][2] = pos1[iBone][2] * s1 + pos2[iBone][2] * s2;
+		}
+		return;
+	}
+
 	for (i = 0; i < pStudioHdr->numbones(); i++)
 	{
 		// skip unused bones
@@ -1636,6 +2480,35 @@ void ScaleBones(
 	float s2 = s;
 	float s1 = 1.0 - s2;
 
+	if ( anim_simd_blend.GetBool() )
+	{
+		// Same bone selection as below, but scaled four at a time
+		int nBoneCount = pStudioHdr->numbones();
+		float *pWeights = (float*)stackalloc( nBoneCount * sizeof(float) );
+		for (i = 0; i < nBoneCount; i++)
+		{
+			j = pSeqGroup ? pSeqGroup->boneMap[i] : i;
+			pWeights[i] = ( ( pStudioHdr->boneFlags(i) & boneMask ) && j >= 0 && seqdesc.weight( j ) > 0.0 ) ? 1.0f : 0.0f;
+		}
+
+		int *pBones = (int*)stackalloc( ( nBoneCount + 3 ) * sizeof(int) );
+		int nBones = BuildSIMDBoneList( pWeights, nBoneCount, pBones );
+		fltx4 t = ReplicateX4( s1 );
+		for (i = 0; i < nBones; i += 4)
+		{
+			BoneQuaternions4_t q, qt;
+			q.Load( q1, &pBones[i] );
+			QuaternionIdentityBlendSoA( q, t, qt );
+			qt.Store( q1, &pBones[i] );
+		}
+
+		for (i = 0; i < nBones; i++)
+		{
+			VectorScale( pos1[ pBones[i] ], s2, pos1[ pBones[i] ] );
+		}
+		return;
+	}
+
 	for (i = 0; i < pStudioHdr->numbones(); i++)
 	{
 		// skip unused bones